@@ -25,25 +25,86 @@
 
 #define PNVL_HW_BAR0_IRQ_0_RAISE 0x00
 #define PNVL_HW_BAR0_IRQ_0_LOWER 0x08
-#define PNVL_HW_BAR0_DMA_CFG_LEN 0x10
-#define PNVL_HW_BAR0_DMA_CFG_PGS 0x18
-#define PNVL_HW_BAR0_DMA_CFG_MOD 0x20
-#define PNVL_HW_BAR0_DMA_CFG_LEN_AVAIL 0x28
-#define PNVL_HW_BAR0_DMA_DOORBELL_RING 0x30
-#define PNVL_HW_BAR0_DMA_HANDLES 0x38
+#define PNVL_HW_BAR0_DMA_CMD_DONE 0x10
+#define PNVL_HW_BAR0_DMA_CMD_STS 0x18
+/* Bytes a bulk send moves before queued latency sends may run, 0 for all */
+#define PNVL_HW_BAR0_DMA_CHUNK 0x20
+/* Register banks of the transmit (sends) and receive (receives) engines */
+#define PNVL_HW_BAR0_DMA_TX 0x100000
+#define PNVL_HW_BAR0_DMA_RX 0x200000
+
+/* Registers of a DMA engine bank, relative to the start of the bank */
+#define PNVL_HW_DMA_CFG_LEN 0x00
+#define PNVL_HW_DMA_CFG_PGS 0x08
+#define PNVL_HW_DMA_CFG_LEN_AVAIL 0x10 /* RX only */
+#define PNVL_HW_DMA_CFG_MATCH 0x18
+#define PNVL_HW_DMA_CMD_TAG 0x20
+#define PNVL_HW_DMA_CMD_FREE 0x28
+#define PNVL_HW_DMA_DOORBELL_RING 0x30
+#define PNVL_HW_DMA_CFG_DELTA 0x38 /* TX only, 1 if DIRTY is to be used */
+#define PNVL_HW_DMA_HANDLES 0x40
 /* 512 for a space of 2MB (if PAGE_SIZE is 4KB), or
  * 131072 (1MB) for a space of 512MB (if PAGE_SIZE is 4KB)
  * ... and 1 more if offset exists */
 #define PNVL_HW_BAR0_DMA_HANDLES_CNT (131072+1)
+/* TX only: one bit per handle, only set pages are sent by a delta */
+#define PNVL_HW_DMA_DIRTY 0x80080
+#define PNVL_HW_DMA_DIRTY_CNT ((PNVL_HW_BAR0_DMA_HANDLES_CNT + 31) / 32)
+/* TX only: 1 for a latency send, run before and in between bulk sends */
+#define PNVL_HW_DMA_CFG_PRIO 0x90000
+/*
+ * Keep the PGS handles written so far for the next command, so that one
+ * with more than HANDLES_CNT pages is programmed in several windows. The
+ * dirty map of a delta only covers the first window.
+ */
+#define PNVL_HW_DMA_CFG_APPEND 0x90008
+/*
+ * 1 if the handles are pairs of bus address and length of physically
+ * contiguous extents, of any size. PGS then counts both words of each.
+ */
+#define PNVL_HW_DMA_CFG_EXTENTS 0x90010
+/*
+ * TX only: 1 if the command carries its CFG_LEN bytes in the INLINE window
+ * instead of handles. The message reaches the peer as a single link
+ * message, without waiting for a receive to be posted there, and the send
+ * completes once a receive takes it, with EMSGSIZE if it did not fit.
+ * Past a small number of unmatched inline sends, the rest are announced
+ * and streamed like the others.
+ */
+#define PNVL_HW_DMA_CFG_INLINE 0x90018
+#define PNVL_HW_DMA_INLINE 0x91000
+#define PNVL_HW_DMA_INLINE_SIZE 0x100
+#define PNVL_HW_DMA_BANK_SIZE 0x100000
 
 #define PNVL_HW_BAR0_START PNVL_HW_BAR0_IRQ_0_RAISE
-#define PNVL_HW_BAR0_END \
-	(PNVL_HW_BAR0_DMA_HANDLES + 64 * PNVL_HW_BAR0_DMA_HANDLES_CNT)
+#define PNVL_HW_BAR0_END (PNVL_HW_BAR0_DMA_RX + PNVL_HW_DMA_BANK_SIZE)
+#define PNVL_HW_BAR0_SIZE 0x400000 /* power of two above the end */
 
 #define PNVL_HW_DMA_ADDR_CAPABILITY 32
 #define PNVL_HW_DMA_AREA_START (PNVL_HW_BAR0_END + 0x1000)
 #define PNVL_HW_DMA_AREA_SIZE 0x1000
 
+/* ============================================================================
+ * Command queue
+ * ============================================================================
+ */
+
+/* Commands each engine accepts before any of them has to complete */
+#define PNVL_HW_DMA_CMD_CNT 16
+/* Default of DMA_CHUNK */
+#define PNVL_HW_DMA_CHUNK_DEFAULT 0x100000
+/* Read from CMD_DONE when there are no completions left */
+#define PNVL_HW_DMA_CMD_NONE 0xffffffff
+
+/* Completion status, read from CMD_STS after popping a tag from CMD_DONE */
+#define PNVL_HW_DMA_STS_OK 0
+#define PNVL_HW_DMA_STS_EMSGSIZE 1
+#define PNVL_HW_DMA_STS_EIO 2
+#define PNVL_HW_DMA_STS_EBUSY 3 /* submitted with no free slot, not run */
+
+/* Receives posted with this match tag accept messages with any tag */
+#define PNVL_HW_DMA_MATCH_ANY 0xffffffff
+
 /* ============================================================================
  * IRQs
  * ============================================================================
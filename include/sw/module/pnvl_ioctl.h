@@ -6,12 +6,86 @@
 
 #pragma once
 
+/*
+ * Tag of an op, 64 bits wide in every submission so the flags above the
+ * 32-bit message tag are carried on any ABI.
+ */
+typedef unsigned long long pnvl_tag_t;
+
+/* Receives posted with this tag match messages sent with any tag */
+#define PNVL_TAG_ANY 0xffffffffULL
+/*
+ * Or'ed into the tag of an op to have it launched ahead of bulk ops, and a
+ * send run in between the chunks of a bulk send. It may then overtake
+ * bulk messages of the same tag.
+ */
+#define PNVL_PRIO_LATENCY (1ULL << 32)
+
 struct pnvl_data {
 	unsigned long addr;
 	unsigned long len;
+	pnvl_tag_t tag;
+};
+
+/* A user buffer to be pinned and mapped once, for REG_BUF */
+struct pnvl_reg {
+	unsigned long addr;
+	unsigned long len;
+};
+
+/* A slice of a registered buffer, for SEND_REG and RECV_REG */
+struct pnvl_reg_data {
+	unsigned long key;
+	unsigned long ofs;
+	unsigned long len;
+	pnvl_tag_t tag;
+};
+
+/*
+ * Payload of an io_uring command (IORING_OP_URING_CMD), whose cmd_op is
+ * PNVL_IOCTL_SEND, SEND_DELTA, RECV or WAIT. WAIT takes the handle in addr.
+ * The length goes in the len field of the SQE itself.
+ */
+struct pnvl_uring_cmd {
+	unsigned long long addr;
+	pnvl_tag_t tag;
+};
+
+/* A range of a regular file, for SEND_FILE and RECV_FILE */
+struct pnvl_file_data {
+	int fd;
+	unsigned long ofs;
+	unsigned long len;
+	pnvl_tag_t tag;
 };
 
 typedef unsigned long pnvl_handle_t;
+typedef unsigned long pnvl_key_t;
+
+/* One op of SUBMITV, or one handle of WAITV */
+struct pnvl_vec {
+	unsigned long cmd; // PNVL_IOCTL_SEND, SEND_DELTA or RECV
+	unsigned long addr;
+	unsigned long len;
+	pnvl_tag_t tag;
+	pnvl_handle_t id; // written by SUBMITV, negative on error
+	long retval; // written by WAITV
+};
+
+#define PNVL_VEC_MAX 64
+#define PNVL_WAIT_ANY 0x1 // WAITV returns once any op finished
+
+struct pnvl_vecs {
+	unsigned long vec; // struct pnvl_vec array
+	unsigned long cnt;
+	unsigned long flags;
+};
+
+/* An eventfd to be signalled when an op finishes, for NOTIFY */
+struct pnvl_notify {
+	pnvl_handle_t id;
+	int efd;
+};
 
 #define PNVL_IOCTL_MAGIC 0xe1
 
@@ -19,3 +93,56 @@ typedef unsigned long pnvl_handle_t;
 #define PNVL_IOCTL_RECV _IOW(PNVL_IOCTL_MAGIC, 2, struct pnvl_data *)
 #define PNVL_IOCTL_WAIT _IOW(PNVL_IOCTL_MAGIC, 3, pnvl_handle_t)
 #define PNVL_IOCTL_FLUSH _IO(PNVL_IOCTL_MAGIC, 4)
+/*
+ * Like SEND, but only pages changed since the last delta send of the same
+ * buffer cross the link. The receive must be posted on the buffer holding
+ * the copy of that previous send, since only the changed pages are patched.
+ * FLUSH forgets the delta sends of the calling process, the next is whole.
+ */
+#define PNVL_IOCTL_SEND_DELTA _IOW(PNVL_IOCTL_MAGIC, 5, struct pnvl_data *)
+/*
+ * REG_BUF returns a key for the buffer, valid on the same open file until
+ * UNREG_BUF or close. Sends and receives on it skip pinning and mapping.
+ */
+#define PNVL_IOCTL_REG_BUF _IOW(PNVL_IOCTL_MAGIC, 6, struct pnvl_reg *)
+#define PNVL_IOCTL_UNREG_BUF _IOW(PNVL_IOCTL_MAGIC, 7, pnvl_key_t)
+#define PNVL_IOCTL_SEND_REG _IOW(PNVL_IOCTL_MAGIC, 8, struct pnvl_reg_data *)
+#define PNVL_IOCTL_RECV_REG _IOW(PNVL_IOCTL_MAGIC, 9, struct pnvl_reg_data *)
+/*
+ * Besides NOTIFY, the device file polls readable once an op issued through
+ * it finishes, and read() returns the handles of finished ops.
+ */
+#define PNVL_IOCTL_NOTIFY _IOW(PNVL_IOCTL_MAGIC, 10, struct pnvl_notify *)
+/*
+ * SUBMITV returns how many ops it issued, WAITV the index of the op waited
+ * for with PNVL_WAIT_ANY and 0 otherwise. WAITV with PNVL_WAIT_ANY fails
+ * with EINVAL on an unknown handle, whose retval is then -EINVAL.
+ */
+#define PNVL_IOCTL_SUBMITV _IOW(PNVL_IOCTL_MAGIC, 11, struct pnvl_vecs *)
+#define PNVL_IOCTL_WAITV _IOW(PNVL_IOCTL_MAGIC, 12, struct pnvl_vecs *)
+/*
+ * SEND_FILE and RECV_FILE move a range of a file straight from and to its
+ * page cache, with no user buffer in between. RECV_FILE only writes files
+ * on tmpfs, memfds included, that are not sealed for writing, append-only
+ * or immutable. It cannot grow the file, the range must lie inside it, and
+ * data received into a range truncated meanwhile is discarded.
+ */
+#define PNVL_IOCTL_SEND_FILE _IOW(PNVL_IOCTL_MAGIC, 13, struct pnvl_file_data *)
+#define PNVL_IOCTL_RECV_FILE _IOW(PNVL_IOCTL_MAGIC, 14, struct pnvl_file_data *)
+/*
+ * EXPORT_BUF returns a dma-buf fd sharing a registered buffer with other
+ * drivers and processes. The buffer must start and end on a page boundary.
+ * IMPORT_BUF registers a dma-buf fd of another driver as a buffer,
+ * returning its key as REG_BUF does. Imported buffers cannot be exported,
+ * ops on them first wait for the fences of the other users.
+ */
+#define PNVL_IOCTL_EXPORT_BUF _IOW(PNVL_IOCTL_MAGIC, 15, pnvl_key_t)
+#define PNVL_IOCTL_IMPORT_BUF _IOW(PNVL_IOCTL_MAGIC, 16, int)
+/*
+ * SPIN caps, in microseconds, how long a WAIT on this file spins before it
+ * sleeps, 0 to always sleep. Spins are sized after how long recent waits
+ * had to wait, so waits on long ops sleep at once. PNVL_SPIN_DEFAULT
+ * follows the spin_max_us module parameter again.
+ */
+#define PNVL_SPIN_DEFAULT 0xffffffffUL
+#define PNVL_IOCTL_SPIN _IOW(PNVL_IOCTL_MAGIC, 17, unsigned long)
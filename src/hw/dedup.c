@@ -0,0 +1,180 @@
+/* dedup.c - Content-addressed dedup of link data frames
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "dedup.h"
+
+/* ============================================================================
+ * Private
+ * ============================================================================
+ */
+
+static void pnvl_dedup_digest(const uint8_t *buff, size_t len,
+		uint8_t *digest)
+{
+	GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+	gsize dlen = PNVL_DEDUP_DIGEST;
+
+	g_checksum_update(sum, buff, len);
+	g_checksum_get_digest(sum, digest, &dlen);
+	g_checksum_free(sum);
+}
+
+static inline uint32_t pnvl_dedup_index(DedupCache *cache,
+		const uint8_t *digest)
+{
+	uint32_t idx;
+
+	memcpy(&idx, digest, sizeof(idx));
+	return idx % cache->nentries;
+}
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+/*
+ * Sender side. Returns true if the peer already holds the frame at *slot.
+ * Otherwise *slot tells the peer where to keep it (PNVL_DEDUP_SLOT_NONE if
+ * dedup is off). Slots are 1-based. Nothing changes until the frame was
+ * sent, see pnvl_dedup_sent.
+ */
+bool pnvl_dedup_tx(DedupCache *cache, const uint8_t *buff, size_t len,
+		uint32_t *slot)
+{
+	DedupEntry *entry;
+	uint32_t idx;
+
+	*slot = PNVL_DEDUP_SLOT_NONE;
+	if (!cache->nentries || len > cache->frame_size)
+		return false;
+
+	pnvl_dedup_digest(buff, len, cache->digest);
+	idx = pnvl_dedup_index(cache, cache->digest);
+	entry = &cache->entries[idx];
+	*slot = idx + 1;
+
+	if (entry->valid && entry->len == len && !memcmp(entry->digest,
+				cache->digest, PNVL_DEDUP_DIGEST)) {
+		cache->hits++;
+		return true;
+	}
+
+	cache->misses++;
+	return false;
+}
+
+/*
+ * Sender side: a data frame (ref false) or a reference to slot made it to
+ * the socket. A data frame with a slot replaces the slot, as it does on the
+ * peer once received. A frame that failed is never accounted, so the slot
+ * keeps what the peer also still holds.
+ */
+void pnvl_dedup_sent(DedupCache *cache, uint32_t slot, const uint8_t *buff,
+		size_t len, bool ref)
+{
+	DedupEntry *entry;
+	uint8_t *data;
+
+	cache->seq++;
+	if (ref || slot == PNVL_DEDUP_SLOT_NONE || slot > cache->nentries)
+		return;
+
+	entry = &cache->entries[slot - 1];
+	data = cache->data + (slot - 1) * cache->frame_size;
+	if (data != buff)
+		memcpy(data, buff, len);
+	memcpy(entry->digest, cache->digest, PNVL_DEDUP_DIGEST);
+	entry->len = len;
+	entry->seq = cache->seq;
+	entry->valid = true;
+}
+
+/*
+ * Sender side: contents of a slot the peer missed when referred to by data
+ * frame seq, to be sent again as a data frame of that slot. NULL if the
+ * slot was filled again since, the data of that frame is then lost.
+ */
+uint8_t *pnvl_dedup_resend(DedupCache *cache, uint32_t slot, uint64_t seq,
+		size_t *len)
+{
+	DedupEntry *entry;
+
+	if (slot == PNVL_DEDUP_SLOT_NONE || slot > cache->nentries)
+		return NULL;
+
+	entry = &cache->entries[slot - 1];
+	if (!entry->valid || entry->seq > seq)
+		return NULL;
+
+	memcpy(cache->digest, entry->digest, PNVL_DEDUP_DIGEST);
+	*len = entry->len;
+	return cache->data + (slot - 1) * cache->frame_size;
+}
+
+/*
+ * Receiver side: keep a data frame the sender will refer to later.
+ */
+void pnvl_dedup_store(DedupCache *cache, uint32_t slot, const uint8_t *buff,
+		size_t len)
+{
+	DedupEntry *entry;
+
+	cache->seq++;
+	if (slot == PNVL_DEDUP_SLOT_NONE || slot > cache->nentries ||
+			len > cache->frame_size)
+		return;
+
+	entry = &cache->entries[slot - 1];
+	memcpy(cache->data + (slot - 1) * cache->frame_size, buff, len);
+	entry->len = len;
+	entry->seq = cache->seq;
+	entry->valid = true;
+}
+
+/*
+ * Receiver side: contents of a slot, or NULL if it was never filled. *seq
+ * is the number of the referring frame in the stream, for the sender to
+ * send the data again.
+ */
+uint8_t *pnvl_dedup_fetch(DedupCache *cache, uint32_t slot, size_t *len,
+		uint64_t *seq)
+{
+	DedupEntry *entry;
+
+	*seq = ++cache->seq;
+	if (slot == PNVL_DEDUP_SLOT_NONE || slot > cache->nentries)
+		return NULL;
+
+	entry = &cache->entries[slot - 1];
+	if (!entry->valid)
+		return NULL;
+
+	cache->hits++;
+	*len = entry->len;
+	return cache->data + (slot - 1) * cache->frame_size;
+}
+
+void pnvl_dedup_init(DedupCache *cache, uint32_t nentries, size_t frame_size)
+{
+	cache->nentries = nentries;
+	cache->frame_size = frame_size;
+	cache->seq = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->entries = nentries ? g_new0(DedupEntry, nentries) : NULL;
+	cache->data = nentries ? g_malloc(nentries * frame_size) : NULL;
+}
+
+void pnvl_dedup_fini(DedupCache *cache)
+{
+	g_free(cache->entries);
+	g_free(cache->data);
+	cache->entries = NULL;
+	cache->data = NULL;
+	cache->nentries = 0;
+}
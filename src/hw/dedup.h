@@ -0,0 +1,61 @@
+/* dedup.h - Content-addressed dedup of link data frames
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#ifndef PNVL_DEDUP_H
+#define PNVL_DEDUP_H
+
+#include "qemu/osdep.h"
+
+#define PNVL_DEDUP_DIGEST 32 /* SHA-256 */
+#define PNVL_DEDUP_SLOT_NONE 0 /* data frame not to be kept by the peer */
+
+/*
+ * Both ends of a stream keep a direct-mapped cache with the same number of
+ * entries, holding the contents of the frames last sent or received in
+ * each slot. Since a stream delivers frames in order and each cache is only
+ * touched by the thread serving its end of the stream, both stay in
+ * lockstep and a slot number is enough to refer to data the peer already
+ * holds. Both ends also number the data frames of the stream alike, so a
+ * reference the peer could not resolve can be named and sent again.
+ */
+typedef struct DedupEntry {
+	uint8_t digest[PNVL_DEDUP_DIGEST];
+	uint32_t len;
+	uint64_t seq; /* data frame that last filled the slot */
+	bool valid;
+} DedupEntry;
+
+typedef struct DedupCache {
+	uint32_t nentries;
+	DedupEntry *entries;
+	uint8_t *data; /* nentries frames */
+	size_t frame_size;
+	uint64_t seq; /* data frames through this end of the stream */
+	uint8_t digest[PNVL_DEDUP_DIGEST]; /* sender, of the frame being sent */
+	uint64_t hits;
+	uint64_t misses;
+} DedupCache;
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+bool pnvl_dedup_tx(DedupCache *cache, const uint8_t *buff, size_t len,
+		uint32_t *slot);
+void pnvl_dedup_sent(DedupCache *cache, uint32_t slot, const uint8_t *buff,
+		size_t len, bool ref);
+uint8_t *pnvl_dedup_resend(DedupCache *cache, uint32_t slot, uint64_t seq,
+		size_t *len);
+void pnvl_dedup_store(DedupCache *cache, uint32_t slot, const uint8_t *buff,
+		size_t len);
+uint8_t *pnvl_dedup_fetch(DedupCache *cache, uint32_t slot, size_t *len,
+		uint64_t *seq);
+
+void pnvl_dedup_init(DedupCache *cache, uint32_t nentries, size_t frame_size);
+void pnvl_dedup_fini(DedupCache *cache);
+
+#endif /* PNVL_DEDUP_H */
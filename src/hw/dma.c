@@ -7,6 +7,7 @@
 #include "qemu/osdep.h"
 #include "exec/target_page.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "pnvl.h"
 #include "dma.h"
 
@@ -17,7 +18,7 @@
 
 static inline dma_addr_t pnvl_dma_mask(DMAEngine *dma, dma_addr_t addr)
 {
-	dma_addr_t masked_addr = addr & dma->config.mask;
+	dma_addr_t masked_addr = addr & dma->mask;
 	if (masked_addr != addr) {
 		qemu_log_mask(LOG_GUEST_ERROR,
 				"masked_addr (%" PRIx64 ") != addr (%" PRIx64 ")",
@@ -32,25 +33,408 @@ static inline bool pnvl_dma_inside_dev_boundaries(dma_addr_t addr)
 			addr <= PNVL_HW_DMA_AREA_START + PNVL_HW_DMA_AREA_SIZE);
 }
 
-static inline void pnvl_dma_init_current(DMAEngine *dma)
+static inline bool pnvl_dma_matches(uint32_t want, uint32_t have)
 {
-	dma->current.len_left = dma->config.len;
-	dma->current.addr = dma->config.handles[0];
-	dma->current.hnd_pos = 0;
+	return want == PNVL_HW_DMA_MATCH_ANY || want == have;
 }
 
-static int pnvl_dma_read(PNVLDevice *dev, dma_addr_t addr, int len, int ofs)
+static void pnvl_dma_free_cmd(DMACommand *cmd)
 {
-	//printf("DMA RD: %d bytes @ %#010lx\n", len, addr);
-	return pci_dma_read(&dev->pci_dev, addr, dev->dma.buff + ofs, len);
+	g_free(cmd->inl);
+	g_free(cmd->config.handles);
+	g_free(cmd->config.ext_end);
+	g_free(cmd->config.dirty);
+	g_free(cmd);
 }
 
-static int pnvl_dma_write(PNVLDevice *dev, dma_addr_t addr, int len, int ofs)
+/*
+ * Bus address of byte ofs of the command buffer, and how many bytes are
+ * contiguous from there in *avail. Page handles are page sized, except the
+ * first one, which also carries the in-page offset. Extents are found by
+ * binary search of their end offsets.
+ */
+static bool pnvl_dma_locate(DMAEngine *dma, DMAConfig *cfg, dma_size_t ofs,
+		dma_addr_t *addr, dma_size_t *avail)
+{
+	dma_addr_t mask = cfg->page_size - 1;
+	dma_size_t idx, lo = 0, hi = cfg->npages, pos;
+
+	if (!cfg->ext_end) {
+		pos = (cfg->handles[0] & mask) + ofs;
+		idx = pos / cfg->page_size;
+		if (idx >= cfg->npages)
+			return false;
+		*addr = pnvl_dma_mask(dma, cfg->handles[idx] & ~mask) +
+			(pos & mask);
+		*avail = cfg->page_size - (pos & mask);
+		return true;
+	}
+
+	while (lo < hi) {
+		idx = lo + (hi - lo) / 2;
+		if (cfg->ext_end[idx] <= ofs)
+			lo = idx + 1;
+		else
+			hi = idx;
+	}
+	if (lo >= cfg->npages)
+		return false;
+
+	pos = ofs - (lo ? cfg->ext_end[lo - 1] : 0);
+	*addr = pnvl_dma_mask(dma, cfg->handles[lo] + pos);
+	*avail = cfg->ext_end[lo] - ofs;
+	return true;
+}
+
+/*
+ * Copy len bytes at offset ofs of the command buffer.
+ */
+static int pnvl_dma_rw(PNVLDevice *dev, DMACommand *cmd, dma_size_t ofs,
+		uint8_t *buff, size_t len, DMADirection dir)
+{
+	DMAConfig *cfg = &cmd->config;
+	dma_addr_t addr;
+	dma_size_t avail;
+	size_t chunk;
+	MemTxResult ret;
+
+	if (!cfg->npages)
+		return len ? PNVL_FAILURE : PNVL_SUCCESS;
+
+	while (len) {
+		if (!pnvl_dma_locate(&dev->dma, cfg, ofs, &addr, &avail))
+			return PNVL_FAILURE;
+		chunk = MIN(len, avail);
+
+		//printf("DMA %s: %zu bytes @ %#010lx\n",
+		//	dir == DMA_DIRECTION_TO_DEVICE ? "RD" : "WR", chunk, addr);
+		if (dir == DMA_DIRECTION_TO_DEVICE)
+			ret = pci_dma_read(&dev->pci_dev, addr, buff, chunk);
+		else
+			ret = pci_dma_write(&dev->pci_dev, addr, buff, chunk);
+		if (ret != MEMTX_OK)
+			return PNVL_FAILURE;
+
+		buff += chunk;
+		ofs += chunk;
+		len -= chunk;
+	}
+
+	return PNVL_SUCCESS;
+}
+
+/*
+ * Completions are signalled from the main loop, since the worker and the
+ * link threads do not hold the BQL.
+ */
+static void pnvl_dma_irq_bh(void *opaque)
+{
+	PNVLDevice *dev = opaque;
+	pnvl_irq_raise(dev, PNVL_HW_IRQ_WORK_ENDED_VECTOR);
+}
+
+static void pnvl_dma_push_done(DMAEngine *dma, uint32_t tag, int status,
+		DMAMode mode, bool slot)
+{
+	unsigned int tail;
+
+	/* dma->lock must be taken */
+	tail = (dma->done_head + dma->done_cnt) % DMA_DONE_CNT;
+	dma->done[tail].tag = tag;
+	dma->done[tail].status = status;
+	dma->done[tail].mode = mode;
+	dma->done[tail].slot = slot;
+	dma->done_cnt++;
+}
+
+static void pnvl_dma_complete(PNVLDevice *dev, DMACommand *cmd, int status)
+{
+	DMAEngine *dma = &dev->dma;
+
+	qemu_mutex_lock(&dma->lock);
+	pnvl_dma_push_done(dma, cmd->tag, status, cmd->mode, true);
+	qemu_mutex_unlock(&dma->lock);
+
+	pnvl_dma_free_cmd(cmd);
+	qemu_bh_schedule(dma->irq_bh);
+}
+
+/*
+ * Complete a command refused at submit, so its submitter is not left
+ * waiting. It took no slot. Refusals only use the half of the ring that
+ * accepted commands never need, a guest that floods it loses the rest.
+ */
+static void pnvl_dma_refuse(PNVLDevice *dev, DMAMode mode, uint32_t tag,
+		int status)
+{
+	DMAEngine *dma = &dev->dma;
+	bool full;
+
+	qemu_mutex_lock(&dma->lock);
+	full = dma->done_cnt >= DMA_DONE_CNT - 2 * PNVL_HW_DMA_CMD_CNT;
+	if (!full)
+		pnvl_dma_push_done(dma, tag, status, mode, false);
+	qemu_mutex_unlock(&dma->lock);
+
+	if (full)
+		qemu_log_mask(LOG_GUEST_ERROR, "no room to refuse tag %u\n",
+				tag);
+	else
+		qemu_bh_schedule(dma->irq_bh);
+}
+
+/*
+ * Bind a receive to an incoming message and tell the peer how much room it
+ * has. Only patch bytes of the message are sent, the rest of the buffer
+ * keeps what an earlier message left there. The receive is not in any list
+ * when called.
+ */
+static void pnvl_dma_bind(PNVLDevice *dev, DMACommand *cmd, uint32_t msg,
+		dma_size_t len, dma_size_t patch)
+{
+	DMAEngine *dma = &dev->dma;
+	bool fits = len <= cmd->config.len_avail;
+
+	cmd->msg = msg;
+	cmd->msg_len = len;
+	cmd->msg_patch = MIN(patch, len);
+	cmd->done_len = 0;
+
+	if (fits && cmd->msg_patch) {
+		qemu_mutex_lock(&dma->lock);
+		QTAILQ_INSERT_TAIL(&dma->bound, cmd, next);
+		qemu_mutex_unlock(&dma->lock);
+	}
+
+	pnvl_proxy_issue_req(dev, PNVL_REQ_RLN, cmd->match, msg,
+			cmd->config.len_avail);
+
+	if (!fits)
+		pnvl_dma_complete(dev, cmd, PNVL_HW_DMA_STS_EMSGSIZE);
+	else if (!cmd->msg_patch)
+		pnvl_dma_complete(dev, cmd, PNVL_HW_DMA_STS_OK);
+}
+
+/*
+ * Fill a receive with an inline message, and tell the peer how much room
+ * it had, which completes the send. The receive is not in any list when
+ * called.
+ */
+static void pnvl_dma_fill(PNVLDevice *dev, DMACommand *cmd, uint32_t msg,
+		uint8_t *buff, dma_size_t len)
+{
+	int status = PNVL_HW_DMA_STS_OK;
+
+	pnvl_proxy_issue_req(dev, PNVL_REQ_RLN, cmd->match, msg,
+			cmd->config.len_avail);
+
+	if (len > cmd->config.len_avail)
+		status = PNVL_HW_DMA_STS_EMSGSIZE;
+	else if (pnvl_dma_write(dev, cmd, 0, buff, len) != PNVL_SUCCESS)
+		status = PNVL_HW_DMA_STS_EIO;
+
+	pnvl_dma_complete(dev, cmd, status);
+}
+
+static void pnvl_dma_post(PNVLDevice *dev, DMACommand *cmd)
+{
+	DMAEngine *dma = &dev->dma;
+	DMAUnexpected *ue;
+
+	/* dma->lock must be taken, and is released */
+	QTAILQ_FOREACH(ue, &dma->unexpected, next) {
+		if (pnvl_dma_matches(cmd->match, ue->match))
+			break;
+	}
+
+	if (!ue) {
+		QTAILQ_INSERT_TAIL(&dma->posted, cmd, next);
+		qemu_mutex_unlock(&dma->lock);
+		return;
+	}
+
+	QTAILQ_REMOVE(&dma->unexpected, ue, next);
+	if (ue->data)
+		dma->inl_kept--;
+	qemu_mutex_unlock(&dma->lock);
+	if (ue->data)
+		pnvl_dma_fill(dev, cmd, ue->msg, ue->data, ue->len);
+	else
+		pnvl_dma_bind(dev, cmd, ue->msg, ue->len, ue->patch);
+	g_free(ue->data);
+	g_free(ue);
+}
+
+/* Oldest latency send, or else the oldest send. dma->lock must be taken */
+static DMACommand *pnvl_dma_next(DMAEngine *dma, bool prio_only)
 {
-	//printf("DMA WR: %d bytes @ %#010lx\n", len, addr);
-	return pci_dma_write(&dev->pci_dev, addr, dev->dma.buff + ofs, len);
+	DMACommand *cmd;
+
+	QTAILQ_FOREACH(cmd, &dma->pending, next) {
+		if (cmd->prio)
+			return cmd;
+	}
+	return prio_only ? NULL : QTAILQ_FIRST(&dma->pending);
 }
 
+/*
+ * Oldest announced latency send the peer replied to, or else the oldest
+ * announced send it replied to. dma->lock must be taken.
+ */
+static DMACommand *pnvl_dma_next_replied(DMAEngine *dma, bool prio_only)
+{
+	DMACommand *cmd, *first = NULL;
+
+	QTAILQ_FOREACH(cmd, &dma->waiting, next) {
+		if (!cmd->replied)
+			continue;
+		if (cmd->prio)
+			return cmd;
+		if (!first)
+			first = cmd;
+	}
+	return prio_only ? NULL : first;
+}
+
+/*
+ * Take a send off its list and start it, or stream it if the peer already
+ * replied to it. A send that was only announced goes to the waiting list
+ * until then, the others are completed. resume is the send the worker
+ * goes back to afterwards, if any. dma->lock must be taken, and is dropped
+ * meanwhile.
+ */
+static void pnvl_dma_run(PNVLDevice *dev, DMACommand *cmd,
+		DMACommand *resume)
+{
+	DMAEngine *dma = &dev->dma;
+	bool replied = cmd->announced;
+	int status;
+
+	if (cmd->announced)
+		QTAILQ_REMOVE(&dma->waiting, cmd, next);
+	else
+		QTAILQ_REMOVE(&dma->pending, cmd, next);
+	cmd->announced = false;
+	dma->active = cmd;
+	dma->nrunning++;
+	dma->status = DMA_STATUS_EXECUTING;
+	qemu_mutex_unlock(&dma->lock);
+
+	status = replied ? pnvl_stream(dev, cmd) : pnvl_execute(dev, cmd);
+
+	qemu_mutex_lock(&dma->lock);
+	dma->active = resume;
+	dma->nrunning--;
+	if (!resume)
+		dma->status = DMA_STATUS_IDLE;
+	if (status == DMA_STS_WAITING)
+		return;
+	if (cmd->announced) { /* could not be announced after all */
+		QTAILQ_REMOVE(&dma->waiting, cmd, next);
+		cmd->announced = false;
+		if (cmd->eager && !cmd->replied)
+			dma->inl_out--;
+	}
+	qemu_mutex_unlock(&dma->lock);
+
+	pnvl_dma_complete(dev, cmd, status);
+
+	qemu_mutex_lock(&dma->lock);
+}
+
+static void pnvl_dma_reset_staged(DMABank *bank)
+{
+	g_free(bank->staged);
+	bank->staged = NULL;
+	bank->nstaged = 0;
+}
+
+static void pnvl_dma_reset_bank(DMABank *bank)
+{
+	bank->tag = 0;
+	bank->match = PNVL_HW_DMA_MATCH_ANY;
+	bank->delta = 0;
+	bank->prio = 0;
+	bank->extents = 0;
+	bank->inl = 0;
+	memset(bank->inl_buf, 0, PNVL_HW_DMA_INLINE_SIZE);
+	pnvl_dma_reset_staged(bank);
+	bank->overrun = false;
+	memset(bank->dirty, 0, sizeof(uint32_t) * PNVL_HW_DMA_DIRTY_CNT);
+	bank->config.npages = 0;
+	bank->config.len = 0;
+	bank->config.len_avail = 0;
+	bank->config.page_size = qemu_target_page_size();
+	memset(bank->config.handles, 0,
+			sizeof(dma_addr_t) * PNVL_HW_BAR0_DMA_HANDLES_CNT);
+}
+
+/*
+ * Transmit engine. Receives need no thread of their own: they are driven
+ * by the frames the link delivers, so both directions run at once. Sends
+ * are announced as soon as they are queued and only streamed once the
+ * peer bound them to a receive, so a send whose receive is not posted yet
+ * does not hold up the ones behind it.
+ */
+static void *pnvl_dma_worker(void *opaque)
+{
+	PNVLDevice *dev = opaque;
+	DMAEngine *dma = &dev->dma;
+	DMACommand *cmd;
+
+	qemu_mutex_lock(&dma->lock);
+	while (!dma->stopping) {
+		cmd = pnvl_dma_next(dma, false);
+		if (!cmd)
+			cmd = pnvl_dma_next_replied(dma, false);
+		if (!cmd) {
+			qemu_cond_wait(&dma->cond, &dma->lock);
+			continue;
+		}
+		pnvl_dma_run(dev, cmd, NULL);
+	}
+	qemu_mutex_unlock(&dma->lock);
+
+	return NULL;
+}
+
+/*
+ * Pool thread: takes ranges of the active send and moves them, so the
+ * guest memory copies and the link I/O of a large send are spread over
+ * several host cores.
+ */
+static void *pnvl_dma_pool_thread(void *opaque)
+{
+	PNVLDevice *dev = opaque;
+	DMAEngine *dma = &dev->dma;
+	DMAJob *job;
+	int ret;
+
+	qemu_mutex_lock(&dma->lock);
+	for (;;) {
+		job = QSIMPLEQ_FIRST(&dma->jobs);
+		if (!job) {
+			if (dma->stopping)
+				break;
+			qemu_cond_wait(&dma->job_cond, &dma->lock);
+			continue;
+		}
+		QSIMPLEQ_REMOVE_HEAD(&dma->jobs, next);
+		qemu_mutex_unlock(&dma->lock);
+
+		ret = job->fn(dev, job->cmd, job->start, job->end);
+		g_free(job);
+
+		qemu_mutex_lock(&dma->lock);
+		if (ret != PNVL_SUCCESS)
+			dma->jobs_ret = PNVL_FAILURE;
+		if (!--dma->jobs_left)
+			qemu_cond_signal(&dma->job_done);
+	}
+	qemu_mutex_unlock(&dma->lock);
+
+	return NULL;
+}
 
 /* ============================================================================
  * Public
@@ -58,128 +442,637 @@ static int pnvl_dma_write(PNVLDevice *dev, dma_addr_t addr, int len, int ofs)
  */
 
 /*
- * Receive page: DMA buffer <-- RAM
+ * Read: DMA buffer <-- RAM
+ */
+int pnvl_dma_read(PNVLDevice *dev, DMACommand *cmd, dma_size_t ofs,
+		uint8_t *buff, size_t len)
+{
+	return pnvl_dma_rw(dev, cmd, ofs, buff, len, DMA_DIRECTION_TO_DEVICE);
+}
+
+/*
+ * Write: DMA buffer --> RAM
+ */
+int pnvl_dma_write(PNVLDevice *dev, DMACommand *cmd, dma_size_t ofs,
+		uint8_t *buff, size_t len)
+{
+	return pnvl_dma_rw(dev, cmd, ofs, buff, len, DMA_DIRECTION_FROM_DEVICE);
+}
+
+DMABank *pnvl_dma_bank(PNVLDevice *dev, DMAMode mode)
+{
+	return mode == DMA_MODE_ACTIVE ? &dev->dma.tx : &dev->dma.rx;
+}
+
+bool pnvl_dma_is_idle(PNVLDevice *dev)
+{
+	return qatomic_read(&dev->dma.status) == DMA_STATUS_IDLE;
+}
+
+/*
+ * Give a send a fresh link message id, so the peer's reply and the data
+ * frames can be told apart from other messages in flight.
  */
-int pnvl_dma_rx_page(PNVLDevice *dev)
+uint32_t pnvl_dma_new_msg(PNVLDevice *dev, DMACommand *cmd)
 {
 	DMAEngine *dma = &dev->dma;
-	unsigned long mask = pnvl_dma_mask(dma, dma->config.page_size - 1);
-	dma_addr_t addr = dma->current.addr;
-	size_t ofs, len_want, len_have;
 
-	ofs = addr & mask;
-	len_have = dma->config.page_size - ofs;
-	len_want = MIN(dma->config.page_size, dma->current.len_left);
+	qemu_mutex_lock(&dma->lock);
+	cmd->msg = dma->next_msg++;
+	cmd->msg_len = cmd->config.len;
+	cmd->replied = false;
+	qemu_mutex_unlock(&dma->lock);
 
-	if (len_want <= len_have) {
-		if (pnvl_dma_read(dev, addr, len_want, 0) < 0)
-			return PNVL_FAILURE;
-		addr += len_want;
-	} else {
-		if (pnvl_dma_read(dev, addr, len_have, 0) < 0)
-			return PNVL_FAILURE;
-		addr = dma->config.handles[++dma->current.hnd_pos];
+	return cmd->msg;
+}
 
-		if (pnvl_dma_read(dev, addr, len_want-len_have, len_have) < 0)
-			return PNVL_FAILURE;
-		addr += len_want - len_have;
-	}
+/*
+ * Have the reply to the message of a send found by pnvl_dma_reply, which
+ * hands the send back to the worker. Must be called before the message is
+ * announced.
+ */
+void pnvl_dma_await(PNVLDevice *dev, DMACommand *cmd)
+{
+	DMAEngine *dma = &dev->dma;
 
-	dma->current.addr = addr;
-	dma->current.len_left -= len_want;
-	return len_want;
+	qemu_mutex_lock(&dma->lock);
+	cmd->announced = true;
+	QTAILQ_INSERT_TAIL(&dma->waiting, cmd, next);
+	qemu_mutex_unlock(&dma->lock);
 }
 
 /*
- * Transmit page: DMA buffer --> RAM
+ * Take one of the inline messages the peer keeps until a receive matches
+ * them, which the reply gives back. Without one, the send is announced
+ * and streamed like any other, so a receiver that falls behind does not
+ * buffer an unbounded number of them.
  */
-int pnvl_dma_tx_page(PNVLDevice *dev, int len_want)
+bool pnvl_dma_take_credit(PNVLDevice *dev, DMACommand *cmd)
 {
 	DMAEngine *dma = &dev->dma;
-	unsigned long mask = pnvl_dma_mask(dma, dma->config.page_size - 1);
-	dma_addr_t addr = dma->current.addr;
-	size_t ofs, len_have;
 
-	ofs = addr & mask;
-	len_have = dma->config.page_size - ofs;
+	qemu_mutex_lock(&dma->lock);
+	cmd->eager = dma->inl_out < DMA_INLINE_CREDIT;
+	if (cmd->eager)
+		dma->inl_out++;
+	qemu_mutex_unlock(&dma->lock);
+
+	return cmd->eager;
+}
 
-	if (len_want == PNVL_FAILURE)
+/*
+ * Move [start, end) of a send with fn. Large ranges are cut into page
+ * aligned ranges, one per pool thread, and this returns once all of them
+ * are done, so the command still completes (and interrupts) only once.
+ */
+int pnvl_dma_split(PNVLDevice *dev, DMACommand *cmd, dma_size_t start,
+		dma_size_t end, DMARangeFn fn)
+{
+	DMAEngine *dma = &dev->dma;
+	dma_size_t len = end - start;
+	dma_size_t ofs, step;
+	DMAJob *job;
+	int ret;
+
+	if (!dma->pool || len < DMA_SPLIT_MIN)
+		return fn(dev, cmd, start, end);
+
+	step = DIV_ROUND_UP(len, cmd->config.page_size);
+	step = DIV_ROUND_UP(step, dma->nworkers) * cmd->config.page_size;
+
+	qemu_mutex_lock(&dma->lock);
+	if (dma->stopping) {
+		qemu_mutex_unlock(&dma->lock);
 		return PNVL_FAILURE;
+	}
+	dma->jobs_ret = PNVL_SUCCESS;
+	for (ofs = start; ofs < end; ofs += step) {
+		job = g_new0(DMAJob, 1);
+		job->cmd = cmd;
+		job->fn = fn;
+		job->start = ofs;
+		job->end = MIN(ofs + step, end);
+		QSIMPLEQ_INSERT_TAIL(&dma->jobs, job, next);
+		dma->jobs_left++;
+	}
+	qemu_cond_broadcast(&dma->job_cond);
+	while (dma->jobs_left)
+		qemu_cond_wait(&dma->job_done, &dma->lock);
+	ret = dma->jobs_ret;
+	qemu_mutex_unlock(&dma->lock);
 
-	if (len_want <= len_have) {
-		if (pnvl_dma_write(dev, addr, len_want, 0) < 0)
-			return PNVL_FAILURE;
-		addr += len_want;
+	return ret;
+}
+
+/*
+ * Bytes of a send to move before giving latency sends a chance to run, in
+ * whole pages. Latency sends themselves are never cut.
+ */
+dma_size_t pnvl_dma_chunk(PNVLDevice *dev, DMACommand *cmd)
+{
+	dma_size_t chunk = qatomic_read(&dev->dma.chunk);
+
+	if (cmd->prio || !chunk)
+		return cmd->config.len;
+	return ROUND_UP(chunk, cmd->config.page_size);
+}
+
+/*
+ * Announce the sends queued while the worker was busy with a bulk send,
+ * and stream the latency sends the peer already bound to a receive. The
+ * bulk send then resumes. Their messages may overtake the bulk one.
+ * Latency sends still waiting for their receive are left to the worker.
+ */
+void pnvl_dma_yield(PNVLDevice *dev, DMACommand *cmd)
+{
+	DMAEngine *dma = &dev->dma;
+	DMACommand *next;
+
+	qemu_mutex_lock(&dma->lock);
+	while (!dma->stopping && ((next = pnvl_dma_next(dma, false)) ||
+				(next = pnvl_dma_next_replied(dma, true))))
+		pnvl_dma_run(dev, next, cmd);
+	qemu_mutex_unlock(&dma->lock);
+}
+
+/*
+ * Whether [ofs, ofs + len) of a send touches a page marked in its dirty
+ * map. Sends without one are sent whole.
+ */
+bool pnvl_dma_is_dirty(DMACommand *cmd, dma_size_t ofs, size_t len)
+{
+	DMAConfig *cfg = &cmd->config;
+	dma_size_t first, last, pg;
+
+	if (!cfg->dirty || !cfg->npages)
+		return true;
+
+	first = ((cfg->handles[0] & (cfg->page_size - 1)) + ofs) /
+		cfg->page_size;
+	last = ((cfg->handles[0] & (cfg->page_size - 1)) + ofs + len - 1) /
+		cfg->page_size;
+	for (pg = first; pg <= last && pg < PNVL_HW_DMA_DIRTY_CNT * 32; pg++) {
+		if (cfg->dirty[pg / 32] & (1U << (pg % 32)))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Bytes of a send that actually cross the link, in page sized frames.
+ */
+dma_size_t pnvl_dma_patch_len(DMACommand *cmd)
+{
+	dma_size_t ofs, patch = 0;
+	size_t len;
+
+	if (!cmd->config.dirty)
+		return cmd->config.len;
+
+	for (ofs = 0; ofs < cmd->config.len; ofs += len) {
+		len = MIN(cmd->config.page_size, cmd->config.len - ofs);
+		if (pnvl_dma_is_dirty(cmd, ofs, len))
+			patch += len;
+	}
+
+	return patch;
+}
+
+/*
+ * The peer bound a message to a receive with len_avail bytes of room. Its
+ * send is streamed by the worker, or failed if it does not fit.
+ */
+void pnvl_dma_reply(PNVLDevice *dev, uint32_t msg, dma_size_t len_avail)
+{
+	DMAEngine *dma = &dev->dma;
+	DMACommand *cmd;
+
+	qemu_mutex_lock(&dma->lock);
+	QTAILQ_FOREACH(cmd, &dma->waiting, next) {
+		if (cmd->msg == msg && !cmd->replied) {
+			cmd->reply = len_avail;
+			cmd->replied = true;
+			if (cmd->eager)
+				dma->inl_out--;
+			qemu_cond_signal(&dma->cond);
+			break;
+		}
+	}
+	qemu_mutex_unlock(&dma->lock);
+}
+
+/*
+ * Oldest posted receive with a tag compatible with an incoming message,
+ * taken out of the posted list. If there is none, the message is kept
+ * until one is posted, with a copy of the payload of an inline one. A peer
+ * that sends more inline messages than its credit allows has the excess
+ * refused as too long for the receive.
+ */
+static DMACommand *pnvl_dma_match(PNVLDevice *dev, uint32_t match,
+		uint32_t msg, dma_size_t len, dma_size_t patch, uint8_t *buff)
+{
+	DMAEngine *dma = &dev->dma;
+	DMAUnexpected *ue;
+	DMACommand *cmd;
+
+	qemu_mutex_lock(&dma->lock);
+	QTAILQ_FOREACH(cmd, &dma->posted, next) {
+		if (pnvl_dma_matches(cmd->match, match))
+			break;
+	}
+
+	if (cmd) {
+		QTAILQ_REMOVE(&dma->posted, cmd, next);
+	} else if (buff && dma->inl_kept >= DMA_INLINE_CREDIT) {
+		qemu_mutex_unlock(&dma->lock);
+		qemu_log_mask(LOG_GUEST_ERROR, "too many inline messages, "
+				"msg %u\n", msg);
+		pnvl_proxy_issue_req(dev, PNVL_REQ_RLN, match, msg, 0);
+		return NULL;
 	} else {
-		if (pnvl_dma_write(dev, addr, len_have, 0) < 0)
-			return PNVL_FAILURE;
-		addr = dma->config.handles[++dma->current.hnd_pos];
+		ue = g_new0(DMAUnexpected, 1);
+		ue->match = match;
+		ue->msg = msg;
+		ue->len = len;
+		ue->patch = patch;
+		ue->data = buff ? g_memdup2(buff, len) : NULL;
+		if (buff)
+			dma->inl_kept++;
+		QTAILQ_INSERT_TAIL(&dma->unexpected, ue, next);
+	}
+	qemu_mutex_unlock(&dma->lock);
 
-		if (pnvl_dma_write(dev, addr, len_want-len_have, len_have) < 0)
-			return PNVL_FAILURE;
-		addr += len_want - len_have;
+	return cmd;
+}
+
+/*
+ * The peer wants to send a message: bind it to the oldest posted receive
+ * with a compatible tag, or keep it until one is posted.
+ */
+void pnvl_dma_incoming(PNVLDevice *dev, uint32_t match, uint32_t msg,
+		dma_size_t len, dma_size_t patch)
+{
+	DMACommand *cmd = pnvl_dma_match(dev, match, msg, len, patch, NULL);
+
+	if (cmd)
+		pnvl_dma_bind(dev, cmd, msg, len, patch);
+}
+
+/*
+ * The peer sent a whole message inline: fill the oldest posted receive
+ * with a compatible tag, or keep it until one is posted.
+ */
+void pnvl_dma_incoming_inline(PNVLDevice *dev, uint32_t match, uint32_t msg,
+		uint8_t *buff, dma_size_t len)
+{
+	DMACommand *cmd = pnvl_dma_match(dev, match, msg, len, len, buff);
+
+	if (cmd)
+		pnvl_dma_fill(dev, cmd, msg, buff, len);
+}
+
+/*
+ * Place a data frame of a message into the receive bound to it. Frames for
+ * unknown messages (e.g. rejected for size) are dropped. Frames can arrive
+ * on several link streams at once, so the receive is only completed, even
+ * on error, by the frame that accounts for its last byte. A NULL buff is a
+ * frame whose data was lost, which fails the receive.
+ */
+void pnvl_dma_deliver(PNVLDevice *dev, uint32_t msg, dma_size_t ofs,
+		uint8_t *buff, size_t len)
+{
+	DMAEngine *dma = &dev->dma;
+	DMACommand *cmd;
+	dma_size_t done;
+	int status;
+
+	qemu_mutex_lock(&dma->lock);
+	QTAILQ_FOREACH(cmd, &dma->bound, next) {
+		if (cmd->msg == msg)
+			break;
 	}
+	qemu_mutex_unlock(&dma->lock);
 
-	dma->current.addr = addr;
-	dma->current.len_left -= len_want;
-	return PNVL_SUCCESS;
+	if (!cmd || ofs + len > cmd->msg_len)
+		return;
+
+	if (!buff || pnvl_dma_write(dev, cmd, ofs, buff, len) != PNVL_SUCCESS)
+		qatomic_set(&cmd->failed, true);
+
+	done = qatomic_add_fetch(&cmd->done_len, len);
+	if (done < cmd->msg_patch)
+		return;
+	status = qatomic_read(&cmd->failed) ?
+		PNVL_HW_DMA_STS_EIO : PNVL_HW_DMA_STS_OK;
+
+	qemu_mutex_lock(&dma->lock);
+	QTAILQ_REMOVE(&dma->bound, cmd, next);
+	qemu_mutex_unlock(&dma->lock);
+	pnvl_dma_complete(dev, cmd, status);
 }
 
-int pnvl_dma_begin_run(PNVLDevice *dev)
+/*
+ * Keep the window of handles written so far for the next command, which
+ * takes them before those of its last window.
+ */
+void pnvl_dma_append(PNVLDevice *dev, DMAMode mode)
 {
-	DMAStatus status;
+	DMABank *bank = pnvl_dma_bank(dev, mode);
+	dma_size_t npages = bank->config.npages;
 
-	pnvl_dma_init_current(&dev->dma);
-	status = qatomic_cmpxchg(&dev->dma.status, DMA_STATUS_IDLE,
-			DMA_STATUS_EXECUTING);
-	if (status == DMA_STATUS_EXECUTING)
-		return PNVL_FAILURE;
+	if (npages > PNVL_HW_BAR0_DMA_HANDLES_CNT) {
+		qemu_log_mask(LOG_GUEST_ERROR, "too many handles (%" PRIu64 ")\n",
+				npages);
+		bank->overrun = true;
+		return;
+	}
 
-	return PNVL_SUCCESS;
+	bank->staged = g_renew(dma_addr_t, bank->staged,
+			bank->nstaged + npages);
+	memcpy(bank->staged + bank->nstaged, bank->config.handles,
+			npages * sizeof(dma_addr_t));
+	bank->nstaged += npages;
+}
+
+/*
+ * Turn the (address, length) pairs of an extents command into a handle
+ * and the end offset of each extent.
+ */
+static bool pnvl_dma_set_extents(DMAConfig *cfg)
+{
+	dma_size_t i, n = cfg->npages / 2, end = 0;
+
+	if (cfg->npages % 2)
+		return false;
+
+	cfg->ext_end = g_new(dma_size_t, n);
+	for (i = 0; i < n; i++) {
+		cfg->handles[i] = cfg->handles[2 * i];
+		end += cfg->handles[2 * i + 1];
+		cfg->ext_end[i] = end;
+	}
+	cfg->npages = n;
+	return true;
 }
 
-void pnvl_dma_end_run(PNVLDevice *dev)
+/* Pages a send spans, which its dirty map must cover */
+static dma_size_t pnvl_dma_span(DMAConfig *cfg)
 {
-	qatomic_set(&dev->dma.status, DMA_STATUS_IDLE);
+	if (!cfg->npages)
+		return 0;
+	return DIV_ROUND_UP((cfg->handles[0] & (cfg->page_size - 1)) +
+			cfg->len, cfg->page_size);
 }
 
-void pnvl_dma_add_handle(PNVLDevice *dev, dma_addr_t handle)
+/*
+ * Snapshot the staging configuration of an engine into a new command.
+ * Sends are queued for the worker, receives are posted for matching. The
+ * bank can be reprogrammed as soon as this returns. Commands that cannot
+ * be run complete at once with an error.
+ */
+void pnvl_dma_submit(PNVLDevice *dev, DMAMode mode)
 {
 	DMAEngine *dma = &dev->dma;
-	dma_addr_t new_hnd = pnvl_dma_mask(dma, handle);
-	dma->config.handles[dma->config.npages++] = new_hnd;
+	DMABank *bank = pnvl_dma_bank(dev, mode);
+	dma_size_t nstaged = bank->nstaged;
+	DMACommand *cmd;
+
+	if (bank->config.npages > PNVL_HW_BAR0_DMA_HANDLES_CNT ||
+			bank->overrun) {
+		qemu_log_mask(LOG_GUEST_ERROR, "too many handles, tag %u\n",
+				bank->tag);
+		pnvl_dma_reset_staged(bank);
+		bank->overrun = false;
+		pnvl_dma_refuse(dev, mode, bank->tag,
+				PNVL_HW_DMA_STS_EMSGSIZE);
+		return;
+	}
+
+	cmd = g_new0(DMACommand, 1);
+	cmd->tag = bank->tag;
+	cmd->match = bank->match;
+	cmd->mode = mode;
+	cmd->prio = mode == DMA_MODE_ACTIVE && bank->prio;
+	if (mode == DMA_MODE_ACTIVE && bank->inl) {
+		if (bank->config.len > PNVL_HW_DMA_INLINE_SIZE) {
+			qemu_log_mask(LOG_GUEST_ERROR, "inline send too long, "
+					"tag %u\n", cmd->tag);
+			pnvl_dma_refuse(dev, mode, cmd->tag,
+					PNVL_HW_DMA_STS_EMSGSIZE);
+			g_free(cmd);
+			pnvl_dma_reset_staged(bank);
+			return;
+		}
+		cmd->inl = g_memdup2(bank->inl_buf, bank->config.len);
+	}
+	cmd->config = bank->config;
+	cmd->config.npages = nstaged + bank->config.npages;
+	cmd->config.handles = g_new(dma_addr_t, cmd->config.npages);
+	if (nstaged)
+		memcpy(cmd->config.handles, bank->staged,
+				nstaged * sizeof(dma_addr_t));
+	memcpy(cmd->config.handles + nstaged, bank->config.handles,
+			bank->config.npages * sizeof(dma_addr_t));
+	pnvl_dma_reset_staged(bank);
+	cmd->config.ext_end = NULL;
+	cmd->config.dirty = NULL;
+	if (bank->extents && !pnvl_dma_set_extents(&cmd->config)) {
+		qemu_log_mask(LOG_GUEST_ERROR, "odd extent words, tag %u\n",
+				cmd->tag);
+		pnvl_dma_refuse(dev, mode, cmd->tag, PNVL_HW_DMA_STS_EMSGSIZE);
+		pnvl_dma_free_cmd(cmd);
+		return;
+	}
+	if (mode == DMA_MODE_ACTIVE && bank->delta &&
+			pnvl_dma_span(&cmd->config) <= PNVL_HW_BAR0_DMA_HANDLES_CNT)
+		cmd->config.dirty = g_memdup2(bank->dirty,
+				sizeof(uint32_t) * PNVL_HW_DMA_DIRTY_CNT);
+
+	qemu_mutex_lock(&dma->lock);
+	if (bank->nused >= PNVL_HW_DMA_CMD_CNT) {
+		qemu_mutex_unlock(&dma->lock);
+		qemu_log_mask(LOG_GUEST_ERROR, "command queue full, tag %u\n",
+				cmd->tag);
+		pnvl_dma_refuse(dev, mode, cmd->tag, PNVL_HW_DMA_STS_EBUSY);
+		pnvl_dma_free_cmd(cmd);
+		return;
+	}
+	bank->nused++;
+
+	if (cmd->mode == DMA_MODE_PASSIVE) {
+		pnvl_dma_post(dev, cmd);
+		return;
+	}
+
+	QTAILQ_INSERT_TAIL(&dma->pending, cmd, next);
+	qemu_cond_signal(&dma->cond);
+	qemu_mutex_unlock(&dma->lock);
 }
 
-bool pnvl_dma_is_idle(PNVLDevice *dev)
+/*
+ * Pop the oldest completion. Its status is latched for CMD_STS.
+ */
+uint32_t pnvl_dma_pop_done(PNVLDevice *dev)
 {
-	return qatomic_read(&dev->dma.status) == DMA_STATUS_IDLE;
+	DMAEngine *dma = &dev->dma;
+	DMACompletion *done;
+	uint32_t tag = PNVL_HW_DMA_CMD_NONE;
+
+	qemu_mutex_lock(&dma->lock);
+	if (dma->done_cnt) {
+		done = &dma->done[dma->done_head];
+		tag = done->tag;
+		dma->done_status = done->status;
+		dma->done_head = (dma->done_head + 1) % DMA_DONE_CNT;
+		dma->done_cnt--;
+		if (done->slot)
+			pnvl_dma_bank(dev, done->mode)->nused--;
+	}
+	qemu_mutex_unlock(&dma->lock);
+
+	return tag;
 }
 
-bool pnvl_dma_is_finished(PNVLDevice *dev)
+uint32_t pnvl_dma_free_slots(PNVLDevice *dev, DMAMode mode)
 {
-	return !dev->dma.current.len_left;
+	DMAEngine *dma = &dev->dma;
+	uint32_t nfree;
+
+	qemu_mutex_lock(&dma->lock);
+	nfree = PNVL_HW_DMA_CMD_CNT - pnvl_dma_bank(dev, mode)->nused;
+	qemu_mutex_unlock(&dma->lock);
+
+	return nfree;
 }
 
+/*
+ * Queued, announced and posted commands are dropped. The sends the worker
+ * is running and receives already bound to a message finish on their own.
+ */
 void pnvl_dma_reset(PNVLDevice *dev)
 {
 	DMAEngine *dma = &dev->dma;
-	dma->status = DMA_STATUS_IDLE;
-	dma->config.npages = 0;
-	dma->config.len = 0;
-	dma->config.page_size = qemu_target_page_size();
-	memset(dma->buff, 0, PNVL_HW_DMA_AREA_SIZE);
-	memset(dma->config.handles, 0,
-			sizeof(dma_addr_t) * PNVL_HW_BAR0_DMA_HANDLES_CNT);
+	DMAUnexpected *ue;
+	DMACommand *cmd, *tmp;
+
+	qemu_mutex_lock(&dma->lock);
+	while ((cmd = QTAILQ_FIRST(&dma->pending))) {
+		QTAILQ_REMOVE(&dma->pending, cmd, next);
+		pnvl_dma_free_cmd(cmd);
+	}
+	QTAILQ_FOREACH_SAFE(cmd, &dma->waiting, next, tmp) {
+		if (cmd == dma->active) /* being announced */
+			continue;
+		QTAILQ_REMOVE(&dma->waiting, cmd, next);
+		pnvl_dma_free_cmd(cmd);
+	}
+	while ((cmd = QTAILQ_FIRST(&dma->posted))) {
+		QTAILQ_REMOVE(&dma->posted, cmd, next);
+		pnvl_dma_free_cmd(cmd);
+	}
+	while ((ue = QTAILQ_FIRST(&dma->unexpected))) {
+		QTAILQ_REMOVE(&dma->unexpected, ue, next);
+		g_free(ue->data);
+		g_free(ue);
+	}
+	dma->inl_kept = 0;
+	dma->inl_out = 0;
+	QTAILQ_FOREACH(cmd, &dma->waiting, next) {
+		if (cmd->eager && !cmd->replied)
+			dma->inl_out++;
+	}
+	dma->tx.nused = dma->nrunning;
+	dma->rx.nused = 0;
+	QTAILQ_FOREACH(cmd, &dma->bound, next)
+		dma->rx.nused++;
+	dma->done_head = 0;
+	dma->done_cnt = 0;
+	dma->done_status = PNVL_HW_DMA_STS_OK;
+	dma->chunk = PNVL_HW_DMA_CHUNK_DEFAULT;
+	qemu_mutex_unlock(&dma->lock);
+
+	pnvl_dma_reset_bank(&dma->tx);
+	pnvl_dma_reset_bank(&dma->rx);
 }
 
 void pnvl_dma_init(PNVLDevice *dev, Error **errp)
 {
+	DMAEngine *dma = &dev->dma;
+	unsigned int i;
+
+	dma->tx.config.handles = g_new0(dma_addr_t,
+			PNVL_HW_BAR0_DMA_HANDLES_CNT);
+	dma->rx.config.handles = g_new0(dma_addr_t,
+			PNVL_HW_BAR0_DMA_HANDLES_CNT);
+	dma->tx.dirty = g_new0(uint32_t, PNVL_HW_DMA_DIRTY_CNT);
+	dma->rx.dirty = g_new0(uint32_t, PNVL_HW_DMA_DIRTY_CNT);
+	dma->mask = DMA_BIT_MASK(PNVL_HW_DMA_ADDR_CAPABILITY);
+	dma->tx.config.mask = dma->mask;
+	dma->rx.config.mask = dma->mask;
+	dma->status = DMA_STATUS_IDLE;
+	dma->active = NULL;
+	dma->nrunning = 0;
+	dma->next_msg = 0;
+	dma->stopping = false;
+	QTAILQ_INIT(&dma->pending);
+	QTAILQ_INIT(&dma->waiting);
+	QTAILQ_INIT(&dma->posted);
+	QTAILQ_INIT(&dma->bound);
+	QTAILQ_INIT(&dma->unexpected);
+	QSIMPLEQ_INIT(&dma->jobs);
+	dma->jobs_left = 0;
+	qemu_mutex_init(&dma->lock);
+	qemu_cond_init(&dma->cond);
+	qemu_cond_init(&dma->job_cond);
+	qemu_cond_init(&dma->job_done);
+	dma->irq_bh = qemu_bh_new(pnvl_dma_irq_bh, dev);
 	pnvl_dma_reset(dev);
-	dev->dma.config.mask = DMA_BIT_MASK(PNVL_HW_DMA_ADDR_CAPABILITY);
+
+	qemu_thread_create(&dma->worker, "pnvl-dma", pnvl_dma_worker, dev,
+			QEMU_THREAD_JOINABLE);
+
+	dma->nworkers = MAX(1, MIN(dma->nworkers, DMA_WORKERS_MAX));
+	dma->pool = NULL;
+	if (dma->nworkers == 1)
+		return;
+	dma->pool = g_new0(QemuThread, dma->nworkers);
+	for (i = 0; i < dma->nworkers; i++)
+		qemu_thread_create(&dma->pool[i], "pnvl-dma-pool",
+				pnvl_dma_pool_thread, dev,
+				QEMU_THREAD_JOINABLE);
 }
 
 void pnvl_dma_fini(PNVLDevice *dev)
 {
+	DMAEngine *dma = &dev->dma;
+	DMACommand *cmd;
+	unsigned int i;
+
+	qemu_mutex_lock(&dma->lock);
+	dma->stopping = true;
+	qemu_cond_signal(&dma->cond);
+	qemu_cond_broadcast(&dma->job_cond);
+	qemu_mutex_unlock(&dma->lock);
+	/* the pool drains the jobs of the active send before leaving */
+	qemu_thread_join(&dma->worker);
+	for (i = 0; dma->pool && i < dma->nworkers; i++)
+		qemu_thread_join(&dma->pool[i]);
+	g_free(dma->pool);
+
 	pnvl_dma_reset(dev);
-	dev->dma.status = DMA_STATUS_OFF;
+	while ((cmd = QTAILQ_FIRST(&dma->bound))) {
+		QTAILQ_REMOVE(&dma->bound, cmd, next);
+		pnvl_dma_free_cmd(cmd);
+	}
+	qemu_bh_delete(dma->irq_bh);
+	qemu_cond_destroy(&dma->job_done);
+	qemu_cond_destroy(&dma->job_cond);
+	qemu_cond_destroy(&dma->cond);
+	qemu_mutex_destroy(&dma->lock);
+	g_free(dma->tx.config.handles);
+	g_free(dma->rx.config.handles);
+	g_free(dma->tx.dirty);
+	g_free(dma->rx.dirty);
+	dma->status = DMA_STATUS_OFF;
 }
@@ -9,9 +9,19 @@
 
 #include "qemu/osdep.h"
 #include "hw/pci/pci.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
 #include "pnvl_hw.h"
 
 #define DMA_BIT_MASK(n) (((n) == 64) ? ~0ULL : ((1ULL << (n)) - 1))
+/* completions of both engines, and as many of commands refused at submit */
+#define DMA_DONE_CNT (4 * PNVL_HW_DMA_CMD_CNT)
+#define DMA_WORKERS 1 /* default number of threads moving a send */
+#define DMA_WORKERS_MAX 16
+#define DMA_SPLIT_MIN (256 * KiB) /* smaller sends are not split */
+#define DMA_STS_WAITING (-1) /* announced, streamed once the peer replies */
+#define DMA_INLINE_CREDIT 16 /* inline messages kept before a receive matches */
 
 /* forward declaration */
 typedef struct PNVLDevice PNVLDevice;
@@ -25,15 +35,11 @@ typedef struct DMAConfig {
 	dma_size_t len_avail;
 	dma_mask_t mask;
 	size_t page_size;
-	dma_addr_t handles[PNVL_HW_BAR0_DMA_HANDLES_CNT];
+	dma_addr_t *handles;
+	dma_size_t *ext_end; /* offset past each extent, NULL for pages */
+	uint32_t *dirty; /* pages a delta sends, NULL to send them all */
 } DMAConfig;
 
-typedef struct DMACurrent {
-	dma_size_t len_left;
-	dma_addr_t addr;
-	int hnd_pos;
-} DMACurrent;
-
 typedef enum DMAStatus {
 	DMA_STATUS_IDLE,
 	DMA_STATUS_EXECUTING,
@@ -45,12 +51,107 @@ typedef enum DMAMode {
 	DMA_MODE_PASSIVE,
 } DMAMode;
 
-typedef struct DMAEngine {
-	DMAConfig config;
-	DMACurrent current;
-	DMAStatus status;
+typedef struct DMACommand {
+	uint32_t tag; /* command tag, reported on completion */
+	uint32_t match; /* message tag, PNVL_HW_DMA_MATCH_ANY for receives */
 	DMAMode mode;
-	uint8_t buff[PNVL_HW_DMA_AREA_SIZE];
+	uint32_t prio; /* latency send, may run between chunks of bulk ones */
+	uint8_t *inl; /* payload of an inline send, NULL otherwise */
+	bool eager; /* sent with its payload, the reply only completes it */
+	DMAConfig config;
+	uint32_t msg; /* link message this command sends or is bound to */
+	dma_size_t msg_len;
+	dma_size_t msg_patch; /* bytes the message carries, less for a delta */
+	dma_size_t done_len;
+	bool failed; /* a data frame could not be written */
+	dma_size_t reply; /* length the peer accepted (sends only) */
+	bool replied;
+	bool announced; /* in the waiting list, see pnvl_dma_await */
+	QTAILQ_ENTRY(DMACommand) next;
+} DMACommand;
+
+/* A message announced by the peer before a receive matched it */
+typedef struct DMAUnexpected {
+	uint32_t match;
+	uint32_t msg;
+	dma_size_t len;
+	dma_size_t patch;
+	uint8_t *data; /* payload of an inline message, NULL otherwise */
+	QTAILQ_ENTRY(DMAUnexpected) next;
+} DMAUnexpected;
+
+/* Moves the [start, end) bytes of a command */
+typedef int (*DMARangeFn)(PNVLDevice *dev, DMACommand *cmd, dma_size_t start,
+		dma_size_t end);
+
+/* A range of a send handed to the worker pool */
+typedef struct DMAJob {
+	DMACommand *cmd;
+	DMARangeFn fn;
+	dma_size_t start;
+	dma_size_t end;
+	QSIMPLEQ_ENTRY(DMAJob) next;
+} DMAJob;
+
+typedef struct DMACompletion {
+	uint32_t tag;
+	uint32_t status;
+	DMAMode mode; /* engine the command ran on */
+	bool slot; /* it took a slot, false if refused at submit */
+} DMACompletion;
+
+/*
+ * Registers of one engine. Sends are programmed through the transmit bank
+ * and receives through the receive bank, so both can be staged at once.
+ */
+typedef struct DMABank {
+	DMAConfig config; /* staging area, written through MMIO */
+	uint32_t tag;
+	uint32_t match;
+	uint32_t delta;
+	uint32_t prio;
+	uint32_t extents;
+	uint32_t inl;
+	uint8_t inl_buf[PNVL_HW_DMA_INLINE_SIZE]; /* INLINE window */
+	uint32_t *dirty;
+	dma_addr_t *staged; /* handles of earlier windows, see CFG_APPEND */
+	dma_size_t nstaged;
+	bool overrun; /* a window was refused, so is the next command */
+	unsigned int nused; /* slots taken by queued or unreaped commands */
+} DMABank;
+
+typedef struct DMAEngine {
+	DMABank tx;
+	DMABank rx;
+	dma_mask_t mask;
+	DMAStatus status; /* of the transmit engine */
+	DMACommand *active; /* send being executed by the worker */
+	unsigned int nrunning; /* sends the worker took off the lists */
+	dma_size_t chunk; /* DMA_CHUNK register */
+	QTAILQ_HEAD(, DMACommand) pending; /* sends waiting for the worker */
+	QTAILQ_HEAD(, DMACommand) waiting; /* sends waiting for the peer */
+	QTAILQ_HEAD(, DMACommand) posted; /* receives waiting for a message */
+	QTAILQ_HEAD(, DMACommand) bound; /* receives matched to a message */
+	QTAILQ_HEAD(, DMAUnexpected) unexpected;
+	unsigned int inl_out; /* eager sends the peer has not matched yet */
+	unsigned int inl_kept; /* inline messages in the unexpected list */
+	uint32_t next_msg;
+	DMACompletion done[DMA_DONE_CNT];
+	unsigned int done_head;
+	unsigned int done_cnt;
+	uint32_t done_status;
+	QemuThread worker;
+	uint32_t nworkers;
+	QemuThread *pool; /* nworkers threads when splitting, else NULL */
+	QSIMPLEQ_HEAD(, DMAJob) jobs;
+	unsigned int jobs_left; /* ranges of the active send not done yet */
+	int jobs_ret;
+	QemuMutex lock;
+	QemuCond cond; /* sends were queued or replied to */
+	QemuCond job_cond; /* jobs were queued */
+	QemuCond job_done; /* the last job finished */
+	QEMUBH *irq_bh;
+	bool stopping;
 } DMAEngine;
 
 /* ============================================================================
@@ -58,14 +159,35 @@ typedef struct DMAEngine {
  * ============================================================================
  */
 
-int pnvl_dma_rx_page(PNVLDevice *dev);
-int pnvl_dma_tx_page(PNVLDevice *dev, int len_want);
+int pnvl_dma_read(PNVLDevice *dev, DMACommand *cmd, dma_size_t ofs,
+		uint8_t *buff, size_t len);
+int pnvl_dma_write(PNVLDevice *dev, DMACommand *cmd, dma_size_t ofs,
+		uint8_t *buff, size_t len);
 
-int pnvl_dma_begin_run(PNVLDevice *dev);
-void pnvl_dma_end_run(PNVLDevice *dev);
-void pnvl_dma_add_handle(PNVLDevice *dev, dma_addr_t handle);
+DMABank *pnvl_dma_bank(PNVLDevice *dev, DMAMode mode);
 bool pnvl_dma_is_idle(PNVLDevice *dev);
-bool pnvl_dma_is_finished(PNVLDevice *dev);
+
+uint32_t pnvl_dma_new_msg(PNVLDevice *dev, DMACommand *cmd);
+void pnvl_dma_await(PNVLDevice *dev, DMACommand *cmd);
+bool pnvl_dma_take_credit(PNVLDevice *dev, DMACommand *cmd);
+int pnvl_dma_split(PNVLDevice *dev, DMACommand *cmd, dma_size_t start,
+		dma_size_t end, DMARangeFn fn);
+dma_size_t pnvl_dma_chunk(PNVLDevice *dev, DMACommand *cmd);
+void pnvl_dma_yield(PNVLDevice *dev, DMACommand *cmd);
+bool pnvl_dma_is_dirty(DMACommand *cmd, dma_size_t ofs, size_t len);
+dma_size_t pnvl_dma_patch_len(DMACommand *cmd);
+void pnvl_dma_reply(PNVLDevice *dev, uint32_t msg, dma_size_t len_avail);
+void pnvl_dma_incoming(PNVLDevice *dev, uint32_t match, uint32_t msg,
+		dma_size_t len, dma_size_t patch);
+void pnvl_dma_incoming_inline(PNVLDevice *dev, uint32_t match, uint32_t msg,
+		uint8_t *buff, dma_size_t len);
+void pnvl_dma_deliver(PNVLDevice *dev, uint32_t msg, dma_size_t ofs,
+		uint8_t *buff, size_t len);
+
+void pnvl_dma_append(PNVLDevice *dev, DMAMode mode);
+void pnvl_dma_submit(PNVLDevice *dev, DMAMode mode);
+uint32_t pnvl_dma_pop_done(PNVLDevice *dev);
+uint32_t pnvl_dma_free_slots(PNVLDevice *dev, DMAMode mode);
 
 void pnvl_dma_reset(PNVLDevice *dev);
 void pnvl_dma_init(PNVLDevice *dev, Error **errp);
@@ -0,0 +1,135 @@
+/* link.c - Modeled link bandwidth and latency
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "link.h"
+#include "pnvl.h"
+
+/* ============================================================================
+ * Private
+ * ============================================================================
+ */
+
+static inline int64_t pnvl_link_now(PNVLLink *link)
+{
+	return qemu_clock_get_ns(link->clock);
+}
+
+/*
+ * The virtual clock only advances while the VM runs, so the wait is done in
+ * small host sleeps and re-checked against the selected clock.
+ */
+static void pnvl_link_sleep_until(PNVLLink *link, int64_t deadline)
+{
+	int64_t now;
+
+	while ((now = pnvl_link_now(link)) < deadline)
+		g_usleep(MAX((deadline - now) / SCALE_US, 1));
+}
+
+static void pnvl_link_refill(PNVLLink *link, int64_t now)
+{
+	double earned = (double)(now - link->last) * link->bandwidth /
+		NANOSECONDS_PER_SECOND;
+
+	link->tokens = MIN(link->tokens + earned, PNVL_LINK_BURST);
+	link->last = now;
+}
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+/*
+ * Token bucket pacer: every transmitted byte costs a token, and tokens are
+ * earned at the modeled bandwidth up to PNVL_LINK_BURST.
+ */
+void pnvl_link_pace_tx(PNVLDevice *dev, size_t len)
+{
+	PNVLLink *link = &dev->link;
+	int64_t now, deadline;
+
+	if (!link->bandwidth || !len)
+		return;
+
+	qemu_mutex_lock(&link->lock);
+	now = pnvl_link_now(link);
+	pnvl_link_refill(link, now);
+	link->tokens -= len;
+	deadline = now;
+	if (link->tokens < 0)
+		deadline += (int64_t)(-link->tokens * NANOSECONDS_PER_SECOND /
+				link->bandwidth);
+	qemu_mutex_unlock(&link->lock);
+
+	pnvl_link_sleep_until(link, deadline);
+}
+
+/*
+ * Time before which a frame queued now must not leave: the latency, plus a
+ * random jitter in [0, jitter] nanoseconds. Every frame is stamped when it
+ * is queued, data frames included, and held until then by the thread that
+ * sends it. Frames queued back to back are thus all delayed, but still
+ * leave back to back, as on a pipelined link.
+ */
+int64_t pnvl_link_stamp(PNVLDevice *dev)
+{
+	PNVLLink *link = &dev->link;
+	int64_t delay = link->latency;
+
+	if (link->jitter)
+		delay += (int64_t)(g_random_double() * link->jitter);
+
+	return delay > 0 ? pnvl_link_now(link) + delay : 0;
+}
+
+void pnvl_link_delay(PNVLDevice *dev, int64_t due)
+{
+	if (due > 0)
+		pnvl_link_sleep_until(&dev->link, due);
+}
+
+char *pnvl_link_get_clock(Object *obj, Error **errp)
+{
+	PNVLDevice *dev = PNVL(obj);
+	return g_strdup(dev->link.clock == QEMU_CLOCK_VIRTUAL ?
+			"virtual" : "host");
+}
+
+void pnvl_link_set_clock(Object *obj, const char *clock, Error **errp)
+{
+	PNVLDevice *dev = PNVL(obj);
+
+	if (!strcmp(clock, "virtual"))
+		dev->link.clock = QEMU_CLOCK_VIRTUAL;
+	else if (!strcmp(clock, "host"))
+		dev->link.clock = QEMU_CLOCK_REALTIME;
+	else
+		error_setg(errp, "link_clock must be 'host' or 'virtual'");
+}
+
+void pnvl_link_reset(PNVLDevice *dev)
+{
+	PNVLLink *link = &dev->link;
+
+	qemu_mutex_lock(&link->lock);
+	link->tokens = PNVL_LINK_BURST;
+	link->last = pnvl_link_now(link);
+	qemu_mutex_unlock(&link->lock);
+}
+
+void pnvl_link_init(PNVLDevice *dev, Error **errp)
+{
+	qemu_mutex_init(&dev->link.lock);
+	pnvl_link_reset(dev);
+}
+
+void pnvl_link_fini(PNVLDevice *dev)
+{
+	qemu_mutex_destroy(&dev->link.lock);
+}
@@ -0,0 +1,45 @@
+/* link.h - Modeled link bandwidth and latency
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#ifndef PNVL_LINK_H
+#define PNVL_LINK_H
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+
+#define PNVL_LINK_BURST (64 * 1024) /* token bucket depth, in bytes */
+
+/* Forward declaration */
+typedef struct PNVLDevice PNVLDevice;
+
+typedef struct PNVLLink {
+	uint64_t bandwidth; /* bytes per second, 0 means unlimited */
+	uint64_t latency; /* nanoseconds per frame */
+	uint64_t jitter; /* max. extra nanoseconds per frame */
+	QEMUClockType clock;
+	QemuMutex lock;
+	double tokens;
+	int64_t last;
+} PNVLLink;
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+void pnvl_link_pace_tx(PNVLDevice *dev, size_t len);
+int64_t pnvl_link_stamp(PNVLDevice *dev);
+void pnvl_link_delay(PNVLDevice *dev, int64_t due);
+
+char *pnvl_link_get_clock(Object *obj, Error **errp);
+void pnvl_link_set_clock(Object *obj, const char *clock, Error **errp);
+
+void pnvl_link_reset(PNVLDevice *dev);
+void pnvl_link_init(PNVLDevice *dev, Error **errp);
+void pnvl_link_fini(PNVLDevice *dev);
+
+#endif /* PNVL_LINK_H */
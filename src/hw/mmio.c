@@ -7,6 +7,7 @@
 #include "qemu/osdep.h"
 #include "exec/target_page.h"
 #include "qapi/error.h"
+#include "qemu/bswap.h"
 #include "qemu/log.h"
 #include "qemu/units.h"
 #include "mmio.h"
@@ -20,49 +21,168 @@
 
 static inline bool pnvl_mmio_valid_access(hwaddr addr, unsigned int size)
 {
-	return (PNVL_HW_BAR0_START <= addr && addr <= PNVL_HW_BAR0_END);
+	return (PNVL_HW_BAR0_START <= addr && addr < PNVL_HW_BAR0_END);
+}
+
+/*
+ * Find the engine bank an address falls in and turn the address into a
+ * register offset inside it. Returns NULL for the global registers.
+ */
+static DMABank *pnvl_mmio_bank(PNVLDevice *dev, hwaddr *addr, DMAMode *mode)
+{
+	if (*addr >= PNVL_HW_BAR0_DMA_RX) {
+		*addr -= PNVL_HW_BAR0_DMA_RX;
+		*mode = DMA_MODE_PASSIVE;
+	} else if (*addr >= PNVL_HW_BAR0_DMA_TX) {
+		*addr -= PNVL_HW_BAR0_DMA_TX;
+		*mode = DMA_MODE_ACTIVE;
+	} else {
+		return NULL;
+	}
+
+	return pnvl_dma_bank(dev, *mode);
 }
 
 static inline int pnvl_mmio_handle_pos(hwaddr addr)
 {
-	return ((addr - PNVL_HW_BAR0_DMA_HANDLES) / sizeof(uint32_t));
+	return ((addr - PNVL_HW_DMA_HANDLES) / sizeof(uint32_t));
 }
 
-static void pnvl_mmio_write_handle(DMAEngine *dma, hwaddr addr, uint64_t hnd)
+static void pnvl_mmio_write_handle(DMABank *bank, hwaddr addr, uint64_t hnd)
 {
 	int pos = pnvl_mmio_handle_pos(addr);
 
-	if (pos >= dma->config.npages || !dma->config.handles)
+	if (addr < PNVL_HW_DMA_HANDLES || pos >= bank->config.npages ||
+			pos >= PNVL_HW_BAR0_DMA_HANDLES_CNT ||
+			!bank->config.handles)
 		return;
 
-	dma->config.handles[pos] = hnd;
+	bank->config.handles[pos] = hnd;
 	printf("+ %#010lx at %#06lx (pos=%d)\n", hnd, addr, pos);
 }
 
+static void pnvl_mmio_write_dirty(DMABank *bank, hwaddr addr, uint64_t val)
+{
+	hwaddr pos = (addr - PNVL_HW_DMA_DIRTY) / sizeof(uint32_t);
+
+	if (pos < PNVL_HW_DMA_DIRTY_CNT && bank->dirty)
+		bank->dirty[pos] = val;
+}
+
+/* Payload of an inline send, as the guest lays it out in memory */
+static void pnvl_mmio_write_inline(DMABank *bank, hwaddr addr, uint64_t val,
+		unsigned int size)
+{
+	hwaddr pos = addr - PNVL_HW_DMA_INLINE;
+
+	if (pos + size <= PNVL_HW_DMA_INLINE_SIZE)
+		stn_le_p(bank->inl_buf + pos, size, val);
+}
+
+static uint64_t pnvl_mmio_read_bank(PNVLDevice *dev, DMABank *bank,
+		DMAMode mode, hwaddr addr)
+{
+	switch(addr) {
+	case PNVL_HW_DMA_CFG_LEN:
+		return bank->config.len;
+	case PNVL_HW_DMA_CFG_PGS:
+		return bank->config.npages;
+	case PNVL_HW_DMA_CFG_LEN_AVAIL:
+		return bank->config.len_avail;
+	case PNVL_HW_DMA_CFG_MATCH:
+		return bank->match;
+	case PNVL_HW_DMA_CMD_TAG:
+		return bank->tag;
+	case PNVL_HW_DMA_CMD_FREE:
+		return pnvl_dma_free_slots(dev, mode);
+	case PNVL_HW_DMA_CFG_DELTA:
+		return bank->delta;
+	case PNVL_HW_DMA_CFG_PRIO:
+		return bank->prio;
+	case PNVL_HW_DMA_CFG_EXTENTS:
+		return bank->extents;
+	case PNVL_HW_DMA_CFG_INLINE:
+		return bank->inl;
+	}
+
+	return ~0ULL;
+}
+
+static void pnvl_mmio_write_bank(PNVLDevice *dev, DMABank *bank,
+		DMAMode mode, hwaddr addr, uint64_t val, unsigned int size)
+{
+	switch(addr) {
+	case PNVL_HW_DMA_CFG_LEN:
+		bank->config.len = val;
+		break;
+	case PNVL_HW_DMA_CFG_PGS:
+		bank->config.npages = val;
+		break;
+	case PNVL_HW_DMA_CFG_LEN_AVAIL:
+		bank->config.len_avail = val;
+		break;
+	case PNVL_HW_DMA_CFG_MATCH:
+		bank->match = val;
+		break;
+	case PNVL_HW_DMA_CMD_TAG:
+		bank->tag = val;
+		break;
+	case PNVL_HW_DMA_DOORBELL_RING:
+		pnvl_dma_submit(dev, mode);
+		break;
+	case PNVL_HW_DMA_CFG_DELTA:
+		bank->delta = mode == DMA_MODE_ACTIVE && val;
+		break;
+	case PNVL_HW_DMA_CFG_PRIO:
+		bank->prio = mode == DMA_MODE_ACTIVE && val;
+		break;
+	case PNVL_HW_DMA_CFG_APPEND:
+		pnvl_dma_append(dev, mode);
+		break;
+	case PNVL_HW_DMA_CFG_EXTENTS:
+		bank->extents = !!val;
+		break;
+	case PNVL_HW_DMA_CFG_INLINE:
+		bank->inl = mode == DMA_MODE_ACTIVE && val;
+		break;
+	case PNVL_HW_DMA_CMD_FREE:
+		break;
+	default: /* DMA handles, dirty map and inline areas */
+		if (addr >= PNVL_HW_DMA_INLINE)
+			pnvl_mmio_write_inline(bank, addr, val, size);
+		else if (addr >= PNVL_HW_DMA_DIRTY)
+			pnvl_mmio_write_dirty(bank, addr, val);
+		else
+			pnvl_mmio_write_handle(bank, addr, val);
+		break;
+	}
+}
+
 static uint64_t pnvl_mmio_read(void *opaque, hwaddr addr, unsigned int size)
 {
 	PNVLDevice *dev = opaque;
 	uint64_t val = ~0ULL;
+	DMABank *bank;
+	DMAMode mode;
 
 	if (!pnvl_mmio_valid_access(addr, size))
 		goto mmio_read_end;
 
+	bank = pnvl_mmio_bank(dev, &addr, &mode);
+	if (bank) {
+		val = pnvl_mmio_read_bank(dev, bank, mode, addr);
+		goto mmio_read_end;
+	}
+
 	switch(addr) {
-	case PNVL_HW_BAR0_DMA_CFG_LEN:
-		val = dev->dma.config.len;
-		break;
-	case PNVL_HW_BAR0_DMA_CFG_PGS:
-		val = dev->dma.config.npages;
+	case PNVL_HW_BAR0_DMA_CMD_DONE:
+		val = pnvl_dma_pop_done(dev);
 		break;
-	case PNVL_HW_BAR0_DMA_CFG_MOD:
-		val = dev->dma.mode;
+	case PNVL_HW_BAR0_DMA_CMD_STS:
+		val = dev->dma.done_status;
 		break;
-	case PNVL_HW_BAR0_DMA_CFG_LEN_AVAIL:
-		if (dev->dma.mode == DMA_MODE_ACTIVE) {
-			pnvl_proxy_issue_req(dev, PNVL_REQ_SLN);
-			pnvl_proxy_await_req(dev, PNVL_REQ_RLN);
-		}
-		val = dev->dma.config.len_avail;
+	case PNVL_HW_BAR0_DMA_CHUNK:
+		val = qatomic_read(&dev->dma.chunk);
 		break;
 	}
 
@@ -74,13 +194,17 @@ static void pnvl_mmio_write(void *opaque, hwaddr addr, uint64_t val,
 				unsigned int size)
 {
 	PNVLDevice *dev = opaque;
-	DMAEngine *dma = &dev->dma;
+	DMABank *bank;
+	DMAMode mode;
 
 	if (!pnvl_mmio_valid_access(addr, size))
 		return;
 
-	if (!pnvl_dma_is_idle(dev))
+	bank = pnvl_mmio_bank(dev, &addr, &mode);
+	if (bank) {
+		pnvl_mmio_write_bank(dev, bank, mode, addr, val, size);
 		return;
+	}
 
 	switch(addr) {
 	case PNVL_HW_BAR0_IRQ_0_RAISE:
@@ -89,23 +213,8 @@ static void pnvl_mmio_write(void *opaque, hwaddr addr, uint64_t val,
 	case PNVL_HW_BAR0_IRQ_0_LOWER:
 		pnvl_irq_lower(dev, 0);
 		break;
-	case PNVL_HW_BAR0_DMA_CFG_LEN:
-		dma->config.len = val;
-		break;
-	case PNVL_HW_BAR0_DMA_CFG_PGS:
-		dma->config.npages = val;
-		break;
-	case PNVL_HW_BAR0_DMA_CFG_MOD:
-		dma->mode = val > 0 ? DMA_MODE_ACTIVE : DMA_MODE_PASSIVE;
-		break;
-	case PNVL_HW_BAR0_DMA_CFG_LEN_AVAIL:
-		dma->config.len_avail = val;
-		break;
-	case PNVL_HW_BAR0_DMA_DOORBELL_RING:
-		pnvl_execute(dev);
-		break;
-	default: /* DMA handles area */
-		pnvl_mmio_write_handle(dma, addr, val);
+	case PNVL_HW_BAR0_DMA_CHUNK:
+		qatomic_set(&dev->dma.chunk, val);
 		break;
 	}
 }
@@ -123,7 +232,7 @@ void pnvl_mmio_reset(PNVLDevice *dev)
 void pnvl_mmio_init(PNVLDevice *dev, Error **errp)
 {
 	memory_region_init_io(&dev->mmio, OBJECT(dev), &pnvl_mmio_ops, dev,
-			"pnvl-mmio", qemu_target_page_size());
+			"pnvl-mmio", PNVL_HW_BAR0_SIZE);
 
 	pci_register_bar(&dev->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY,
 			&dev->mmio);
@@ -8,6 +8,7 @@
 #include "pnvl_hw.h"
 #include "dma.h"
 #include "irq.h"
+#include "link.h"
 #include "mmio.h"
 #include "proxy.h"
 #include "qom/object.h"
@@ -23,6 +24,7 @@ static void pnvl_device_init(PCIDevice *pci_dev, Error **errp)
 	pnvl_irq_init(dev, errp);
 	pnvl_dma_init(dev, errp);
 	pnvl_mmio_init(dev, errp);
+	pnvl_link_init(dev, errp);
 	pnvl_proxy_init(dev, errp);
 }
 
@@ -30,9 +32,10 @@ static void pnvl_device_fini(PCIDevice *pci_dev)
 {
 	PNVLDevice *dev = PNVL_DEVICE(pci_dev);
 	pnvl_irq_fini(dev);
+	pnvl_proxy_fini(dev);
 	pnvl_dma_fini(dev);
 	pnvl_mmio_fini(dev);
-	pnvl_proxy_fini(dev);
+	pnvl_link_fini(dev);
 }
 
 static void pnvl_device_reset(DeviceState *dev_st)
@@ -41,6 +44,7 @@ static void pnvl_device_reset(DeviceState *dev_st)
 	pnvl_irq_reset(dev);
 	pnvl_dma_reset(dev);
 	pnvl_mmio_reset(dev);
+	pnvl_link_reset(dev);
 	pnvl_proxy_reset(dev);
 }
 
@@ -77,6 +81,38 @@ static void pnvl_instance_init(Object *obj)
 	dev->proxy.port = PNVL_PROXY_PORT;
 	object_property_add_uint16_ptr(obj, "port", &dev->proxy.port,
 				OBJ_PROP_FLAG_READWRITE);
+
+	dev->dma.nworkers = DMA_WORKERS;
+	object_property_add_uint32_ptr(obj, "dma_workers", &dev->dma.nworkers,
+				OBJ_PROP_FLAG_READWRITE);
+
+	dev->proxy.streams = PNVL_PROXY_STREAMS;
+	object_property_add_uint32_ptr(obj, "streams", &dev->proxy.streams,
+				OBJ_PROP_FLAG_READWRITE);
+
+	dev->proxy.dedup = 0;
+	object_property_add_uint32_ptr(obj, "dedup", &dev->proxy.dedup,
+				OBJ_PROP_FLAG_READWRITE);
+
+	dev->proxy.lanes = PNVL_PROXY_LANES;
+	object_property_add_uint32_ptr(obj, "lanes", &dev->proxy.lanes,
+				OBJ_PROP_FLAG_READWRITE);
+
+	dev->link.bandwidth = 0;
+	object_property_add_uint64_ptr(obj, "bandwidth", &dev->link.bandwidth,
+				OBJ_PROP_FLAG_READWRITE);
+
+	dev->link.latency = 0;
+	object_property_add_uint64_ptr(obj, "latency", &dev->link.latency,
+				OBJ_PROP_FLAG_READWRITE);
+
+	dev->link.jitter = 0;
+	object_property_add_uint64_ptr(obj, "jitter", &dev->link.jitter,
+				OBJ_PROP_FLAG_READWRITE);
+
+	dev->link.clock = QEMU_CLOCK_REALTIME;
+	object_property_add_str(obj, "link_clock", pnvl_link_get_clock,
+				pnvl_link_set_clock);
 }
 
 /* ============================================================================
@@ -108,40 +144,75 @@ type_init(pnvl_register_types)
  * ============================================================================
  */
 
-static void pnvl_transfer_pages(PNVLDevice *dev)
+/*
+ * Read a range of a send from guest memory and stream it in page sized
+ * data frames. Each page is read straight into the buffer of its frame,
+ * which the link frees once sent. Ranges of one send may run on different
+ * threads.
+ */
+static int pnvl_transfer_range(PNVLDevice *dev, DMACommand *cmd,
+		dma_size_t start, dma_size_t end)
+{
+	dma_size_t ofs;
+	int ret = PNVL_SUCCESS, len;
+	uint8_t *buff;
+
+	for (ofs = start; ofs < end && ret != PNVL_FAILURE; ofs += len) {
+		len = MIN(cmd->config.page_size, end - ofs);
+		if (!pnvl_dma_is_dirty(cmd, ofs, len))
+			continue;
+		buff = g_malloc(len);
+		ret = pnvl_dma_read(dev, cmd, ofs, buff, len);
+		if (ret != PNVL_FAILURE)
+			ret = pnvl_proxy_tx_data(dev, cmd->msg, ofs, buff, len);
+		else
+			g_free(buff);
+	}
+
+	return ret;
+}
+
+/*
+ * Announce the message. A delta only streams its dirty pages, and tells
+ * the peer how many bytes that is. The worker streams the data once the
+ * peer bound the message to a receive.
+ */
+static int pnvl_transfer_pages(PNVLDevice *dev, DMACommand *cmd)
 {
-	int ret, len;
+	uint32_t msg;
 
-	printf("(TX) beginning - %lu\n", dev->dma.config.len);
-	if (pnvl_dma_begin_run(dev) < 0)
-		return;
+	msg = pnvl_dma_new_msg(dev, cmd);
+	printf("(TX) announcing - msg %u, tag %u, %lu bytes\n", msg,
+			cmd->match, cmd->config.len);
 
-	do {
-		//printf("%lu bytes left\n", dev->dma.current.len_left);
-		len = pnvl_dma_rx_page(dev);
-		ret = pnvl_proxy_tx_page(dev, dev->dma.buff, len);
-	} while (ret != PNVL_FAILURE && !pnvl_dma_is_finished(dev));
+	pnvl_dma_await(dev, cmd);
+	if (pnvl_proxy_issue_sln(dev, cmd->match, msg, cmd->config.len,
+				pnvl_dma_patch_len(cmd)) != PNVL_SUCCESS)
+		return PNVL_HW_DMA_STS_EIO;
 
-	pnvl_dma_end_run(dev);
-	printf("(TX) finished - %d\n", ret);
+	return DMA_STS_WAITING;
 }
 
-static void pnvl_receive_pages(PNVLDevice *dev)
+/*
+ * An inline send is a single link message carrying its payload, sent
+ * without waiting for the peer to bind it to a receive. It still completes
+ * with the reply, which tells whether the receive had room for it. Once
+ * the peer keeps as many as it may, inline sends are announced instead.
+ */
+static int pnvl_transfer_inline(PNVLDevice *dev, DMACommand *cmd)
 {
-	int ret, len;
+	uint32_t msg;
 
-	printf("(RX) beginning - %lu\n", dev->dma.config.len);
-	if (pnvl_dma_begin_run(dev) < 0)
-		return;
+	if (!pnvl_dma_take_credit(dev, cmd))
+		return pnvl_transfer_pages(dev, cmd);
 
-	do {
-		//printf("%lu bytes left\n", dev->dma.current.len_left);
-		len = pnvl_proxy_rx_page(dev, dev->dma.buff);
-		ret = pnvl_dma_tx_page(dev, len);
-	} while (ret != PNVL_FAILURE && !pnvl_dma_is_finished(dev));
+	msg = pnvl_dma_new_msg(dev, cmd);
+	pnvl_dma_await(dev, cmd);
+	if (pnvl_proxy_issue_inl(dev, cmd->match, msg, cmd->inl,
+				cmd->config.len) != PNVL_SUCCESS)
+		return PNVL_HW_DMA_STS_EIO;
 
-	pnvl_dma_end_run(dev);
-	printf("(RX) finished - %d\n", ret);
+	return DMA_STS_WAITING;
 }
 
 /* ============================================================================
@@ -149,20 +220,58 @@ static void pnvl_receive_pages(PNVLDevice *dev)
  * ============================================================================
  */
 
-void pnvl_execute(PNVLDevice *dev)
+/*
+ * Start a queued send, called from the DMA worker thread. Receives never
+ * reach the worker: they are matched and filled by the link receive
+ * thread. Returns the completion status reported to the guest, or
+ * DMA_STS_WAITING if the send now waits for the peer to reply.
+ */
+int pnvl_execute(PNVLDevice *dev, DMACommand *cmd)
 {
-	printf(">>>>>>>>>> START RUN\n");
-	switch(dev->dma.mode) {
-	case DMA_MODE_ACTIVE:
-		pnvl_transfer_pages(dev);
-		break;
-	case DMA_MODE_PASSIVE:
-		pnvl_proxy_await_req(dev, PNVL_REQ_SLN);
-		pnvl_receive_pages(dev);
-		break;
-	default:
-		return;
+	int status = PNVL_HW_DMA_STS_EIO;
+
+	printf(">>>>>>>>>> START RUN (tag %u)\n", cmd->tag);
+	if (cmd->mode == DMA_MODE_ACTIVE && cmd->inl)
+		status = pnvl_transfer_inline(dev, cmd);
+	else if (cmd->mode == DMA_MODE_ACTIVE)
+		status = pnvl_transfer_pages(dev, cmd);
+	printf("<<<<<<<<<< END RUN (tag %u) - %d\n", cmd->tag, status);
+
+	return status;
+}
+
+/*
+ * Stream the data of a send the peer bound to a receive, called from the
+ * DMA worker thread. Bulk sends are streamed in chunks, with the sends
+ * queued meanwhile started in between. An inline send the peer already
+ * had is only completed. Returns the completion status.
+ */
+int pnvl_stream(PNVLDevice *dev, DMACommand *cmd)
+{
+	dma_size_t ofs, chunk;
+	int ret = PNVL_SUCCESS;
+
+	if (cmd->config.len > cmd->reply)
+		return PNVL_HW_DMA_STS_EMSGSIZE;
+	if (cmd->eager) /* the peer already had the payload */
+		return PNVL_HW_DMA_STS_OK;
+	if (cmd->inl) /* announced for want of credit, a single frame */
+		return pnvl_proxy_tx_data(dev, cmd->msg, 0,
+				g_memdup2(cmd->inl, cmd->config.len),
+				cmd->config.len) == PNVL_FAILURE ?
+			PNVL_HW_DMA_STS_EIO : PNVL_HW_DMA_STS_OK;
+
+	printf("(TX) streaming - msg %u, tag %u\n", cmd->msg, cmd->match);
+	chunk = pnvl_dma_chunk(dev, cmd);
+	for (ofs = 0; ofs < cmd->config.len && ret != PNVL_FAILURE;
+			ofs += chunk) {
+		if (ofs)
+			pnvl_dma_yield(dev, cmd);
+		ret = pnvl_dma_split(dev, cmd, ofs,
+				MIN(ofs + chunk, cmd->config.len),
+				pnvl_transfer_range);
 	}
-	printf("<<<<<<<<<< END RUN\n");
-	pnvl_irq_raise(dev, PNVL_HW_IRQ_WORK_ENDED_VECTOR);
+
+	printf("(TX) finished - %d\n", ret);
+	return ret == PNVL_FAILURE ? PNVL_HW_DMA_STS_EIO : PNVL_HW_DMA_STS_OK;
 }
@@ -13,6 +13,7 @@
 #include "pnvl_hw.h"
 #include "dma.h"
 #include "irq.h"
+#include "link.h"
 #include "proxy.h"
 
 #define TYPE_PNVL_DEVICE "pnvl"
@@ -33,6 +34,7 @@ typedef struct PNVLDevice {
 	IRQStatus irq;
 	DMAEngine dma;
 	MemoryRegion mmio;
+	PNVLLink link;
 	PNVLProxy proxy;
 } PNVLDevice;
 
@@ -42,6 +44,7 @@ typedef struct PNVLDevice {
  * ============================================================================
  */
 
-void pnvl_execute(PNVLDevice *dev);
+int pnvl_execute(PNVLDevice *dev, DMACommand *cmd);
+int pnvl_stream(PNVLDevice *dev, DMACommand *cmd);
 
 #endif /* PNVL_H */
@@ -9,16 +9,51 @@
 #include "proxy.h"
 #include "pnvl.h"
 #include "qapi/qapi-commands-machine.h"
+#include <netinet/tcp.h>
 
 /* ============================================================================
  * Private
  * ============================================================================
  */
 
+static int pnvl_proxy_await_req(ProxyStream *st, ProxyRequest req,
+		ProxyHeader *hdr);
+static int pnvl_proxy_send_frame(ProxyStream *st, ProxyHeader *hdr,
+		uint8_t *buff);
+
+/*
+ * Connection test of a stream. The client opens the streams in order and
+ * tells the server which one each connection is, how many there are and
+ * the size of the dedup caches, which must be the same on both ends.
+ */
+static int pnvl_proxy_hello(ProxyStream *st, uint32_t nstreams,
+		uint32_t dedup)
+{
+	ProxyHeader hdr = {
+		.req = PNVL_REQ_ACK,
+		.tag = nstreams,
+		.msg = dedup,
+		.arg = st->idx,
+	};
+
+	if (pnvl_proxy_send_frame(st, &hdr, NULL) != PNVL_SUCCESS) {
+		perror("pnvl_proxy_send_frame");
+		return PNVL_FAILURE;
+	}
+	if (pnvl_proxy_await_req(st, PNVL_REQ_ACK, &hdr) != PNVL_SUCCESS) {
+		perror("pnvl_proxy_await_req");
+		return PNVL_FAILURE;
+	}
+
+	return PNVL_SUCCESS;
+}
+
 static void pnvl_proxy_init_server(PNVLDevice *dev)
 {
 	PNVLProxy *proxy = &dev->proxy;
-	socklen_t len = sizeof(proxy->client.addr);
+	ProxyStream tmp = { .dev = dev };
+	ProxyHeader hdr;
+	unsigned int i;
 
 	if (bind(proxy->server.sockd, (struct sockaddr *)&proxy->server.addr,
 				sizeof(proxy->server.addr)) < 0) {
@@ -26,96 +61,386 @@ static void pnvl_proxy_init_server(PNVLDevice *dev)
 		return;
 	}
 
-	if (listen(proxy->server.sockd, PNVL_PROXY_MAXQ) < 0) {
+	if (listen(proxy->server.sockd, PNVL_PROXY_MAXQ + proxy->streams) < 0) {
 		perror("listen");
 		return;
 	}
 
 	puts("Server started, waiting for client...");
 
-	proxy->client.sockd = accept(proxy->server.sockd,
-			(struct sockaddr *)&proxy->client.addr, &len);
-	if (proxy->client.sockd < 0) {
-		perror("accept");
-		return;
+	for (i = 0; i < proxy->streams; i++) {
+		tmp.sockd = accept(proxy->server.sockd, NULL, NULL);
+		if (tmp.sockd < 0) {
+			perror("accept");
+			return;
+		}
+
+		/* Begin connection test */
+		if (pnvl_proxy_await_req(&tmp, PNVL_REQ_ACK, &hdr) !=
+				PNVL_SUCCESS) {
+			perror("pnvl_proxy_await_req");
+			close(tmp.sockd);
+			return;
+		}
+		if (hdr.tag != proxy->streams || hdr.arg >= proxy->streams ||
+				proxy->stream[hdr.arg].sockd >= 0 ||
+				hdr.msg != proxy->dedup) {
+			fprintf(stderr, "stream %" PRIu64 "/%u (dedup %u) does "
+					"not match %u streams (dedup %u)\n",
+					hdr.arg, hdr.tag, hdr.msg,
+					proxy->streams, proxy->dedup);
+			close(tmp.sockd);
+			return;
+		}
+		proxy->stream[hdr.arg].sockd = tmp.sockd;
+		if (pnvl_proxy_send_frame(&proxy->stream[hdr.arg], &hdr, NULL) !=
+				PNVL_SUCCESS) {
+			perror("pnvl_proxy_send_frame");
+			return;
+		}
+		/* End connection test */
 	}
 
-	/* Begin connection test */
-	if (pnvl_proxy_issue_req(dev, PNVL_REQ_ACK) != PNVL_SUCCESS) {
-		perror("pnvl_proxy_issue_req");
-		return;
-	}
-	if (pnvl_proxy_await_req(dev, PNVL_REQ_ACK) != PNVL_SUCCESS) {
-		perror("pnvl_proxy_await_req");
-		return;
-	}
 	puts("Client connection established.");
-	/* End connection test */
+	proxy->connected = true;
 }
 
 static void pnvl_proxy_init_client(PNVLDevice *dev)
 {
 	PNVLProxy *proxy = &dev->proxy;
+	ProxyStream *st;
+	unsigned int i;
+
+	for (i = 0; i < proxy->streams; i++) {
+		st = &proxy->stream[i];
+		st->sockd = socket(AF_INET, SOCK_STREAM, 0);
+		if (st->sockd < 0) {
+			perror("socket");
+			return;
+		}
+
+		if (connect(st->sockd, (struct sockaddr *)&proxy->server.addr,
+					sizeof(proxy->server.addr)) < 0) {
+			perror("connect");
+			return;
+		}
+
+		if (pnvl_proxy_hello(st, proxy->streams, proxy->dedup) !=
+				PNVL_SUCCESS)
+			return;
+	}
 
-	if (connect(proxy->server.sockd, (struct sockaddr *)&proxy->server.addr,
-				sizeof(proxy->server.addr)) < 0) {
-		perror("connect");
-		return;
+	puts("Server connection established.");
+	proxy->connected = true;
+}
+
+static int pnvl_proxy_recv_all(int con, void *buff, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = recv(con, buff, len, MSG_WAITALL);
+		if (ret <= 0)
+			return PNVL_FAILURE;
+		buff = (uint8_t *)buff + ret;
+		len -= ret;
 	}
 
-	/* Begin connection test */
-	if (pnvl_proxy_await_req(dev, PNVL_REQ_ACK) != PNVL_SUCCESS) {
-		perror("pnvl_proxy_await_req");
-		return;
+	return PNVL_SUCCESS;
+}
+
+static int pnvl_proxy_send_all(int con, const void *buff, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(con, buff, len, MSG_NOSIGNAL);
+		if (ret < 0)
+			return PNVL_FAILURE;
+		buff = (const uint8_t *)buff + ret;
+		len -= ret;
 	}
-	if (pnvl_proxy_issue_req(dev, PNVL_REQ_ACK) != PNVL_SUCCESS) {
-		perror("pnvl_proxy_issue_req");
-		return;
+
+	return PNVL_SUCCESS;
+}
+
+/*
+ * Send a header and its payload as one frame. Only the connection test
+ * and, once connected, the transmit thread of the stream write to it.
+ */
+static int pnvl_proxy_send_frame(ProxyStream *st, ProxyHeader *hdr,
+		uint8_t *buff)
+{
+	int ret;
+
+	pnvl_link_pace_tx(st->dev, sizeof(*hdr) + hdr->len);
+
+	ret = pnvl_proxy_send_all(st->sockd, hdr, sizeof(*hdr));
+	if (ret == PNVL_SUCCESS && hdr->len)
+		ret = pnvl_proxy_send_all(st->sockd, buff, hdr->len);
+
+	return ret;
+}
+
+/*
+ * Queue a frame on a channel. The frame takes the payload, which must come
+ * from g_malloc, and frees it once sent or on failure. Bulk lanes are
+ * bounded and block the caller when full, the control channel never
+ * blocks.
+ */
+static int pnvl_proxy_queue_frame(PNVLDevice *dev, unsigned int chan,
+		ProxyHeader *hdr, uint8_t *data)
+{
+	PNVLProxy *proxy = &dev->proxy;
+	ProxyChannel *ch = &proxy->chan[chan];
+	ProxyFrame *frame;
+
+	frame = g_new0(ProxyFrame, 1);
+	frame->hdr = *hdr;
+	frame->data = data;
+	frame->due = pnvl_link_stamp(dev);
+
+	qemu_mutex_lock(&proxy->tx_lock);
+	while (chan != PNVL_PROXY_CHAN_CTRL &&
+			ch->depth >= PNVL_PROXY_LANE_DEPTH && !proxy->stopping)
+		qemu_cond_wait(&proxy->tx_space, &proxy->tx_lock);
+	if (proxy->stopping) {
+		qemu_mutex_unlock(&proxy->tx_lock);
+		g_free(frame->data);
+		g_free(frame);
+		return PNVL_FAILURE;
 	}
-	puts("Server connection established.");
-	/* End connection test */
+	QSIMPLEQ_INSERT_TAIL(&ch->frames, frame, next);
+	ch->depth++;
+	/* only the first stream takes control frames, make sure it wakes up */
+	if (chan == PNVL_PROXY_CHAN_CTRL)
+		qemu_cond_broadcast(&proxy->tx_cond);
+	else
+		qemu_cond_signal(&proxy->tx_cond);
+	qemu_mutex_unlock(&proxy->tx_lock);
+
+	return PNVL_SUCCESS;
 }
 
-static inline int pnvl_proxy_endpoint(PNVLDevice *dev)
+/*
+ * Queue a frame only the given stream may send, answering or answered by
+ * a frame of the same stream. Never blocks.
+ */
+static void pnvl_proxy_queue_stream(ProxyStream *st, ProxyHeader *hdr,
+		uint8_t *data, uint64_t resend)
 {
-	return (dev->proxy.server_mode ?
-			dev->proxy.client.sockd : dev->proxy.server.sockd);
+	PNVLProxy *proxy = &st->dev->proxy;
+	ProxyFrame *frame;
+
+	frame = g_new0(ProxyFrame, 1);
+	frame->hdr = *hdr;
+	frame->data = data;
+	frame->resend = resend;
+	frame->due = pnvl_link_stamp(st->dev);
+
+	qemu_mutex_lock(&proxy->tx_lock);
+	QSIMPLEQ_INSERT_TAIL(&st->frames, frame, next);
+	qemu_cond_broadcast(&proxy->tx_cond);
+	qemu_mutex_unlock(&proxy->tx_lock);
 }
 
-static ProxyRequest pnvl_proxy_wait_req(PNVLDevice *dev)
+/*
+ * Pick the next frame to transmit: those of the stream itself, control
+ * (first stream only), then the bulk lanes in round robin.
+ */
+static ProxyFrame *pnvl_proxy_next_frame(PNVLProxy *proxy, ProxyStream *st)
 {
-	int con = pnvl_proxy_endpoint(dev);
-	ProxyRequest req = PNVL_REQ_NIL;
-	fd_set cons;
+	ProxyChannel *ch = &proxy->chan[PNVL_PROXY_CHAN_CTRL];
+	ProxyFrame *frame;
+	unsigned int i, lane;
+
+	/* proxy->tx_lock must be taken */
+	frame = QSIMPLEQ_FIRST(&st->frames);
+	if (frame) {
+		QSIMPLEQ_REMOVE_HEAD(&st->frames, next);
+		return frame;
+	}
 
-	FD_ZERO(&cons);
-	FD_SET(con, &cons);
-	if (select(con+1, &cons, NULL, NULL, NULL) && FD_ISSET(con, &cons))
-		recv(con, &req, sizeof(req), 0);
+	if (st->idx || QSIMPLEQ_EMPTY(&ch->frames)) {
+		ch = NULL;
+		for (i = 0; i < proxy->lanes; i++) {
+			lane = (proxy->next_lane + i) % proxy->lanes;
+			if (!QSIMPLEQ_EMPTY(&proxy->chan[1 + lane].frames)) {
+				ch = &proxy->chan[1 + lane];
+				proxy->next_lane = (lane + 1) % proxy->lanes;
+				break;
+			}
+		}
+		if (!ch)
+			return NULL;
+	}
 
-	return req;
+	frame = QSIMPLEQ_FIRST(&ch->frames);
+	QSIMPLEQ_REMOVE_HEAD(&ch->frames, next);
+	ch->depth--;
+	qemu_cond_broadcast(&proxy->tx_space);
+
+	return frame;
 }
 
-static int pnvl_proxy_handle_req(PNVLDevice *dev, ProxyRequest req)
+/*
+ * Send a frame, deduplicating data frames. The dedup cache only takes a
+ * frame once it made it to the socket, so it never refers to data the
+ * peer did not get. A resend whose slot was filled again is lost, and told
+ * as such so the receive does not wait for it forever.
+ */
+static int pnvl_proxy_tx_frame(ProxyStream *st, ProxyFrame *frame)
 {
-	int con = pnvl_proxy_endpoint(dev);
+	ProxyHeader *hdr = &frame->hdr;
+	uint8_t *buff = frame->data;
+	uint64_t ref_len;
+	size_t len;
+	bool ref;
+
+	if (frame->resend) {
+		buff = pnvl_dedup_resend(&st->dedup_tx, hdr->tag, frame->resend,
+				&len);
+		if (buff) {
+			hdr->len = len;
+		} else { /* the peer fails the receive instead */
+			qemu_log_mask(LOG_GUEST_ERROR, "lost data of msg %u\n",
+					hdr->msg);
+			hdr->req = PNVL_REQ_LOS;
+			hdr->len = sizeof(ref_len);
+			buff = frame->data;
+		}
+	} else if (hdr->req == PNVL_REQ_DAT &&
+			pnvl_dedup_tx(&st->dedup_tx, buff, hdr->len,
+				&hdr->tag)) {
+		hdr->req = PNVL_REQ_REF;
+		ref_len = hdr->len;
+		hdr->len = sizeof(ref_len);
+		buff = (uint8_t *)&ref_len;
+	}
+	ref = hdr->req == PNVL_REQ_REF;
+	len = hdr->len;
 
-	switch(req) {
-	case PNVL_REQ_SYN:
-		pnvl_execute(dev);
-		break;
+	if (pnvl_proxy_send_frame(st, hdr, buff) != PNVL_SUCCESS)
+		return PNVL_FAILURE;
+	if (hdr->req == PNVL_REQ_DAT || ref)
+		pnvl_dedup_sent(&st->dedup_tx, hdr->tag, buff, len, ref);
+
+	return PNVL_SUCCESS;
+}
+
+static void *pnvl_proxy_tx_thread(void *opaque)
+{
+	ProxyStream *st = opaque;
+	PNVLProxy *proxy = &st->dev->proxy;
+	ProxyFrame *frame;
+
+	qemu_mutex_lock(&proxy->tx_lock);
+	while (!proxy->stopping) {
+		frame = pnvl_proxy_next_frame(proxy, st);
+		if (!frame) {
+			qemu_cond_wait(&proxy->tx_cond, &proxy->tx_lock);
+			continue;
+		}
+		qemu_mutex_unlock(&proxy->tx_lock);
+
+		pnvl_link_delay(st->dev, frame->due);
+		if (pnvl_proxy_tx_frame(st, frame) != PNVL_SUCCESS)
+			qemu_log_mask(LOG_GUEST_ERROR, "lost request %u\n",
+					frame->hdr.req);
+		g_free(frame->data);
+		g_free(frame);
+
+		qemu_mutex_lock(&proxy->tx_lock);
+	}
+	qemu_mutex_unlock(&proxy->tx_lock);
+
+	return NULL;
+}
+
+static int pnvl_proxy_wait_req(ProxyStream *st, ProxyHeader *hdr)
+{
+	return pnvl_proxy_recv_all(st->sockd, hdr, sizeof(*hdr));
+}
+
+static int pnvl_proxy_handle_req(ProxyStream *st, ProxyHeader *hdr)
+{
+	PNVLDevice *dev = st->dev;
+	uint8_t *buff = st->rx_buff;
+	uint64_t patch, seq, ref_len, nak[2];
+	size_t len;
+
+	switch(hdr->req) {
 	case PNVL_REQ_RST:
 		qmp_system_reset(NULL); /* see qemu/ui/gtk.c L1313 */
 		break;
 	case PNVL_REQ_SLN:
-		pnvl_proxy_issue_req(dev, PNVL_REQ_RLN);
-		send(con, &dev->dma.config.len_avail,
-				sizeof(dev->dma.config.len_avail), 0);
+		patch = hdr->arg;
+		if (hdr->len == sizeof(patch) &&
+				pnvl_proxy_recv_all(st->sockd, &patch,
+					sizeof(patch)) != PNVL_SUCCESS)
+			return PNVL_FAILURE;
+		else if (hdr->len && hdr->len != sizeof(patch))
+			return PNVL_FAILURE;
+		pnvl_dma_incoming(dev, hdr->tag, hdr->msg, hdr->arg, patch);
 		break;
 	case PNVL_REQ_RLN:
-		recv(con, &dev->dma.config.len_avail,
-				sizeof(dev->dma.config.len_avail), 0);
+		pnvl_dma_reply(dev, hdr->msg, hdr->arg);
+		break;
+	case PNVL_REQ_DAT:
+		if (hdr->len > PNVL_PROXY_BUFF)
+			return PNVL_FAILURE;
+		if (pnvl_proxy_recv_all(st->sockd, buff, hdr->len) !=
+				PNVL_SUCCESS)
+			return PNVL_FAILURE;
+		pnvl_dedup_store(&st->dedup_rx, hdr->tag, buff, hdr->len);
+		pnvl_dma_deliver(dev, hdr->msg, hdr->arg, buff, hdr->len);
+		break;
+	case PNVL_REQ_INL:
+		if (hdr->len > PNVL_HW_DMA_INLINE_SIZE)
+			return PNVL_FAILURE;
+		if (pnvl_proxy_recv_all(st->sockd, buff, hdr->len) !=
+				PNVL_SUCCESS)
+			return PNVL_FAILURE;
+		pnvl_dma_incoming_inline(dev, hdr->tag, hdr->msg, buff,
+				hdr->len);
+		break;
+	case PNVL_REQ_REF:
+		if (hdr->len != sizeof(ref_len) ||
+				pnvl_proxy_recv_all(st->sockd, &ref_len,
+					sizeof(ref_len)) != PNVL_SUCCESS)
+			return PNVL_FAILURE;
+		buff = pnvl_dedup_fetch(&st->dedup_rx, hdr->tag, &len, &seq);
+		if (!buff || len != ref_len) { /* ask for the data itself */
+			nak[0] = seq;
+			nak[1] = ref_len;
+			hdr->req = PNVL_REQ_NAK;
+			hdr->len = sizeof(nak);
+			pnvl_proxy_queue_stream(st, hdr,
+					g_memdup2(nak, sizeof(nak)), 0);
+			break;
+		}
+		pnvl_dma_deliver(dev, hdr->msg, hdr->arg, buff, len);
+		break;
+	case PNVL_REQ_NAK:
+		if (hdr->len != sizeof(nak) ||
+				pnvl_proxy_recv_all(st->sockd, nak,
+					sizeof(nak)) != PNVL_SUCCESS || !nak[0])
+			return PNVL_FAILURE;
+		hdr->req = PNVL_REQ_DAT;
+		hdr->len = 0;
+		/* the length, in case the data is lost */
+		pnvl_proxy_queue_stream(st, hdr,
+				g_memdup2(&nak[1], sizeof(nak[1])), nak[0]);
 		break;
+	case PNVL_REQ_LOS:
+		if (hdr->len != sizeof(ref_len) ||
+				pnvl_proxy_recv_all(st->sockd, &ref_len,
+					sizeof(ref_len)) != PNVL_SUCCESS ||
+				ref_len > PNVL_PROXY_BUFF)
+			return PNVL_FAILURE;
+		pnvl_dma_deliver(dev, hdr->msg, hdr->arg, NULL, ref_len);
+		break;
+	case PNVL_REQ_SYN:
 	case PNVL_REQ_ACK:
 		break;
 	default:
@@ -125,72 +450,138 @@ static int pnvl_proxy_handle_req(PNVLDevice *dev, ProxyRequest req)
 	return PNVL_SUCCESS;
 }
 
-/* ============================================================================
- * Public
- * ============================================================================
+/*
+ * Only used during the connection test, before the receive thread runs.
+ * Other requests read while waiting are handled, not dropped.
  */
-
-int pnvl_proxy_issue_req(PNVLDevice *dev, ProxyRequest req)
+static int pnvl_proxy_await_req(ProxyStream *st, ProxyRequest req,
+		ProxyHeader *hdr)
 {
-	int ret, con = pnvl_proxy_endpoint(dev);
-
-	ret = send(con, &req, sizeof(req), 0);
-	if (ret < 0)
-		return PNVL_FAILURE;
+	do {
+		if (pnvl_proxy_wait_req(st, hdr) != PNVL_SUCCESS)
+			return PNVL_FAILURE;
+		if (pnvl_proxy_handle_req(st, hdr) != PNVL_SUCCESS)
+			return PNVL_FAILURE;
+	} while (hdr->req != req);
 
 	return PNVL_SUCCESS;
 }
 
-int pnvl_proxy_wait_and_handle_req(PNVLDevice *dev)
+/*
+ * Every incoming frame of a stream is dispatched from here, so requests
+ * for different messages can arrive in any order without being lost. A
+ * malformed frame may leave part of its payload unread, which would be
+ * taken for the next header, so the stream is closed instead.
+ */
+static void *pnvl_proxy_rx_thread(void *opaque)
 {
-	return pnvl_proxy_handle_req(dev, pnvl_proxy_wait_req(dev));
+	ProxyStream *st = opaque;
+	ProxyHeader hdr;
+
+	while (pnvl_proxy_wait_req(st, &hdr) == PNVL_SUCCESS) {
+		if (pnvl_proxy_handle_req(st, &hdr) != PNVL_SUCCESS) {
+			qemu_log_mask(LOG_GUEST_ERROR, "bad request %u, "
+					"closing stream %u\n", hdr.req,
+					st->idx);
+			shutdown(st->sockd, SHUT_RDWR);
+			break;
+		}
+	}
+
+	return NULL;
 }
 
-int pnvl_proxy_await_req(PNVLDevice *dev, ProxyRequest req)
-{
-	ProxyRequest new_req;
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
 
-	do {
-		new_req = pnvl_proxy_wait_req(dev);
-	} while(new_req != PNVL_FAILURE && new_req != req);
+int pnvl_proxy_issue_req(PNVLDevice *dev, ProxyRequest req, uint32_t tag,
+		uint32_t msg, uint64_t arg)
+{
+	ProxyHeader hdr = {
+		.req = req,
+		.tag = tag,
+		.msg = msg,
+		.len = 0,
+		.arg = arg,
+	};
+
+	if (!dev->proxy.connected)
+		return PNVL_FAILURE;
 
-	return pnvl_proxy_handle_req(dev, new_req);
+	return pnvl_proxy_queue_frame(dev, PNVL_PROXY_CHAN_CTRL, &hdr, NULL);
 }
 
 /*
- * Receive page: buffer <-- socket
+ * Announce a message of len bytes, of which only patch are going to be
+ * sent (a delta). Whole messages use a plain SLN.
  */
-int pnvl_proxy_rx_page(PNVLDevice *dev, uint8_t *buff)
+int pnvl_proxy_issue_sln(PNVLDevice *dev, uint32_t tag, uint32_t msg,
+		uint64_t len, uint64_t patch)
 {
-	int src = pnvl_proxy_endpoint(dev);
-	int len = 0;
-
-	if (recv(src, &len, sizeof(len), 0) < 0 || !len)
-		return PNVL_FAILURE;
-
-	if (recv(src, buff, len, 0) < 0)
+	ProxyHeader hdr = {
+		.req = PNVL_REQ_SLN,
+		.tag = tag,
+		.msg = msg,
+		.len = patch == len ? 0 : sizeof(patch),
+		.arg = len,
+	};
+
+	if (!dev->proxy.connected)
 		return PNVL_FAILURE;
 
-	return len;
+	return pnvl_proxy_queue_frame(dev, PNVL_PROXY_CHAN_CTRL, &hdr,
+			hdr.len ? g_memdup2(&patch, sizeof(patch)) : NULL);
 }
 
 /*
- * Transmit page: buffer --> socket
+ * Send a whole small message on the control channel, so it keeps its
+ * order with the announcements of other messages.
  */
-int pnvl_proxy_tx_page(PNVLDevice *dev, uint8_t *buff, int len)
+int pnvl_proxy_issue_inl(PNVLDevice *dev, uint32_t tag, uint32_t msg,
+		uint8_t *buff, uint32_t len)
 {
-	int dst = pnvl_proxy_endpoint(dev);
-
-	if (len <= 0)
+	ProxyHeader hdr = {
+		.req = PNVL_REQ_INL,
+		.tag = tag,
+		.msg = msg,
+		.len = len,
+		.arg = len,
+	};
+
+	if (!len || len > PNVL_HW_DMA_INLINE_SIZE || !dev->proxy.connected)
 		return PNVL_FAILURE;
 
-	if (send(dst, &len, sizeof(len), 0) < 0)
-		return PNVL_FAILURE;
+	return pnvl_proxy_queue_frame(dev, PNVL_PROXY_CHAN_CTRL, &hdr,
+			g_memdup2(buff, len));
+}
 
-	if (send(dst, buff, len, 0) < 0)
+/*
+ * Transmit data: buffer --> socket. Frames carry their offset, so the
+ * frames of one message are spread over the lanes, and the ranges the pool
+ * threads move in parallel do not all wait on one lane. The frame takes
+ * buff, which must come from g_malloc, so the data is not copied again
+ * before it reaches the socket.
+ */
+int pnvl_proxy_tx_data(PNVLDevice *dev, uint32_t msg, uint64_t ofs,
+		uint8_t *buff, int len)
+{
+	ProxyHeader hdr = {
+		.req = PNVL_REQ_DAT,
+		.msg = msg,
+		.len = len,
+		.arg = ofs,
+	};
+
+	if (len <= 0 || len > PNVL_PROXY_BUFF || !dev->proxy.connected) {
+		g_free(buff);
 		return PNVL_FAILURE;
+	}
 
-	return PNVL_SUCCESS;
+	return pnvl_proxy_queue_frame(dev,
+			1 + (msg + ofs / PNVL_PROXY_BUFF) % dev->proxy.lanes,
+			&hdr, buff);
 }
 
 bool pnvl_proxy_get_mode(Object *obj, Error **errp)
@@ -214,6 +605,28 @@ void pnvl_proxy_init(PNVLDevice *dev, Error **errp)
 {
 	PNVLProxy *proxy = &dev->proxy;
 	struct hostent *h;
+	ProxyStream *st;
+	int i, one = 1, lowat = PNVL_PROXY_LOWAT;
+
+	qemu_mutex_init(&proxy->tx_lock);
+	qemu_cond_init(&proxy->tx_cond);
+	qemu_cond_init(&proxy->tx_space);
+	for (i = 0; i <= PNVL_PROXY_LANES_MAX; i++) {
+		QSIMPLEQ_INIT(&proxy->chan[i].frames);
+		proxy->chan[i].depth = 0;
+	}
+	proxy->lanes = MAX(1, MIN(proxy->lanes, PNVL_PROXY_LANES_MAX));
+	proxy->next_lane = 0;
+	proxy->streams = MAX(1, MIN(proxy->streams, PNVL_PROXY_STREAMS_MAX));
+	for (i = 0; i < PNVL_PROXY_STREAMS_MAX; i++) {
+		proxy->stream[i].dev = dev;
+		proxy->stream[i].idx = i;
+		proxy->stream[i].sockd = -1;
+		QSIMPLEQ_INIT(&proxy->stream[i].frames);
+	}
+	proxy->server.sockd = -1;
+	proxy->stopping = false;
+	proxy->connected = false;
 
 	h = gethostbyname(PNVL_PROXY_HOST);
 	if (!h) {
@@ -221,26 +634,100 @@ void pnvl_proxy_init(PNVLDevice *dev, Error **errp)
 		return;
 	}
 
-	proxy->server.sockd = socket(AF_INET, SOCK_STREAM, 0);
-	if (proxy->server.sockd < 0) {
-		perror("socket");
-		return;
-	}
-
 	bzero(&proxy->server.addr, sizeof(proxy->server.addr));
 	proxy->server.addr.sin_family = AF_INET;
 	proxy->server.addr.sin_port = htons(proxy->port);
 	proxy->server.addr.sin_addr.s_addr = *(in_addr_t *)h->h_addr_list[0];
 
-	if (proxy->server_mode)
+	if (proxy->server_mode) {
+		proxy->server.sockd = socket(AF_INET, SOCK_STREAM, 0);
+		if (proxy->server.sockd < 0) {
+			perror("socket");
+			return;
+		}
 		pnvl_proxy_init_server(dev);
-	else
+	} else {
 		pnvl_proxy_init_client(dev);
+	}
+
+	if (!proxy->connected)
+		return;
+
+	for (i = 0; i < proxy->streams; i++) {
+		st = &proxy->stream[i];
+		pnvl_dedup_init(&st->dedup_tx, proxy->dedup, PNVL_PROXY_BUFF);
+		pnvl_dedup_init(&st->dedup_rx, proxy->dedup, PNVL_PROXY_BUFF);
+		/* small control frames must not wait for more data */
+		setsockopt(st->sockd, IPPROTO_TCP, TCP_NODELAY, &one,
+				sizeof(one));
+		/* nor behind the bulk data the kernel already holds */
+#ifdef TCP_NOTSENT_LOWAT
+		setsockopt(st->sockd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+				sizeof(lowat));
+#else
+		setsockopt(st->sockd, SOL_SOCKET, SO_SNDBUF, &lowat,
+				sizeof(lowat));
+#endif
+		qemu_thread_create(&st->tx_thread, "pnvl-link-tx",
+				pnvl_proxy_tx_thread, st, QEMU_THREAD_JOINABLE);
+		qemu_thread_create(&st->rx_thread, "pnvl-link-rx",
+				pnvl_proxy_rx_thread, st, QEMU_THREAD_JOINABLE);
+	}
 }
 
 void pnvl_proxy_fini(PNVLDevice *dev)
 {
-	if (dev->proxy.server_mode)
-		close(dev->proxy.client.sockd);
-	close(dev->proxy.server.sockd);
+	PNVLProxy *proxy = &dev->proxy;
+	ProxyStream *st;
+	ProxyFrame *frame;
+	int i;
+
+	qemu_mutex_lock(&proxy->tx_lock);
+	proxy->stopping = true;
+	qemu_cond_broadcast(&proxy->tx_cond);
+	qemu_cond_broadcast(&proxy->tx_space);
+	qemu_mutex_unlock(&proxy->tx_lock);
+
+	/* wake up the threads blocked on the link */
+	for (i = 0; i < proxy->streams; i++) {
+		if (proxy->stream[i].sockd >= 0)
+			shutdown(proxy->stream[i].sockd, SHUT_RDWR);
+	}
+	for (i = 0; proxy->connected && i < proxy->streams; i++) {
+		qemu_thread_join(&proxy->stream[i].tx_thread);
+		qemu_thread_join(&proxy->stream[i].rx_thread);
+	}
+
+	for (i = 0; i <= PNVL_PROXY_LANES_MAX; i++) {
+		while ((frame = QSIMPLEQ_FIRST(&proxy->chan[i].frames))) {
+			QSIMPLEQ_REMOVE_HEAD(&proxy->chan[i].frames, next);
+			g_free(frame->data);
+			g_free(frame);
+		}
+	}
+
+	for (i = 0; i < proxy->streams; i++) {
+		st = &proxy->stream[i];
+		while ((frame = QSIMPLEQ_FIRST(&st->frames))) {
+			QSIMPLEQ_REMOVE_HEAD(&st->frames, next);
+			g_free(frame->data);
+			g_free(frame);
+		}
+		if (st->sockd >= 0)
+			close(st->sockd);
+		if (proxy->connected && proxy->dedup)
+			printf("stream %d dedup: %" PRIu64 "/%" PRIu64
+					" frames sent as refs, %" PRIu64
+					" refs received\n", i,
+					st->dedup_tx.hits,
+					st->dedup_tx.hits + st->dedup_tx.misses,
+					st->dedup_rx.hits);
+		pnvl_dedup_fini(&st->dedup_tx);
+		pnvl_dedup_fini(&st->dedup_rx);
+	}
+	if (proxy->server.sockd >= 0)
+		close(proxy->server.sockd);
+	qemu_cond_destroy(&proxy->tx_space);
+	qemu_cond_destroy(&proxy->tx_cond);
+	qemu_mutex_destroy(&proxy->tx_lock);
 }
@@ -9,35 +9,128 @@
 
 #include "qemu/osdep.h"
 #include "qemu/typedefs.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "pnvl_hw.h"
+#include "dedup.h"
 #include <sys/socket.h>
 
 #define PNVL_PROXY_HOST "localhost"
 #define PNVL_PROXY_PORT 8987
-#define PNVL_PROXY_BUFF PAGE_SIZE
+#define PNVL_PROXY_BUFF PNVL_HW_DMA_AREA_SIZE
 #define PNVL_PROXY_MAXQ 1
 
+/*
+ * Virtual channels multiplexed on the link. Control requests always go
+ * first, data frames share the bulk lanes in round robin, the frames of a
+ * message going to consecutive lanes. A bulk lane holds a bounded number
+ * of frames, so the control channel never waits behind more than one data
+ * frame.
+ */
+#define PNVL_PROXY_CHAN_CTRL 0
+#define PNVL_PROXY_LANES 4 /* default number of bulk lanes */
+#define PNVL_PROXY_LANES_MAX 16
+#define PNVL_PROXY_LANE_DEPTH 8
+/*
+ * Unsent bytes a socket may hold, so a control frame does not wait in the
+ * kernel behind more bulk data than in the lanes.
+ */
+#define PNVL_PROXY_LOWAT (2 * PNVL_PROXY_BUFF)
+
+/*
+ * Parallel sockets of the link, each served by its own pair of threads.
+ * Control frames always use the first stream, data frames are taken by
+ * whichever stream is free. Data frames carry their offset in the message,
+ * so they can arrive on any stream and in any order.
+ */
+#define PNVL_PROXY_STREAMS 1 /* default number of streams */
+#define PNVL_PROXY_STREAMS_MAX 8
+
 #define PNVL_REQ_NIL 0x0
 #define PNVL_REQ_ACK 0x1 /* general acknowledge */
 #define PNVL_REQ_SYN 0x2 /* start syncing page data */
 #define PNVL_REQ_RST 0x3 /* reset machine */
-#define PNVL_REQ_SLN 0x4 /* send your available length */
-#define PNVL_REQ_RLN 0x5 /* receive my available length */
+#define PNVL_REQ_SLN 0x4 /* send your available length (for a message) */
+#define PNVL_REQ_RLN 0x5 /* receive my available length (for a message) */
+#define PNVL_REQ_DAT 0x6 /* page data of a message */
+#define PNVL_REQ_REF 0x7 /* page data the peer already holds */
+#define PNVL_REQ_INL 0x8 /* a whole small message, no reply expected */
+#define PNVL_REQ_NAK 0x9 /* page data the peer did not hold after all */
+#define PNVL_REQ_LOS 0xA /* page data the sender no longer holds either */
 
 /* Forward declaration */
 typedef struct PNVLDevice PNVLDevice;
 
 typedef unsigned int ProxyRequest;
 
+/*
+ * Every request travels with this header. SLN carries the message length
+ * in arg, RLN the available length and DAT the offset of the len payload
+ * bytes that follow the header. The SLN of a delta carries, as an 8 byte
+ * payload, how many bytes of the message will actually be sent. With dedup
+ * on, the tag of DAT is the slot where the peer keeps the payload, and REF
+ * places the data kept in slot tag at offset arg, with the length of that
+ * data as an 8 byte payload. INL carries the len bytes of a whole message
+ * with tag. A REF the receiver cannot resolve is answered, on the same
+ * stream, by a NAK with the same tag, msg and arg and, as a payload, the
+ * number of the REF among the data frames of the stream and its length, 8
+ * bytes each. The sender then sends the data of the slot again as a DAT,
+ * or as a LOS carrying only the length if the slot was filled again since,
+ * which fails the receive.
+ */
+typedef struct ProxyHeader {
+	uint32_t req;
+	uint32_t tag;
+	uint32_t msg;
+	uint32_t len;
+	uint64_t arg;
+} ProxyHeader;
+
+typedef struct ProxyFrame {
+	ProxyHeader hdr;
+	uint8_t *data;
+	int64_t due; /* not sent before, see pnvl_link_stamp */
+	uint64_t resend; /* data frame the peer missed, DAT of the slot */
+	QSIMPLEQ_ENTRY(ProxyFrame) next;
+} ProxyFrame;
+
+typedef struct ProxyChannel {
+	QSIMPLEQ_HEAD(, ProxyFrame) frames;
+	unsigned int depth;
+} ProxyChannel;
+
 typedef struct PNVLProxyConn {
 	int sockd;
 	struct sockaddr_in addr;
 } PNVLProxyConn;
 
+typedef struct ProxyStream {
+	PNVLDevice *dev;
+	unsigned int idx;
+	int sockd;
+	DedupCache dedup_tx; /* used by tx_thread only */
+	DedupCache dedup_rx; /* used by rx_thread only */
+	QSIMPLEQ_HEAD(, ProxyFrame) frames; /* NAKs and resends of this stream */
+	QemuThread tx_thread;
+	QemuThread rx_thread;
+	uint8_t rx_buff[PNVL_PROXY_BUFF];
+} ProxyStream;
+
 typedef struct PNVLProxy {
-	PNVLProxyConn server;
-	PNVLProxyConn client;
+	PNVLProxyConn server; /* listening socket, or the peer address */
 	bool server_mode;
 	uint16_t port;
+	bool connected;
+	uint32_t streams;
+	ProxyStream stream[PNVL_PROXY_STREAMS_MAX];
+	uint32_t dedup; /* dedup cache entries per stream, 0 disables it */
+	uint32_t lanes;
+	ProxyChannel chan[1 + PNVL_PROXY_LANES_MAX]; /* control, then bulk */
+	unsigned int next_lane;
+	bool stopping;
+	QemuMutex tx_lock;
+	QemuCond tx_cond; /* frames were queued */
+	QemuCond tx_space; /* a bulk lane has room */
 } PNVLProxy;
 
 /* ============================================================================
@@ -45,15 +138,18 @@ typedef struct PNVLProxy {
  * ============================================================================
  */
 
-int pnvl_proxy_rx_page(PNVLDevice *dev, uint8_t *buff);
-int pnvl_proxy_tx_page(PNVLDevice *dev, uint8_t *buff, int len);
+int pnvl_proxy_tx_data(PNVLDevice *dev, uint32_t msg, uint64_t ofs,
+		uint8_t *buff, int len);
 
 bool pnvl_proxy_get_mode(Object *obj, Error **errp);
 void pnvl_proxy_set_mode(Object *obj, bool mode, Error **errp);
 
-int pnvl_proxy_issue_req(PNVLDevice *dev, ProxyRequest req);
-int pnvl_proxy_wait_and_handle_req(PNVLDevice *dev);
-int pnvl_proxy_await_req(PNVLDevice *dev, ProxyRequest req);
+int pnvl_proxy_issue_req(PNVLDevice *dev, ProxyRequest req, uint32_t tag,
+		uint32_t msg, uint64_t arg);
+int pnvl_proxy_issue_sln(PNVLDevice *dev, uint32_t tag, uint32_t msg,
+		uint64_t len, uint64_t patch);
+int pnvl_proxy_issue_inl(PNVLDevice *dev, uint32_t tag, uint32_t msg,
+		uint8_t *buff, uint32_t len);
 
 void pnvl_proxy_reset(PNVLDevice *dev);
 void pnvl_proxy_init(PNVLDevice *dev, Error **errp);
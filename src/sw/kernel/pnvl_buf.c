@@ -0,0 +1,392 @@
+/* pnvl_buf.c - Registered and driver allocated buffers
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include "hw/pnvl_hw.h"
+#include "pnvl_module.h"
+#include <linux/dma-mapping.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+/*
+ * Bus address of every page of the buffer, so a slice can be programmed
+ * without walking the scatterlist. Segments merged by the IOMMU are
+ * contiguous and page aligned except for the start of the first one.
+ */
+static int pnvl_buf_fill_handles(struct pnvl_buf *buf)
+{
+	struct pnvl_dma *dma = &buf->dma;
+	unsigned long ofs = dma->addr & ~PAGE_MASK;
+	unsigned long n = 0;
+	struct scatterlist *sg;
+	dma_addr_t handle;
+	long remain;
+	int i;
+
+	buf->handles = kvmalloc_array(dma->npages, sizeof(dma_addr_t),
+			GFP_KERNEL);
+	if (!buf->handles)
+		return -ENOMEM;
+
+	for_each_sg(dma->sgt.sgl, sg, dma->nmapped, i) {
+		handle = sg_dma_address(sg);
+		remain = sg_dma_len(sg);
+		if (i == 0) {
+			handle -= ofs;
+			remain += ofs;
+		}
+		for (; remain > 0 && n < dma->npages; remain -= PAGE_SIZE) {
+			buf->handles[n++] = handle;
+			handle += PAGE_SIZE;
+		}
+	}
+
+	return 0;
+}
+
+/* ops complete in the IRQ thread, so the last reference is never atomic */
+static void pnvl_buf_free(struct kref *ref)
+{
+	struct pnvl_buf *buf = container_of(ref, struct pnvl_buf, ref);
+
+	if (buf->attach) {
+		pnvl_dmabuf_detach(buf);
+	} else if (buf->vaddr) {
+		dma_free_coherent(&buf->pnvl_dev->pdev->dev, buf->dma.len,
+				buf->vaddr, buf->base);
+	} else {
+		pnvl_dma_unmap_pages(&buf->dma, buf->pnvl_dev->pdev);
+		pnvl_dma_unpin_pages(&buf->dma);
+		sg_free_table(&buf->dma.sgt);
+	}
+	kvfree(buf->handles);
+	kfree(buf);
+}
+
+/*
+ * Pin and map a range of the current process for both directions. The
+ * caller owns the only reference.
+ */
+struct pnvl_buf *pnvl_buf_create(struct pnvl_dev *pnvl_dev, unsigned long addr,
+		unsigned long len)
+{
+	struct pnvl_buf *buf;
+	long rv;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+
+	buf->pnvl_dev = pnvl_dev;
+	buf->dma.addr = addr;
+	buf->dma.len = len;
+	buf->dma.mode = PNVL_MODE_OFF;
+	buf->dma.direction = DMA_BIDIRECTIONAL;
+	kref_init(&buf->ref);
+
+	rv = pnvl_dma_pin_pages(&buf->dma, pnvl_dev->pdev);
+	if (rv < 0)
+		goto free_buf;
+
+	if (pnvl_dma_map_pages(&buf->dma, pnvl_dev->pdev) <= 0) {
+		rv = -ENOMEM;
+		goto unpin_pages;
+	}
+
+	rv = pnvl_buf_fill_handles(buf);
+	if (rv < 0)
+		goto unmap_pages;
+
+	return buf;
+
+unmap_pages:
+	pnvl_dma_unmap_pages(&buf->dma, pnvl_dev->pdev);
+unpin_pages:
+	pnvl_dma_unpin_pages(&buf->dma);
+	sg_free_table(&buf->dma.sgt);
+free_buf:
+	kfree(buf);
+	return ERR_PTR(rv);
+}
+
+/*
+ * Make dma describe [addr, addr + len) of a buffer the caller holds a
+ * reference to, which passes to dma on success.
+ */
+int pnvl_buf_slice(struct pnvl_buf *buf, struct pnvl_dma *dma,
+		unsigned long addr, unsigned long len)
+{
+	dma->buf = buf;
+	dma->addr = addr;
+	dma->len = len;
+	dma->first = (addr >> PAGE_SHIFT) - (buf->dma.addr >> PAGE_SHIFT);
+	dma->npages = ((addr + len - 1) >> PAGE_SHIFT) -
+		(addr >> PAGE_SHIFT) + 1;
+	dma->nmapped = dma->npages;
+	dma->pages = buf->dma.pages ? buf->dma.pages + dma->first : NULL;
+
+	return 0;
+}
+
+/*
+ * Hand the part of a pinned buffer a slice covers to the device before an
+ * op, or back to the CPU after it. The buffer stays mapped from one op to
+ * the next, so CPU caches and bounce buffers are only synced here. Coherent
+ * and imported buffers need nothing.
+ */
+void pnvl_buf_sync(struct pnvl_buf *buf, struct pnvl_dma *dma,
+		bool for_device)
+{
+	struct device *dev = &buf->pnvl_dev->pdev->dev;
+	unsigned long pos = buf->dma.addr, end = dma->addr + dma->len;
+	struct scatterlist *sg;
+	int i;
+
+	if (!buf->dma.pages)
+		return;
+
+	for_each_sg(buf->dma.sgt.sgl, sg, buf->dma.sgt.orig_nents, i) {
+		if (pos >= end)
+			break;
+		if (pos + sg->length > dma->addr && for_device)
+			dma_sync_sg_for_device(dev, sg, 1, DMA_BIDIRECTIONAL);
+		else if (pos + sg->length > dma->addr)
+			dma_sync_sg_for_cpu(dev, sg, 1, DMA_BIDIRECTIONAL);
+		pos += sg->length;
+	}
+}
+
+/*
+ * Register a buffer with the file, which takes over the reference of the
+ * caller. Returns the key that sends and receives of slices of it refer to.
+ */
+pnvl_key_t pnvl_buf_add(struct pnvl_file *file, struct pnvl_buf *buf)
+{
+	pnvl_key_t key;
+
+	spin_lock(&file->lock);
+	key = buf->key = file->next_key++;
+	list_add_tail(&buf->list, &file->bufs);
+	spin_unlock(&file->lock);
+
+	return key;
+}
+
+/*
+ * Pin and map a user buffer for the lifetime of its registration.
+ */
+long pnvl_buf_reg(struct pnvl_file *file, unsigned long uarg)
+{
+	struct pnvl_reg reg;
+	struct pnvl_buf *buf;
+
+	if (copy_from_user(&reg, (void *)uarg, sizeof(reg)))
+		return -EFAULT;
+	if (!reg.len)
+		return -EINVAL;
+
+	buf = pnvl_buf_create(file->pnvl_dev, reg.addr, reg.len);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	return (long)pnvl_buf_add(file, buf);
+}
+
+/*
+ * Drop a registration. Ops still running on the buffer keep it pinned
+ * until they complete.
+ */
+long pnvl_buf_unreg(struct pnvl_file *file, pnvl_key_t key)
+{
+	struct pnvl_buf *buf, *found = NULL;
+
+	spin_lock(&file->lock);
+	list_for_each_entry(buf, &file->bufs, list) {
+		if (buf->key == key) {
+			list_del(&buf->list);
+			found = buf;
+			break;
+		}
+	}
+	spin_unlock(&file->lock);
+
+	if (!found)
+		return -ENOENT;
+
+	kref_put(&found->ref, pnvl_buf_free);
+	return 0;
+}
+
+/*
+ * Take a reference to a registered buffer for an op, NULL if the key is
+ * unknown to this file.
+ */
+struct pnvl_buf *pnvl_buf_get(struct pnvl_file *file, pnvl_key_t key)
+{
+	struct pnvl_buf *buf;
+
+	spin_lock(&file->lock);
+	list_for_each_entry(buf, &file->bufs, list) {
+		if (buf->key == key) {
+			kref_get(&buf->ref);
+			spin_unlock(&file->lock);
+			return buf;
+		}
+	}
+	spin_unlock(&file->lock);
+
+	return NULL;
+}
+
+void pnvl_buf_put(struct pnvl_buf *buf)
+{
+	kref_put(&buf->ref, pnvl_buf_free);
+}
+
+static void pnvl_buf_vm_close(struct vm_area_struct *vma)
+{
+	struct pnvl_buf *buf = vma->vm_private_data;
+	struct pnvl_file *file = buf->file;
+
+	spin_lock(&file->lock);
+	list_del(&buf->list);
+	spin_unlock(&file->lock);
+
+	kref_put(&buf->ref, pnvl_buf_free);
+}
+
+/* the buffer is one allocation, it cannot be unmapped piecewise */
+static int pnvl_buf_vm_may_split(struct vm_area_struct *vma,
+		unsigned long addr)
+{
+	return -EINVAL;
+}
+
+/* ops find the buffer by the address it was mapped at, it cannot move */
+static int pnvl_buf_vm_mremap(struct vm_area_struct *vma)
+{
+	return -EINVAL;
+}
+
+static const struct vm_operations_struct pnvl_buf_vm_ops = {
+	.close = pnvl_buf_vm_close,
+	.may_split = pnvl_buf_vm_may_split,
+	.mremap = pnvl_buf_vm_mremap,
+};
+
+/*
+ * Back a new mapping of the device file with coherent DMA memory. It is
+ * mapped for the device for as long as the mapping exists, so ops on it
+ * never pin or map pages.
+ */
+int pnvl_buf_mmap(struct pnvl_file *file, struct vm_area_struct *vma)
+{
+	struct pci_dev *pdev = file->pnvl_dev->pdev;
+	unsigned long i, len = vma->vm_end - vma->vm_start;
+	struct pnvl_buf *buf;
+	int rv;
+
+	if (vma->vm_pgoff)
+		return -EINVAL;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	buf->pnvl_dev = file->pnvl_dev;
+	buf->file = file;
+	buf->mm = vma->vm_mm;
+	buf->dma.addr = vma->vm_start;
+	buf->dma.len = len;
+	buf->dma.npages = len >> PAGE_SHIFT;
+	buf->dma.nmapped = buf->dma.npages;
+	buf->dma.mode = PNVL_MODE_OFF;
+	buf->dma.direction = DMA_BIDIRECTIONAL;
+	kref_init(&buf->ref);
+
+	buf->handles = kvmalloc_array(buf->dma.npages, sizeof(dma_addr_t),
+			GFP_KERNEL);
+	if (!buf->handles) {
+		rv = -ENOMEM;
+		goto free_buf;
+	}
+
+	buf->vaddr = dma_alloc_coherent(&pdev->dev, len, &buf->base,
+			GFP_KERNEL);
+	if (!buf->vaddr) {
+		rv = -ENOMEM;
+		goto free_handles;
+	}
+
+	for (i = 0; i < buf->dma.npages; i++)
+		buf->handles[i] = buf->base + i * PAGE_SIZE;
+
+	rv = dma_mmap_coherent(&pdev->dev, vma, buf->vaddr, buf->base, len);
+	if (rv < 0)
+		goto free_coherent;
+
+	vm_flags_set(vma, VM_DONTCOPY | VM_DONTEXPAND);
+	vma->vm_ops = &pnvl_buf_vm_ops;
+	vma->vm_private_data = buf;
+
+	spin_lock(&file->lock);
+	list_add_tail(&buf->list, &file->maps);
+	spin_unlock(&file->lock);
+
+	return 0;
+
+free_coherent:
+	dma_free_coherent(&pdev->dev, len, buf->vaddr, buf->base);
+free_handles:
+	kvfree(buf->handles);
+free_buf:
+	kfree(buf);
+	return rv;
+}
+
+/*
+ * Make dma a slice of a buffer mapped from this file if it lies inside
+ * one. Returns -ENOENT if it does not.
+ */
+int pnvl_buf_find_mmap(struct pnvl_file *file, struct pnvl_dma *dma)
+{
+	struct pnvl_buf *buf;
+	int rv = -ENOENT;
+
+	spin_lock(&file->lock);
+	list_for_each_entry(buf, &file->maps, list) {
+		if (buf->mm != current->mm || dma->addr < buf->dma.addr ||
+				dma->addr - buf->dma.addr >= buf->dma.len ||
+				dma->len > buf->dma.len -
+				(dma->addr - buf->dma.addr))
+			continue;
+		kref_get(&buf->ref);
+		rv = pnvl_buf_slice(buf, dma, dma->addr, dma->len);
+		if (rv < 0)
+			kref_put(&buf->ref, pnvl_buf_free);
+		break;
+	}
+	spin_unlock(&file->lock);
+
+	return rv;
+}
+
+/*
+ * Drop every registration of a file being closed.
+ */
+void pnvl_buf_release(struct pnvl_file *file)
+{
+	struct pnvl_buf *buf, *tmp;
+	LIST_HEAD(bufs);
+
+	spin_lock(&file->lock);
+	list_splice_init(&file->bufs, &bufs);
+	spin_unlock(&file->lock);
+
+	list_for_each_entry_safe(buf, tmp, &bufs, list) {
+		list_del(&buf->list);
+		kref_put(&buf->ref, pnvl_buf_free);
+	}
+}
@@ -0,0 +1,221 @@
+/* pnvl_cache.c - Sends and receives on the page cache of a file
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include "pnvl_module.h"
+#include <linux/dma-mapping.h>
+#include <linux/fcntl.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/fsnotify.h>
+#include <linux/magic.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/shmem_fs.h>
+#include <linux/slab.h>
+
+static bool pnvl_cache_is_tmpfs(struct file *filp)
+{
+	return file_inode(filp)->i_sb->s_magic == TMPFS_MAGIC;
+}
+
+/*
+ * Receives write the page cache behind the back of the filesystem, with no
+ * blocks reserved and no writeback to wait for, which only tmpfs copes
+ * with. Files that may not be written at all are refused.
+ */
+static int pnvl_cache_may_recv(struct file *filp)
+{
+	struct inode *inode = file_inode(filp);
+
+	if (!pnvl_cache_is_tmpfs(filp))
+		return -EOPNOTSUPP;
+	if (IS_IMMUTABLE(inode) || IS_APPEND(inode) ||
+			(SHMEM_I(inode)->seals &
+			 (F_SEAL_WRITE | F_SEAL_FUTURE_WRITE)))
+		return -EPERM;
+
+	return 0;
+}
+
+/*
+ * Make an op out of a range of a file. The op holds a reference to the
+ * file for as long as it holds its pages.
+ */
+int pnvl_cache_new(struct pnvl_op *op, unsigned int cmd, unsigned long uarg)
+{
+	struct pnvl_file_data data;
+	struct file *filp;
+	int rv = -EINVAL;
+
+	if (copy_from_user(&data, (void *)uarg, sizeof(data)))
+		return -EFAULT;
+	if (pnvl_ops_set_tag(&op->dma, data.tag) < 0)
+		return -EINVAL;
+	if (cmd == PNVL_IOCTL_SEND_FILE && op->dma.tag == PNVL_TAG_ANY)
+		return -EINVAL;
+
+	filp = fget(data.fd);
+	if (!filp)
+		return -EBADF;
+
+	if (!S_ISREG(file_inode(filp)->i_mode) || IS_DAX(file_inode(filp)) ||
+			(!pnvl_cache_is_tmpfs(filp) &&
+			 !filp->f_mapping->a_ops->read_folio))
+		goto put_file;
+	if (!(filp->f_mode & (cmd == PNVL_IOCTL_SEND_FILE ?
+					FMODE_READ : FMODE_WRITE))) {
+		rv = -EBADF;
+		goto put_file;
+	}
+	if (!data.len || data.ofs + data.len < data.ofs ||
+			data.ofs + data.len > i_size_read(file_inode(filp)))
+		goto put_file;
+	if (cmd == PNVL_IOCTL_RECV_FILE) {
+		rv = pnvl_cache_may_recv(filp);
+		if (!rv)
+			rv = file_update_time(filp);
+		if (rv)
+			goto put_file;
+	}
+
+	op->dma.filp = filp;
+	op->dma.addr = data.ofs;
+	op->dma.len = data.len;
+	op->dma.mode = PNVL_MODE_OFF;
+	if (cmd == PNVL_IOCTL_RECV_FILE) {
+		op->dma.direction = DMA_FROM_DEVICE;
+		op->ioctl_fn = pnvl_ioctl_recv;
+	} else {
+		op->dma.direction = DMA_TO_DEVICE;
+		op->ioctl_fn = pnvl_ioctl_send;
+	}
+
+	return 0;
+
+put_file:
+	fput(filp);
+	return rv;
+}
+
+/*
+ * Uptodate folio holding page index of the file, read in if it is not
+ * cached. As read() does, the readahead state of the file is told about
+ * the nr pages still wanted, so sequential streams are read ahead. tmpfs
+ * has nothing to read ahead, its holes are filled with new folios.
+ */
+static struct folio *pnvl_cache_get_folio(struct file *filp, pgoff_t index,
+		unsigned long nr)
+{
+	struct address_space *mapping = filp->f_mapping;
+	struct folio *folio;
+
+	if (pnvl_cache_is_tmpfs(filp))
+		return shmem_read_folio(mapping, index);
+
+	folio = filemap_get_folio(mapping, index);
+	if (IS_ERR(folio)) {
+		page_cache_sync_readahead(mapping, &filp->f_ra, filp, index, nr);
+	} else {
+		if (folio_test_readahead(folio))
+			page_cache_async_readahead(mapping, &filp->f_ra, filp,
+					folio, index, nr);
+		if (folio_test_uptodate(folio))
+			return folio;
+		folio_put(folio);
+	}
+
+	return read_mapping_folio(mapping, index, filp);
+}
+
+/*
+ * Take the page cache pages of the range of dma, a reference each, and
+ * describe them in its scatterlist. The file reference is dropped if this
+ * fails.
+ */
+int pnvl_cache_get_pages(struct pnvl_dma *dma, struct pci_dev *pdev)
+{
+	pgoff_t first = dma->addr >> PAGE_SHIFT;
+	unsigned long i = 0, j, n, npages;
+	struct folio *folio;
+	int rv;
+
+	npages = ((dma->addr + dma->len - 1) >> PAGE_SHIFT) - first + 1;
+	if (npages > INT_MAX) {
+		rv = -EMSGSIZE;
+		goto put_file;
+	}
+	dma->npages = npages;
+
+	dma->pages = kvmalloc_array(npages, sizeof(struct page *), GFP_KERNEL);
+	if (!dma->pages) {
+		rv = -ENOMEM;
+		goto put_file;
+	}
+
+	while (i < npages) {
+		folio = pnvl_cache_get_folio(dma->filp, first + i, npages - i);
+		if (IS_ERR(folio)) {
+			rv = PTR_ERR(folio);
+			goto put_pages;
+		}
+		n = min_t(unsigned long, folio_next_index(folio) - (first + i),
+				npages - i);
+		for (j = 0; j < n; j++)
+			dma->pages[i + j] = folio_file_page(folio, first + i + j);
+		if (n > 1)
+			folio_ref_add(folio, n - 1);
+		i += n;
+	}
+
+	rv = sg_alloc_table_from_pages_segment(&dma->sgt, dma->pages, npages,
+			dma->addr & ~PAGE_MASK, dma->len,
+			dma_get_max_seg_size(&pdev->dev), GFP_KERNEL);
+	if (rv < 0)
+		goto put_pages;
+
+	return 0;
+
+put_pages:
+	release_pages(dma->pages, i);
+	kvfree(dma->pages);
+put_file:
+	fput(dma->filp);
+	dma->filp = NULL;
+	return rv;
+}
+
+/*
+ * Once unmapped, mark the pages a successful receive wrote as dirty, so
+ * they are kept, and tell watchers the file changed.
+ */
+void pnvl_cache_finish(struct pnvl_dma *dma, bool ok)
+{
+	struct folio *folio, *prev = NULL;
+	unsigned long i;
+
+	if (!ok || dma->direction != DMA_FROM_DEVICE)
+		return;
+
+	for (i = 0; i < dma->npages; i++) {
+		folio = page_folio(dma->pages[i]);
+		if (folio == prev)
+			continue;
+		folio_lock(folio);
+		folio_mark_dirty(folio);
+		folio_unlock(folio);
+		prev = folio;
+	}
+	fsnotify_modify(dma->filp);
+}
+
+void pnvl_cache_put_pages(struct pnvl_dma *dma)
+{
+	release_pages(dma->pages, dma->npages);
+	kvfree(dma->pages);
+	sg_free_table(&dma->sgt);
+	fput(dma->filp);
+	dma->filp = NULL;
+}
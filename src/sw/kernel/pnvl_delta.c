@@ -0,0 +1,342 @@
+/* pnvl_delta.c - Changed page tracking for delta sends
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include "hw/pnvl_hw.h"
+#include "pnvl_module.h"
+#include <linux/bitmap.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/xxhash.h>
+
+/*
+ * A page is considered written since the last delta send of the same range
+ * if its checksum changed. This needs neither soft-dirty bits nor write
+ * faults, and also catches pages written through other mappings. Only the
+ * pages that may have changed are checksummed again, see
+ * pnvl_delta_scan_ptes.
+ */
+static void pnvl_delta_sum_pages(struct pnvl_dma *dma, unsigned long *todo)
+{
+	unsigned long i;
+	void *va;
+
+	for_each_set_bit(i, todo, dma->npages) {
+		va = kmap_local_page(dma->pages[i]);
+		dma->sums[i] = xxh64(va, PAGE_SIZE, 0);
+		kunmap_local(va);
+	}
+}
+
+/*
+ * Note the pages still mapped by a clean pte. Nothing wrote to such an
+ * anonymous page, or to the zero page, since it was mapped: any write
+ * through a mapping dirties the pte, or replaces the page. A dirty pte is
+ * only cleaned (e.g. by MADV_FREE) through the mmu notifiers, which make
+ * the range forget its clean pages, see pnvl_delta_invalidate. Delta sends
+ * pin their pages without FOLL_WRITE so as not to dirty the ptes
+ * themselves.
+ */
+static void pnvl_delta_scan_ptes(struct pnvl_dma *dma)
+{
+	unsigned long i, va = dma->addr & PAGE_MASK;
+	struct mm_struct *mm = current->mm;
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t *ptep, pte;
+
+	mmap_read_lock(mm);
+	for (i = 0; i < dma->npages; i++, va += PAGE_SIZE) {
+		page = dma->pages[i];
+		dma->pfns[i] = page_to_pfn(page);
+		if (!(PageAnon(page) || is_zero_pfn(dma->pfns[i])) ||
+				PageDirty(page) || follow_pte(mm, va, &ptep, &ptl))
+			continue;
+		pte = ptep_get(ptep);
+		if (pte_present(pte) && !pte_dirty(pte) &&
+				pte_pfn(pte) == dma->pfns[i])
+			__set_bit(i, dma->clean);
+		pte_unmap_unlock(ptep, ptl);
+	}
+	mmap_read_unlock(mm);
+}
+
+/*
+ * Take the checksums of the last send for the pages mapped by a clean pte
+ * both then and now, to the same page, with the range left alone by the
+ * mmu notifiers in between: they cannot have changed. The other pages are
+ * left in todo. pnvl_dev->delta_lock must be taken.
+ */
+static void pnvl_delta_reuse(struct pnvl_delta *delta, struct pnvl_dma *dma,
+		unsigned long *todo)
+{
+	unsigned long i;
+
+	if (!delta->sums)
+		return;
+
+	for_each_set_bit(i, dma->clean, dma->npages) {
+		if (test_bit(i, delta->clean) &&
+				delta->pfns[i] == dma->pfns[i]) {
+			dma->sums[i] = delta->sums[i];
+			__clear_bit(i, todo);
+		}
+	}
+}
+
+static bool pnvl_delta_invalidate(struct mmu_interval_notifier *mni,
+		const struct mmu_notifier_range *range, unsigned long cur_seq)
+{
+	struct pnvl_delta *delta = container_of(mni, struct pnvl_delta,
+			notifier);
+	struct pnvl_dev *pnvl_dev = delta->pnvl_dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pnvl_dev->delta_lock, flags);
+	mmu_interval_set_seq(mni, cur_seq);
+	if (delta->clean)
+		bitmap_zero(delta->clean, delta->npages);
+	spin_unlock_irqrestore(&pnvl_dev->delta_lock, flags);
+
+	return true;
+}
+
+static const struct mmu_interval_notifier_ops pnvl_delta_ops = {
+	.invalidate = pnvl_delta_invalidate,
+};
+
+/*
+ * Set up a new range for dma, watched by its notifier from now on so that
+ * no change is missed before its ptes are first scanned.
+ */
+static int pnvl_delta_track(struct pnvl_dev *pnvl_dev,
+		struct pnvl_delta *delta, struct pnvl_dma *dma)
+{
+	unsigned long start = dma->addr & PAGE_MASK;
+	int rv;
+
+	rv = mmu_interval_notifier_insert(&delta->notifier, current->mm,
+			start, PAGE_ALIGN(dma->addr + dma->len) - start,
+			&pnvl_delta_ops);
+	if (rv)
+		return rv;
+
+	mmgrab(current->mm);
+	delta->pnvl_dev = pnvl_dev;
+	delta->mm = current->mm;
+	delta->addr = dma->addr;
+	delta->len = dma->len;
+	delta->npages = dma->npages;
+	return 0;
+}
+
+static struct pnvl_delta *pnvl_delta_find(struct pnvl_dev *pnvl_dev,
+		struct pnvl_dma *dma)
+{
+	struct pnvl_delta *delta;
+
+	/* pnvl_dev->delta_lock must be taken */
+	list_for_each_entry(delta, &pnvl_dev->deltas, list) {
+		if (delta->mm == current->mm && delta->addr == dma->addr &&
+				delta->len == dma->len)
+			return delta;
+	}
+	return NULL;
+}
+
+/* Free ranges taken off the list, without any lock held */
+static void pnvl_delta_free(struct list_head *list)
+{
+	struct pnvl_delta *delta, *tmp;
+
+	list_for_each_entry_safe(delta, tmp, list, list) {
+		list_del(&delta->list);
+		mmu_interval_notifier_remove(&delta->notifier);
+		mmdrop(delta->mm);
+		kvfree(delta->sums);
+		kvfree(delta->pfns);
+		bitmap_free(delta->clean);
+		kfree(delta);
+	}
+}
+
+/* Free the page state of a delta send */
+static void pnvl_delta_free_dma(struct pnvl_dma *dma)
+{
+	kvfree(dma->sums);
+	kvfree(dma->dirty);
+	kvfree(dma->pfns);
+	bitmap_free(dma->clean);
+	dma->sums = NULL;
+	dma->dirty = NULL;
+	dma->pfns = NULL;
+	dma->clean = NULL;
+}
+
+/*
+ * Make room for one more range by forgetting the least recently sent one
+ * that has no send in flight. Returns false if all of them are busy.
+ */
+static bool pnvl_delta_evict(struct pnvl_dev *pnvl_dev,
+		struct list_head *evicted)
+{
+	struct pnvl_delta *delta;
+
+	/* pnvl_dev->delta_lock must be taken */
+	list_for_each_entry(delta, &pnvl_dev->deltas, list) {
+		if (!delta->users) {
+			list_move_tail(&delta->list, evicted);
+			pnvl_dev->ndeltas--;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Checksum the pinned pages of a delta send and mark in dma->dirty those
+ * that differ from the last completed send of the same range. Unknown
+ * ranges are sent whole.
+ */
+int pnvl_delta_prepare(struct pnvl_dev *pnvl_dev, struct pnvl_dma *dma)
+{
+	struct pnvl_delta *delta, *new;
+	unsigned long i, *todo;
+	LIST_HEAD(evicted);
+
+	dma->sums = kvmalloc_array(dma->npages, sizeof(u64), GFP_KERNEL);
+	dma->dirty = kvcalloc(DIV_ROUND_UP(dma->npages, 32), sizeof(u32),
+			GFP_KERNEL);
+	dma->pfns = kvmalloc_array(dma->npages, sizeof(unsigned long),
+			GFP_KERNEL);
+	dma->clean = bitmap_zalloc(dma->npages, GFP_KERNEL);
+	todo = bitmap_alloc(dma->npages, GFP_KERNEL);
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!dma->sums || !dma->dirty || !dma->pfns || !dma->clean || !todo ||
+			!new) {
+		pnvl_delta_free_dma(dma);
+		bitmap_free(todo);
+		kfree(new);
+		return -ENOMEM;
+	}
+
+	spin_lock_irq(&pnvl_dev->delta_lock);
+	delta = pnvl_delta_find(pnvl_dev, dma);
+	if (delta)
+		delta->users++;
+	spin_unlock_irq(&pnvl_dev->delta_lock);
+
+	/* inserting the notifier sleeps, someone may add the range meanwhile */
+	if (!delta && !pnvl_delta_track(pnvl_dev, new, dma)) {
+		spin_lock_irq(&pnvl_dev->delta_lock);
+		delta = pnvl_delta_find(pnvl_dev, dma);
+		if (!delta && (pnvl_dev->ndeltas < PNVL_DELTA_CNT ||
+					pnvl_delta_evict(pnvl_dev, &evicted))) {
+			delta = new;
+			new = NULL;
+			list_add_tail(&delta->list, &pnvl_dev->deltas);
+			pnvl_dev->ndeltas++;
+		}
+		if (delta)
+			delta->users++;
+		spin_unlock_irq(&pnvl_dev->delta_lock);
+		if (new)
+			list_add(&new->list, &evicted);
+		new = NULL;
+	}
+
+	if (delta) {
+		dma->clean_seq = mmu_interval_read_begin(&delta->notifier);
+		pnvl_delta_scan_ptes(dma);
+	}
+	bitmap_fill(todo, dma->npages);
+
+	spin_lock_irq(&pnvl_dev->delta_lock);
+	if (delta) {
+		pnvl_delta_reuse(delta, dma, todo);
+		list_move_tail(&delta->list, &pnvl_dev->deltas);
+	}
+	dma->prev = delta;
+	spin_unlock_irq(&pnvl_dev->delta_lock);
+
+	pnvl_delta_free(&evicted);
+	kfree(new);
+
+	pnvl_delta_sum_pages(dma, todo);
+	bitmap_free(todo);
+
+	/* the last send may have completed meanwhile, compare with it */
+	spin_lock_irq(&pnvl_dev->delta_lock);
+	for (i = 0; i < dma->npages; i++) {
+		if (!delta || !delta->sums || delta->sums[i] != dma->sums[i])
+			dma->dirty[i / 32] |= 1U << (i % 32);
+	}
+	spin_unlock_irq(&pnvl_dev->delta_lock);
+
+	return 0;
+}
+
+/*
+ * Called once a delta send is over, possibly from the IRQ thread. The
+ * receiver only has the data the checksums describe if the send succeeded,
+ * otherwise the next delta of the range is sent whole.
+ */
+void pnvl_delta_finish(struct pnvl_dev *pnvl_dev, struct pnvl_dma *dma,
+		bool ok)
+{
+	struct pnvl_delta *delta = dma->prev;
+	unsigned long *old_pfns = NULL, *old_clean = NULL;
+	u64 *old = NULL;
+
+	if (delta) {
+		spin_lock_irq(&pnvl_dev->delta_lock);
+		old = delta->sums;
+		old_pfns = delta->pfns;
+		old_clean = delta->clean;
+		delta->sums = NULL;
+		delta->pfns = NULL;
+		delta->clean = NULL;
+		if (ok) {
+			/* the range changed after its ptes were scanned */
+			if (mmu_interval_check_retry(&delta->notifier,
+						dma->clean_seq))
+				bitmap_zero(dma->clean, dma->npages);
+			swap(delta->sums, dma->sums);
+			swap(delta->pfns, dma->pfns);
+			swap(delta->clean, dma->clean);
+		}
+		delta->users--;
+		spin_unlock_irq(&pnvl_dev->delta_lock);
+	}
+
+	kvfree(old);
+	kvfree(old_pfns);
+	bitmap_free(old_clean);
+	pnvl_delta_free_dma(dma);
+	dma->prev = NULL;
+}
+
+/*
+ * Forget every range of mm, or of any process if NULL, with no send in
+ * flight.
+ */
+void pnvl_delta_flush(struct pnvl_dev *pnvl_dev, struct mm_struct *mm)
+{
+	struct pnvl_delta *delta, *tmp;
+	LIST_HEAD(unused);
+
+	spin_lock_irq(&pnvl_dev->delta_lock);
+	list_for_each_entry_safe(delta, tmp, &pnvl_dev->deltas, list) {
+		if (!delta->users && (!mm || delta->mm == mm)) {
+			list_move_tail(&delta->list, &unused);
+			pnvl_dev->ndeltas--;
+		}
+	}
+	spin_unlock_irq(&pnvl_dev->delta_lock);
+
+	pnvl_delta_free(&unused);
+}
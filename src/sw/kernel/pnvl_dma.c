@@ -7,22 +7,34 @@
 #include "hw/pnvl_hw.h"
 #include "pnvl_module.h"
 #include <linux/dma-mapping.h>
+#include <linux/io.h>
+#include <linux/slab.h>
 
-int pnvl_dma_pin_pages(struct pnvl_dma *dma)
+/*
+ * Buffers are not limited by the handle table of the device: the handles
+ * of larger ones are programmed in several windows. Physically contiguous
+ * pages, as those of a huge page, share one scatterlist entry.
+ */
+int pnvl_dma_pin_pages(struct pnvl_dma *dma, struct pci_dev *pdev)
 {
-	int first_page, last_page, npages, pinned, rv;
+	unsigned long first_page, last_page, npages;
+	unsigned int gup_flags = FOLL_LONGTERM;
+	int pinned, rv;
 	unsigned ofs;
 
+	if (!dma->len || dma->addr + dma->len < dma->addr)
+		return -EMSGSIZE;
+
 	ofs = dma->addr & ~PAGE_MASK;
-	first_page = (dma->addr & PAGE_MASK) >> PAGE_SHIFT;
-	last_page = ((dma->addr + dma->len - 1) & PAGE_MASK) >> PAGE_SHIFT;
+	first_page = dma->addr >> PAGE_SHIFT;
+	last_page = (dma->addr + dma->len - 1) >> PAGE_SHIFT;
 	npages = last_page - first_page + 1;
 	dma->npages = npages;
 
-	if (npages <= 0 || npages > PNVL_HW_BAR0_DMA_HANDLES_CNT)
+	if (npages > INT_MAX)
 		return -EMSGSIZE;
 
-	dma->pages = kmalloc_array(npages, sizeof(struct page *), GFP_KERNEL);
+	dma->pages = kvmalloc_array(npages, sizeof(struct page *), GFP_KERNEL);
 	if (!dma->pages)
 		return -ENOMEM;
 
@@ -42,13 +54,16 @@ int pnvl_dma_pin_pages(struct pnvl_dma *dma)
 	}
 	/* END VMA CHECK */
 
-	pinned = pin_user_pages_fast(dma->addr, npages,
-			FOLL_LONGTERM | FOLL_WRITE, dma->pages);
+	/* a delta send must not dirty the ptes it checks, see pnvl_delta.c */
+	if (!dma->delta)
+		gup_flags |= FOLL_WRITE;
+
+	pinned = pin_user_pages_fast(dma->addr, npages, gup_flags, dma->pages);
 	if (pinned == -EFAULT || pinned == -EAGAIN) { /* we can retry */
 		//pr_info("pin_user_pages - recoverable error, retrying\n");
 		down_read(&current->mm->mmap_lock);
-		pinned = pin_user_pages(dma->addr, npages,
-				FOLL_LONGTERM | FOLL_WRITE, dma->pages);
+		pinned = pin_user_pages(dma->addr, npages, gup_flags,
+				dma->pages);
 		up_read(&current->mm->mmap_lock);
 	}
 
@@ -63,7 +78,8 @@ int pnvl_dma_pin_pages(struct pnvl_dma *dma)
 	}
 
 	rv = sg_alloc_table_from_pages_segment(&dma->sgt, dma->pages, npages,
-			ofs, dma->len, PAGE_SIZE, GFP_KERNEL);
+			ofs, dma->len, dma_get_max_seg_size(&pdev->dev),
+			GFP_KERNEL);
 	if (rv < 0)
 		goto free_table;
 
@@ -74,7 +90,7 @@ free_table:
 unpin_pages:
 	unpin_user_pages(dma->pages, pinned);
 free_pages:
-	kfree(dma->pages);
+	kvfree(dma->pages);
 	return rv;
 }
 
@@ -86,35 +102,181 @@ int pnvl_dma_map_pages(struct pnvl_dma *dma, struct pci_dev *pdev)
 	return (int)dma->nmapped;
 }
 
-void pnvl_dma_write_setup(struct pnvl_dma *dma, struct pnvl_bar *bar, int mode,
+void pnvl_dma_write_setup(struct pnvl_dma *dma, void __iomem *bank, int mode,
 		enum dma_data_direction dir)
 {
 	dma->mode = mode;
 	dma->direction = dir;
-	iowrite32((u32)dma->mode, bar->mmio + PNVL_HW_BAR0_DMA_CFG_MOD);
+	iowrite32(dma->tag, bank + PNVL_HW_DMA_CFG_MATCH);
+	if (mode == PNVL_MODE_ACTIVE) {
+		iowrite32(dma->latency ? 1 : 0, bank + PNVL_HW_DMA_CFG_PRIO);
+		iowrite32(dma->inl ? 1 : 0, bank + PNVL_HW_DMA_CFG_INLINE);
+	}
 }
 
-void pnvl_dma_write_maps(struct pnvl_dma *dma, struct pnvl_bar *bar)
+/*
+ * Windows of the handle table hold whole extents, so each one can be
+ * sized before any of its words is written.
+ */
+#define PNVL_DMA_WINDOW (PNVL_HW_BAR0_DMA_HANDLES_CNT & ~1UL)
+
+/*
+ * Write word i of cnt. A new window of the handle table is opened as the
+ * previous one fills up.
+ */
+static void pnvl_dma_write_word(void __iomem *bank, unsigned long i,
+		unsigned long cnt, u32 val)
 {
-	dma_addr_t handle;
+	unsigned long pos = i % PNVL_DMA_WINDOW;
+
+	if (!pos) {
+		if (i)
+			iowrite32(1, bank + PNVL_HW_DMA_CFG_APPEND);
+		iowrite32((u32)min_t(unsigned long, cnt - i, PNVL_DMA_WINDOW),
+				bank + PNVL_HW_DMA_CFG_PGS);
+	}
+	iowrite32(val, bank + PNVL_HW_DMA_HANDLES + pos * sizeof(u32));
+}
+
+/* Write extent k of n, nothing when only counting them */
+static void pnvl_dma_emit(void __iomem *bank, unsigned long k,
+		unsigned long n, dma_addr_t addr, unsigned long len)
+{
+	if (!bank)
+		return;
+	pnvl_dma_write_word(bank, 2 * k, 2 * n, (u32)addr);
+	pnvl_dma_write_word(bank, 2 * k + 1, 2 * n, (u32)len);
+}
+
+/*
+ * Walk the mapped pieces of dma, merging those contiguous on the bus into
+ * extents, and write the n of them to bank. Returns how many there are.
+ */
+static unsigned long pnvl_dma_extents(struct pnvl_dma *dma,
+		void __iomem *bank, unsigned long n)
+{
+	unsigned long k = 0, i, len, cur_len = 0, left = dma->len;
+	dma_addr_t addr, cur = 0;
+	struct scatterlist *sg = dma->buf ? NULL : dma->sgt.sgl;
+	unsigned ofs = dma->addr & ~PAGE_MASK;
+
+	for (i = 0; i < dma->nmapped && left; i++) {
+		if (dma->buf) { /* slice of a registered buffer */
+			addr = dma->buf->handles[dma->first + i] + ofs;
+			len = min_t(unsigned long, PAGE_SIZE - ofs, left);
+			ofs = 0;
+		} else {
+			addr = sg_dma_address(sg);
+			len = min_t(unsigned long, sg_dma_len(sg), left);
+			sg = sg_next(sg);
+		}
+		left -= len;
+
+		if (cur_len && addr == cur + cur_len &&
+				cur_len + len <= U32_MAX) {
+			cur_len += len;
+			continue;
+		}
+		if (cur_len)
+			pnvl_dma_emit(bank, k++, n, cur, cur_len);
+		cur = addr;
+		cur_len = len;
+	}
+	if (cur_len)
+		pnvl_dma_emit(bank, k++, n, cur, cur_len);
+
+	return k;
+}
+
+/*
+ * Write one handle per page of dma, the first one carrying the offset of
+ * the data in its page.
+ */
+static void pnvl_dma_handles(struct pnvl_dma *dma, void __iomem *bank)
+{
+	unsigned long i = 0, k;
 	struct scatterlist *sg;
-	unsigned ofs = 0;
-	int i;
+	dma_addr_t addr, end;
 
-	iowrite32((u32)dma->len, bar->mmio + PNVL_HW_BAR0_DMA_CFG_LEN);
-	iowrite32((u32)dma->nmapped, bar->mmio + PNVL_HW_BAR0_DMA_CFG_PGS);
+	if (dma->buf) { /* slice of a registered buffer */
+		for (i = 0; i < dma->npages; i++) {
+			addr = dma->buf->handles[dma->first + i];
+			if (i == 0)
+				addr += dma->addr & ~PAGE_MASK;
+			pnvl_dma_write_word(bank, i, dma->npages, (u32)addr);
+		}
+		return;
+	}
 
-	for_each_sg(dma->sgt.sgl, sg, dma->nmapped, i) {
-		handle = sg_dma_address(sg);
-		iowrite32((u32)handle,
-				bar->mmio + PNVL_HW_BAR0_DMA_HANDLES + ofs);
-		ofs += sizeof(u32);
+	for_each_sg(dma->sgt.sgl, sg, dma->nmapped, k) {
+		addr = sg_dma_address(sg);
+		end = addr + sg_dma_len(sg);
+		for (; addr < end && i < dma->npages;
+				addr = (addr & PAGE_MASK) + PAGE_SIZE)
+			pnvl_dma_write_word(bank, i++, dma->npages, (u32)addr);
 	}
 }
 
-void pnvl_dma_doorbell_ring(struct pnvl_bar *bar)
+/*
+ * Program the buffer as one extent per bus contiguous run, which for huge
+ * pages is a single pair of words instead of hundreds of page handles.
+ * Scattered pages take fewer words as plain page handles.
+ */
+void pnvl_dma_write_maps(struct pnvl_dma *dma, void __iomem *bank)
+{
+	unsigned long n;
+
+	writeq(dma->len, bank + PNVL_HW_DMA_CFG_LEN);
+
+	n = pnvl_dma_extents(dma, NULL, 0);
+	if (2 * n >= dma->npages) {
+		iowrite32(0, bank + PNVL_HW_DMA_CFG_EXTENTS);
+		if (!dma->npages)
+			iowrite32(0, bank + PNVL_HW_DMA_CFG_PGS);
+		else
+			pnvl_dma_handles(dma, bank);
+		return;
+	}
+
+	iowrite32(1, bank + PNVL_HW_DMA_CFG_EXTENTS);
+	pnvl_dma_extents(dma, bank, n);
+}
+
+/*
+ * Copy the payload of an inline send into the inline window in 64-bit
+ * words, which a write-combined window merges into a few bus writes.
+ */
+void pnvl_dma_write_inline(struct pnvl_dma *dma, void __iomem *bank,
+		void __iomem *window, const void *payload)
 {
-	iowrite32(1, bar->mmio + PNVL_HW_BAR0_DMA_DOORBELL_RING);
+	writeq(dma->len, bank + PNVL_HW_DMA_CFG_LEN);
+	__iowrite64_copy(window, payload, DIV_ROUND_UP(dma->len, 8));
+	/* the payload must land before the doorbell */
+	wmb();
+}
+
+/*
+ * Tell the transmit engine which pages to send. Plain sends clear the
+ * delta flag left by an earlier delta. The dirty map covers one window of
+ * handles, larger deltas are turned into plain sends when prepared.
+ */
+void pnvl_dma_write_delta(struct pnvl_dma *dma, void __iomem *bank)
+{
+	unsigned long i;
+
+	iowrite32(dma->dirty ? 1 : 0, bank + PNVL_HW_DMA_CFG_DELTA);
+	if (!dma->dirty)
+		return;
+
+	for (i = 0; i < DIV_ROUND_UP(dma->npages, 32); i++)
+		iowrite32(dma->dirty[i],
+				bank + PNVL_HW_DMA_DIRTY + i * sizeof(u32));
+}
+
+void pnvl_dma_doorbell_ring(void __iomem *bank, u32 tag)
+{
+	iowrite32(tag, bank + PNVL_HW_DMA_CMD_TAG);
+	iowrite32(1, bank + PNVL_HW_DMA_DOORBELL_RING);
 }
 
 void pnvl_dma_unmap_pages(struct pnvl_dma *dma, struct pci_dev *pdev)
@@ -124,6 +286,10 @@ void pnvl_dma_unmap_pages(struct pnvl_dma *dma, struct pci_dev *pdev)
 
 void pnvl_dma_unpin_pages(struct pnvl_dma *dma)
 {
+	if (dma->filp) {
+		pnvl_cache_put_pages(dma);
+		return;
+	}
 	unpin_user_pages(dma->pages, dma->npages);
-	kfree(dma->pages);
+	kvfree(dma->pages);
 }
@@ -0,0 +1,257 @@
+/* pnvl_dmabuf.c - Sharing of buffers with other drivers through dma-buf
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include "pnvl_module.h"
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/dma-resv.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+MODULE_IMPORT_NS(DMA_BUF);
+
+/*
+ * Exported buffers are pinned user pages, mapped for every device that
+ * attaches and for every process that maps the dma-buf.
+ */
+static struct sg_table *pnvl_dmabuf_map(struct dma_buf_attachment *attach,
+		enum dma_data_direction dir)
+{
+	struct pnvl_buf *buf = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int rv;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	rv = sg_alloc_table_from_pages_segment(sgt, buf->dma.pages,
+			buf->dma.npages, 0, buf->dma.npages << PAGE_SHIFT,
+			dma_get_max_seg_size(attach->dev) & PAGE_MASK,
+			GFP_KERNEL);
+	if (rv < 0)
+		goto free_sgt;
+
+	rv = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (rv < 0)
+		goto free_table;
+
+	return sgt;
+
+free_table:
+	sg_free_table(sgt);
+free_sgt:
+	kfree(sgt);
+	return ERR_PTR(rv);
+}
+
+static void pnvl_dmabuf_unmap(struct dma_buf_attachment *attach,
+		struct sg_table *sgt, enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+/* the mapping holds the dma-buf, and so the buffer, until it is gone */
+static int pnvl_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct pnvl_buf *buf = dmabuf->priv;
+	unsigned long i, npages = vma_pages(vma);
+	int rv;
+
+	if (vma->vm_pgoff > buf->dma.npages ||
+			npages > buf->dma.npages - vma->vm_pgoff)
+		return -EINVAL;
+
+	for (i = 0; i < npages; i++) {
+		rv = remap_pfn_range(vma, vma->vm_start + i * PAGE_SIZE,
+				page_to_pfn(buf->dma.pages[vma->vm_pgoff + i]),
+				PAGE_SIZE, vma->vm_page_prot);
+		if (rv < 0)
+			return rv;
+	}
+
+	return 0;
+}
+
+static void pnvl_dmabuf_release(struct dma_buf *dmabuf)
+{
+	pnvl_buf_put(dmabuf->priv);
+}
+
+static const struct dma_buf_ops pnvl_dmabuf_ops = {
+	.map_dma_buf = pnvl_dmabuf_map,
+	.unmap_dma_buf = pnvl_dmabuf_unmap,
+	.mmap = pnvl_dmabuf_mmap,
+	.release = pnvl_dmabuf_release,
+};
+
+/*
+ * Export the whole pages of a registered buffer as a dma-buf, which holds
+ * a reference to the buffer until its last user is gone. Returns its fd.
+ * Only page aligned buffers are exported, the pages of others also hold
+ * memory around the buffer.
+ */
+long pnvl_dmabuf_export(struct pnvl_file *file, pnvl_key_t key)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp);
+	struct dma_buf *dmabuf;
+	struct pnvl_buf *buf;
+	int fd;
+
+	buf = pnvl_buf_get(file, key);
+	if (!buf)
+		return -ENOENT;
+	/* an imported buffer belongs to another driver */
+	if (!buf->dma.pages || ((buf->dma.addr | buf->dma.len) & ~PAGE_MASK)) {
+		pnvl_buf_put(buf);
+		return -EINVAL;
+	}
+
+	exp.ops = &pnvl_dmabuf_ops;
+	exp.size = buf->dma.npages << PAGE_SHIFT;
+	exp.flags = O_RDWR;
+	exp.priv = buf;
+	dmabuf = dma_buf_export(&exp);
+	if (IS_ERR(dmabuf)) {
+		pnvl_buf_put(buf);
+		return PTR_ERR(dmabuf);
+	}
+
+	fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+	if (fd < 0)
+		dma_buf_put(dmabuf);
+
+	return fd;
+}
+
+/*
+ * Bus address of every page of an imported buffer. Slices are programmed
+ * per page, so every segment must be page aligned and, but for the last
+ * one, a whole number of pages.
+ */
+static int pnvl_dmabuf_fill_handles(struct pnvl_buf *buf)
+{
+	unsigned long n = 0, len;
+	struct scatterlist *sg;
+	dma_addr_t handle;
+	int i;
+
+	buf->handles = kvmalloc_array(buf->dma.npages, sizeof(dma_addr_t),
+			GFP_KERNEL);
+	if (!buf->handles)
+		return -ENOMEM;
+
+	for_each_sgtable_dma_sg(buf->sgt, sg, i) {
+		handle = sg_dma_address(sg);
+		len = sg_dma_len(sg);
+		if ((handle & ~PAGE_MASK) || (!sg_is_last(sg) &&
+					(len & ~PAGE_MASK)))
+			return -EINVAL;
+		for (; len && n < buf->dma.npages; n++) {
+			buf->handles[n] = handle;
+			handle += PAGE_SIZE;
+			len -= min_t(unsigned long, len, PAGE_SIZE);
+		}
+	}
+
+	return n == buf->dma.npages ? 0 : -EINVAL;
+}
+
+/*
+ * Attach to and map a dma-buf of another driver, and register it as a
+ * buffer of the file. Returns its key, as REG_BUF does.
+ */
+long pnvl_dmabuf_import(struct pnvl_file *file, int fd)
+{
+	struct pci_dev *pdev = file->pnvl_dev->pdev;
+	struct dma_buf *dmabuf;
+	struct pnvl_buf *buf;
+	long rv;
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf) {
+		rv = -ENOMEM;
+		goto put_dmabuf;
+	}
+
+	buf->pnvl_dev = file->pnvl_dev;
+	buf->dma.addr = 0;
+	buf->dma.len = dmabuf->size;
+	buf->dma.npages = DIV_ROUND_UP(dmabuf->size, PAGE_SIZE);
+	buf->dma.nmapped = buf->dma.npages;
+	buf->dma.mode = PNVL_MODE_OFF;
+	buf->dma.direction = DMA_BIDIRECTIONAL;
+	kref_init(&buf->ref);
+
+	if (!buf->dma.len) {
+		rv = -EINVAL;
+		goto free_buf;
+	}
+
+	buf->attach = dma_buf_attach(dmabuf, &pdev->dev);
+	if (IS_ERR(buf->attach)) {
+		rv = PTR_ERR(buf->attach);
+		goto free_buf;
+	}
+
+	buf->sgt = dma_buf_map_attachment_unlocked(buf->attach,
+			DMA_BIDIRECTIONAL);
+	if (IS_ERR(buf->sgt)) {
+		rv = PTR_ERR(buf->sgt);
+		goto detach;
+	}
+
+	rv = pnvl_dmabuf_fill_handles(buf);
+	if (rv < 0)
+		goto unmap;
+
+	return (long)pnvl_buf_add(file, buf);
+
+unmap:
+	kvfree(buf->handles);
+	dma_buf_unmap_attachment_unlocked(buf->attach, buf->sgt,
+			DMA_BIDIRECTIONAL);
+detach:
+	dma_buf_detach(dmabuf, buf->attach);
+free_buf:
+	kfree(buf);
+put_dmabuf:
+	dma_buf_put(dmabuf);
+	return rv;
+}
+
+/*
+ * Wait for the other users of an imported buffer to be done with it before
+ * an op: for its writers before a send, for everyone before a receive.
+ */
+int pnvl_dmabuf_wait(struct pnvl_buf *buf, bool send)
+{
+	long rv;
+
+	rv = dma_resv_wait_timeout(buf->attach->dmabuf->resv,
+			send ? DMA_RESV_USAGE_WRITE : DMA_RESV_USAGE_READ,
+			true, MAX_SCHEDULE_TIMEOUT);
+
+	return rv < 0 ? (int)rv : 0;
+}
+
+/* Give an imported buffer back to its exporter, once unused */
+void pnvl_dmabuf_detach(struct pnvl_buf *buf)
+{
+	struct dma_buf *dmabuf = buf->attach->dmabuf;
+
+	dma_buf_unmap_attachment_unlocked(buf->attach, buf->sgt,
+			DMA_BIDIRECTIONAL);
+	dma_buf_detach(dmabuf, buf->attach);
+	dma_buf_put(dmabuf);
+}
@@ -13,18 +13,30 @@ static inline void pnvl_irq_ack(struct pnvl_dev *pnvl_dev)
 	iowrite32(1, pnvl_dev->irq.mmio_ack_irq);
 }
 
+/*
+ * The hard handler only acks. Retiring an op unmaps and unpins its pages,
+ * and launching one runs the whole transfer on the doorbell, so both are
+ * left to the IRQ thread.
+ */
 static irqreturn_t pnvl_irq_handler(int irq, void *data)
 {
 	struct pnvl_dev *pnvl_dev = data;
 
 	pnvl_irq_ack(pnvl_dev);
-	pnvl_ops_next(pnvl_dev);
 
 	/*
 	dev_dbg(&pnvl_dev->pdev->dev, "irq_handler irq = %d dev = %d\n", irq,
 		pnvl_dev->major);
 	*/
 
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t pnvl_irq_thread(int irq, void *data)
+{
+	struct pnvl_dev *pnvl_dev = data;
+
+	pnvl_ops_next(pnvl_dev);
 	return IRQ_HANDLED;
 }
 
@@ -51,8 +63,8 @@ static int pnvl_irq_enable_vectors(struct pnvl_dev *pnvl_dev)
 		goto err_clean_irqs;
 	}
 
-	err = request_irq(pnvl_dev->irq.irq_num, pnvl_irq_handler,
-			  PNVL_HW_IRQ_WORK_ENDED_VECTOR,
+	err = request_threaded_irq(pnvl_dev->irq.irq_num, pnvl_irq_handler,
+			  pnvl_irq_thread, PNVL_HW_IRQ_WORK_ENDED_VECTOR,
 			  "pnvl_irq_dma_ended", pnvl_dev);
 	if (err)
 		goto err_clean_irqs;
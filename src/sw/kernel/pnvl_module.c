@@ -10,6 +10,8 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/pci.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 
 MODULE_LICENSE("GPL");
@@ -17,6 +19,10 @@ MODULE_VERSION("1.0");
 MODULE_DESCRIPTION("Kernel module to control the pnvl virtual device");
 MODULE_AUTHOR("David Cañadas López <dcanadas@bsc.es>");
 
+static unsigned int chunk_kb = PNVL_HW_DMA_CHUNK_DEFAULT >> 10;
+module_param(chunk_kb, uint, 0444);
+MODULE_PARM_DESC(chunk_kb, "Bytes a bulk send moves before latency sends may run, in KiB (0 = whole sends)");
+
 static struct class *pnvl_class;
 
 static struct pci_device_id pnvl_id_table[] = {
@@ -30,6 +36,7 @@ static int pnvl_open(struct inode *inode, struct file *fp)
 {
 	unsigned int bar = iminor(inode);
 	struct pnvl_dev *pnvl_dev;
+	struct pnvl_file *file;
 
 	pnvl_dev = container_of(inode->i_cdev, struct pnvl_dev, cdev);
 
@@ -38,91 +45,193 @@ static int pnvl_open(struct inode *inode, struct file *fp)
 	if (pnvl_dev->bar.len == 0)
 		return -EIO;
 
-	fp->private_data = pnvl_dev;
+	file = kmalloc(sizeof(*file), GFP_KERNEL);
+	if (!file)
+		return -ENOMEM;
+
+	file->pnvl_dev = pnvl_dev;
+	kref_init(&file->ref);
+	spin_lock_init(&file->lock);
+	INIT_LIST_HEAD(&file->bufs);
+	INIT_LIST_HEAD(&file->maps);
+	file->next_key = 0;
+	spin_lock_init(&file->done_lock);
+	mutex_init(&file->read_lock);
+	INIT_KFIFO(file->done);
+	init_waitqueue_head(&file->poll_wq);
+	pnvl_ops_init_file(file);
+	fp->private_data = file;
 
 	return 0;
 }
 
-static bool pnvl_check_size_avail(struct pnvl_dma *dma, struct pnvl_bar *bar)
+static void pnvl_file_free(struct kref *ref)
 {
-	return dma->len <= ioread32(bar->mmio + PNVL_HW_BAR0_DMA_CFG_LEN_AVAIL);
+	kfree(container_of(ref, struct pnvl_file, ref));
 }
 
-static void pnvl_set_size_avail(struct pnvl_dma *dma, struct pnvl_bar *bar)
+void pnvl_file_put(struct pnvl_file *file)
 {
-	iowrite32((u32)dma->len, bar->mmio + PNVL_HW_BAR0_DMA_CFG_LEN_AVAIL);
+	kref_put(&file->ref, pnvl_file_free);
 }
 
-long pnvl_ioctl_send(struct pnvl_dev *pnvl_dev, struct pnvl_dma *dma)
+/*
+ * Ops still running keep the file state alive, they report to it when
+ * they finish.
+ */
+static int pnvl_release(struct inode *inode, struct file *fp)
 {
-	struct pnvl_bar *bar = &pnvl_dev->bar;
-	int rv = 0;
+	struct pnvl_file *file = fp->private_data;
 
-	pnvl_dma_write_setup(dma, bar, PNVL_MODE_ACTIVE, DMA_TO_DEVICE);
-	if (!pnvl_check_size_avail(dma, bar))
-		return -EMSGSIZE;
+	pnvl_ops_fini_file(file);
+	pnvl_buf_release(file);
+	pnvl_file_put(file);
 
-	rv = pnvl_dma_map_pages(dma, pnvl_dev->pdev);
-	if (rv < 0) {
-		pnvl_dma_unpin_pages(dma); /* there will be no irq */
-		return rv;
+	return 0;
+}
+
+/*
+ * Handles of the ops issued through this file that finished since the
+ * last read, in the order they did.
+ */
+static ssize_t pnvl_read(struct file *fp, char __user *ubuf, size_t len,
+		loff_t *ppos)
+{
+	struct pnvl_file *file = fp->private_data;
+	unsigned int copied;
+	int rv;
+
+	len -= len % sizeof(pnvl_handle_t);
+	if (!len)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&file->read_lock))
+		return -ERESTARTSYS;
+
+	while (kfifo_is_empty(&file->done)) {
+		mutex_unlock(&file->read_lock);
+		if (fp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(file->poll_wq,
+					!kfifo_is_empty(&file->done)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&file->read_lock))
+			return -ERESTARTSYS;
 	}
 
-	//pr_info("pnvl_dma_map_pages - success\n");
+	rv = kfifo_to_user(&file->done, ubuf, len, &copied);
+	mutex_unlock(&file->read_lock);
 
-	pnvl_dma_write_maps(dma, bar);
-	pnvl_dma_doorbell_ring(bar);
+	return rv ? rv : copied;
+}
 
-	//pr_info("pnvl_ioctl_send - success\n");
+static __poll_t pnvl_poll(struct file *fp, poll_table *wait)
+{
+	struct pnvl_file *file = fp->private_data;
 
-	return (long)rv;
+	poll_wait(fp, &file->poll_wq, wait);
+
+	return kfifo_is_empty(&file->done) ? 0 : EPOLLIN | EPOLLRDNORM;
 }
 
-long pnvl_ioctl_recv(struct pnvl_dev *pnvl_dev, struct pnvl_dma *dma)
+static void pnvl_set_size_avail(struct pnvl_dma *dma, void __iomem *bank)
 {
-	struct pnvl_bar *bar = &pnvl_dev->bar;
-	int rv = 0;
-
-	pnvl_dma_write_setup(dma, bar, PNVL_MODE_PASSIVE, DMA_FROM_DEVICE);
-	pnvl_set_size_avail(dma, bar);
+	writeq(dma->len, bank + PNVL_HW_DMA_CFG_LEN_AVAIL);
+}
 
-	rv = pnvl_dma_map_pages(dma, pnvl_dev->pdev);
-	if (rv < 0) {
-		pnvl_dma_unpin_pages(dma); /* there will be no irq */
-		return rv;
+/*
+ * Program a device command for an already pinned and mapped op. Length
+ * checks against the peer are done by the device when the command runs.
+ * Sends and receives go through different engine banks, so the queues of
+ * both directions can program the device at the same time.
+ */
+long pnvl_ioctl_send(struct pnvl_dev *pnvl_dev, struct pnvl_op *op)
+{
+	void __iomem *bank = op->queue->bank;
+
+	pnvl_dma_write_setup(&op->dma, bank, PNVL_MODE_ACTIVE, DMA_TO_DEVICE);
+	if (op->dma.inl) {
+		pnvl_dma_write_inline(&op->dma, bank, pnvl_dev->bar.wc ?:
+				bank + PNVL_HW_DMA_INLINE, op->payload);
+	} else {
+		pnvl_dma_write_maps(&op->dma, bank);
+		pnvl_dma_write_delta(&op->dma, bank);
 	}
+	pnvl_dma_doorbell_ring(bank, (u32)op->id);
 
-	//pr_info("pnvl_dma_map_pages - success\n");
+	return 0;
+}
 
-	pnvl_dma_write_maps(dma, bar);
-	pnvl_dma_doorbell_ring(bar);
+long pnvl_ioctl_recv(struct pnvl_dev *pnvl_dev, struct pnvl_op *op)
+{
+	void __iomem *bank = op->queue->bank;
 
-	//pr_info("pnvl_ioctl_recv - success\n");
+	pnvl_dma_write_setup(&op->dma, bank, PNVL_MODE_PASSIVE,
+			DMA_FROM_DEVICE);
+	pnvl_set_size_avail(&op->dma, bank);
+	pnvl_dma_write_maps(&op->dma, bank);
+	pnvl_dma_doorbell_ring(bank, (u32)op->id);
 
-	return (long)rv;
+	return 0;
+}
+
+static int pnvl_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+	return pnvl_buf_mmap(fp->private_data, vma);
 }
 
 static long pnvl_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 {
-	struct pnvl_dev *pnvl_dev = fp->private_data;
+	struct pnvl_file *file = fp->private_data;
+	struct pnvl_dev *pnvl_dev = file->pnvl_dev;
 	struct pnvl_op *op;
 	pnvl_handle_t id;
 	long rv = -ENOTTY;
 
 	switch(cmd) {
 	case PNVL_IOCTL_SEND:
+	case PNVL_IOCTL_SEND_DELTA:
 	case PNVL_IOCTL_RECV:
-		op = pnvl_ops_new(cmd, arg);
+	case PNVL_IOCTL_SEND_REG:
+	case PNVL_IOCTL_RECV_REG:
+	case PNVL_IOCTL_SEND_FILE:
+	case PNVL_IOCTL_RECV_FILE:
+		op = pnvl_ops_new(file, cmd, arg);
 		id = pnvl_ops_init(pnvl_dev, op);
 		rv = (long)id;
 		break;
 	case PNVL_IOCTL_WAIT:
 		id = (pnvl_handle_t)arg;
-		op = pnvl_ops_get(&pnvl_dev->ops, id);
-		rv = pnvl_ops_wait(op);
+		op = pnvl_ops_get(file, id);
+		rv = pnvl_ops_wait(&pnvl_dev->ops, op);
+		break;
+	case PNVL_IOCTL_SUBMITV:
+		rv = pnvl_ops_submitv(file, arg);
+		break;
+	case PNVL_IOCTL_WAITV:
+		rv = pnvl_ops_waitv(file, arg);
+		break;
+	case PNVL_IOCTL_NOTIFY:
+		rv = pnvl_ops_notify(file, arg);
 		break;
 	case PNVL_IOCTL_FLUSH:
-		rv = pnvl_ops_flush(pnvl_dev);
+		rv = pnvl_ops_flush(pnvl_dev, file);
+		pnvl_delta_flush(pnvl_dev, current->mm);
+		break;
+	case PNVL_IOCTL_REG_BUF:
+		rv = pnvl_buf_reg(file, arg);
+		break;
+	case PNVL_IOCTL_UNREG_BUF:
+		rv = pnvl_buf_unreg(file, (pnvl_key_t)arg);
+		break;
+	case PNVL_IOCTL_EXPORT_BUF:
+		rv = pnvl_dmabuf_export(file, (pnvl_key_t)arg);
+		break;
+	case PNVL_IOCTL_IMPORT_BUF:
+		rv = pnvl_dmabuf_import(file, (int)arg);
+		break;
+	case PNVL_IOCTL_SPIN:
+		rv = pnvl_ops_set_spin(file, arg);
 		break;
 	}
 
@@ -132,6 +241,11 @@ static long pnvl_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 static const struct file_operations pnvl_fops = {
 	.owner = THIS_MODULE,
 	.open = pnvl_open,
+	.release = pnvl_release,
+	.mmap = pnvl_mmap,
+	.read = pnvl_read,
+	.poll = pnvl_poll,
+	.uring_cmd = pnvl_uring_issue,
 	.unlocked_ioctl = pnvl_ioctl,
 };
 
@@ -140,6 +254,8 @@ static void pnvl_dev_clean(struct pnvl_dev *pnvl_dev)
 	pnvl_dev->bar.start = 0;
 	pnvl_dev->bar.end = 0;
 	pnvl_dev->bar.len = 0;
+	if (pnvl_dev->bar.wc)
+		iounmap(pnvl_dev->bar.wc);
 	if (pnvl_dev->bar.mmio)
 		pci_iounmap(pnvl_dev->pdev, pnvl_dev->bar.mmio);
 }
@@ -159,19 +275,31 @@ static int pnvl_dev_init(struct pnvl_dev *pnvl_dev, struct pci_dev *pdev)
 		pnvl_dev_clean(pnvl_dev);
 		return -ENOMEM;
 	}
+	/* where the platform refuses it, the window is written uncached */
+	pnvl_dev->bar.wc = ioremap_wc(pnvl_dev->bar.start +
+			PNVL_HW_BAR0_DMA_TX + PNVL_HW_DMA_INLINE,
+			PNVL_HW_DMA_INLINE_SIZE);
 	pci_set_drvdata(pdev, pnvl_dev);
+	iowrite32(chunk_kb << 10, pnvl_dev->bar.mmio + PNVL_HW_BAR0_DMA_CHUNK);
 
-	spin_lock_init(&pnvl_dev->ops.lock);
-	INIT_LIST_HEAD(&pnvl_dev->ops.active);
-	INIT_LIST_HEAD(&pnvl_dev->ops.inactive);
-	pnvl_dev->ops.next_id = 0;
+	pnvl_ops_init_ops(&pnvl_dev->ops);
+	pnvl_ops_init_queue(&pnvl_dev->ops.tx,
+			pnvl_dev->bar.mmio + PNVL_HW_BAR0_DMA_TX);
+	pnvl_ops_init_queue(&pnvl_dev->ops.rx,
+			pnvl_dev->bar.mmio + PNVL_HW_BAR0_DMA_RX);
+
+	spin_lock_init(&pnvl_dev->delta_lock);
+	INIT_LIST_HEAD(&pnvl_dev->deltas);
+	pnvl_dev->ndeltas = 0;
+
+	pnvl_pin_init(pnvl_dev);
 
 	return 0;
 }
 
 static struct pnvl_dev *pnvl_alloc_dev(void)
 {
-	return kmalloc(sizeof(struct pnvl_dev), GFP_KERNEL);
+	return kzalloc(sizeof(struct pnvl_dev), GFP_KERNEL);
 }
 
 static int pnvl_probe(struct pci_dev *pdev, const struct pci_device_id *id)
@@ -210,6 +338,14 @@ static int pnvl_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		goto err_dma_set_mask;
 	}
 
+	/*
+	 * Let contiguous pages, as those of huge pages, map as one segment,
+	 * as long as it can be mapped as one (swiotlb limits that).
+	 */
+	dma_set_max_seg_size(&pdev->dev, min_t(size_t,
+				dma_max_mapping_size(&pdev->dev), UINT_MAX) &
+			PAGE_MASK);
+
 	/* verify no other device is already using the same address resource */
 	mem_bars = pci_select_bars(pdev, IORESOURCE_MEM);
 	if ((mem_bars & (1 << PNVL_HW_BAR0)) == 0) {
@@ -314,13 +450,18 @@ static void pnvl_remove(struct pci_dev *pdev)
 	cdev_del(&pnvl_dev->cdev);
 	unregister_chrdev_region(MKDEV(pnvl_dev->major, pnvl_dev->minor),
 			PNVL_HW_BAR_CNT);
-	pnvl_dev_clean(pnvl_dev);
+	/* stop DMA and the IRQ thread before the ops and the BAR go away */
 	pci_clear_master(pdev);
 	free_irq(pnvl_dev->irq.irq_num, pnvl_dev);
+	pnvl_ops_flush(pnvl_dev, NULL);
+	pnvl_delta_flush(pnvl_dev, NULL);
+	pnvl_pin_flush(pnvl_dev);
+	pnvl_dev_clean(pnvl_dev);
 	pci_release_selected_regions(pdev, pci_select_bars(pdev,
 				IORESOURCE_MEM));
 	pci_disable_device(pdev);
 
+	pnvl_ops_fini_ops(&pnvl_dev->ops);
 	kfree(pnvl_dev);
 
 	dev_info(&pdev->dev, "pnvl remove - success\n");
@@ -337,6 +478,7 @@ static void pnvl_module_exit(void)
 {
 	pci_unregister_driver(&pnvl_pci_driver);
 	class_destroy(pnvl_class);
+	pnvl_ops_cache_fini();
 	pr_debug("pnvl_module_exit finished successfully\n");
 }
 
@@ -350,11 +492,16 @@ static char *pnvl_devnode(const struct device *dev, umode_t *mode)
 static int __init pnvl_module_init(void)
 {
 	int err;
+	err = pnvl_ops_cache_init();
+	if (err) {
+		pr_err("pnvl_ops_cache_init error\n");
+		return err;
+	}
 	pnvl_class = class_create("pnvl");
 	if (IS_ERR(pnvl_class)) {
 		pr_err("class_create error\n");
 		err = PTR_ERR(pnvl_class);
-		return err;
+		goto err_class;
 	}
 	pnvl_class->devnode = pnvl_devnode;
 	err = pci_register_driver(&pnvl_pci_driver);
@@ -366,6 +513,8 @@ static int __init pnvl_module_init(void)
 	return 0;
 err_pci:
 	class_destroy(pnvl_class);
+err_class:
+	pnvl_ops_cache_fini();
 	pr_err("pnvl_module_init failed with err=%d\n", err);
 	return err;
 }
@@ -15,11 +15,28 @@
 #include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/interval_tree.h>
+#include <linux/mmu_notifier.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/eventfd.h>
+#include <linux/io_uring.h>
 
 #define PNVL_MODE_ACTIVE 1
 #define PNVL_MODE_PASSIVE 0
 #define PNVL_MODE_OFF -1
 
+#define PNVL_OP_PENDING 0 // queued on the driver, or being flushed
+#define PNVL_OP_ACTIVE 1 // submitted to the device
+#define PNVL_OP_DONE 2
+
+#define PNVL_DONE_CNT 256 // finished op handles kept for read(), power of 2
+
+#define PNVL_DELTA_CNT 64 // ranges whose page checksums are remembered
+
 //struct pnvl_dev; /* forward declaration */
 
 struct pnvl_bar {
@@ -27,6 +44,7 @@ struct pnvl_bar {
 	u64 end;
 	u64 len;
 	void __iomem *mmio;
+	void __iomem *wc; // write-combined TX inline window, NULL if unavailable
 };
 
 struct pnvl_irq {
@@ -43,13 +61,84 @@ struct pnvl_dma {
 	unsigned long nmapped;
 	unsigned long addr;
 	unsigned long len;
+	u32 tag;
+	bool latency; // launched first, sent in between chunks of bulk sends
+	bool inl; // small send copied through the inline window, no pages
+	bool delta; // only send pages changed since the last delta
+	u64 *sums; // page checksums, delta only
+	u32 *dirty; // pages to send, delta only
+	unsigned long *pfns; // of the pinned pages, delta only
+	unsigned long *clean; // pages mapped by a clean pte, delta only
+	unsigned long clean_seq; // notifier sequence of prev when scanned
+	struct pnvl_delta *prev; // last delta send of the same range
+	struct pnvl_buf *buf; // registered buffer the op is a slice of
+	unsigned long first; // first page of the slice in buf
+	struct file *filp; // whose page cache pages are used, addr is an offset
+};
+
+struct pnvl_buf {
+	struct list_head list;
+	pnvl_key_t key;
+	struct kref ref; // registration and ops in flight
+	struct pnvl_dev *pnvl_dev;
+	struct pnvl_dma dma; // pinned and mapped for both directions
+	dma_addr_t *handles; // of every page of dma
+	void *vaddr; // coherent memory mmap'ed by the user, NULL if pinned
+	dma_addr_t base; // bus address of vaddr
+	struct pnvl_file *file; // mmap'ed only
+	struct mm_struct *mm; // mmap'ed only
+	struct dma_buf_attachment *attach; // imported dma-buf, NULL otherwise
+	struct sg_table *sgt; // of attach
+};
+
+struct pnvl_delta {
+	struct list_head list;
+	struct mmu_interval_notifier notifier; // forgets clean on any change
+	struct pnvl_dev *pnvl_dev;
+	struct mm_struct *mm;
+	unsigned long addr;
+	unsigned long len;
+	unsigned long npages;
+	u64 *sums; // of the last completed send, NULL if none
+	unsigned long *pfns; // of the pages of that send
+	unsigned long *clean; // pages of that send mapped by a clean pte
+	unsigned int users; // delta sends in flight
+};
+
+struct pnvl_queue {
+	struct mutex lock; // to lock queue and engine bank access
+	void __iomem *bank; // registers of the device engine
+	unsigned int nslots; // free device command slots
+	struct list_head urgent; // latency ops waiting for a slot, go first
+	struct list_head flows; // of the files with ops waiting for a slot
+	struct list_head active; // submitted to the device
+};
+
+/*
+ * Ops of one file waiting for a slot of one engine. Files take turns to
+ * launch, each up to its deficit of bytes.
+ */
+struct pnvl_flow {
+	struct list_head node; // in the queue flows, while ops are pending
+	struct list_head pending;
+	long deficit; // bytes the file may still launch this turn
 };
 
 struct pnvl_ops {
-	pnvl_handle_t next_id; // to identify an op
-	spinlock_t lock; // to lock queue access
-	struct list_head active;
-	struct list_head inactive;
+	struct xarray xa; // handle to op, until waited for or flushed
+	u32 next_id; // to identify an op
+	wait_queue_head_t done_wq; // woken whenever an op finishes
+	struct pnvl_queue tx; // sends, on the transmit engine
+	struct pnvl_queue rx; // receives, on the receive engine
+};
+
+struct pnvl_pins {
+	spinlock_t lock; // to lock the tree and lists
+	struct rb_root_cached tree; // cached ranges by user address
+	struct list_head lru; // least recently used first
+	struct list_head dead; // invalidated, to be freed by reap
+	unsigned long bytes; // pinned by cached ranges
+	struct work_struct reap;
 };
 
 struct pnvl_dev {
@@ -57,39 +146,126 @@ struct pnvl_dev {
 	struct pnvl_bar bar;
 	struct pnvl_irq irq;
 	struct pnvl_ops ops;
+	struct list_head deltas; // least recently sent first
+	unsigned int ndeltas;
+	spinlock_t delta_lock;
+	struct pnvl_pins pins;
 	dev_t minor, major;
 	struct cdev cdev;
 };
 
+struct pnvl_file {
+	struct pnvl_dev *pnvl_dev;
+	struct kref ref; // open file and ops in flight
+	spinlock_t lock; // to lock the registered buffer list
+	struct list_head bufs;
+	struct list_head maps; // buffers mmap'ed from the file
+	pnvl_key_t next_key;
+	spinlock_t done_lock; // to lock done writers, taken from the IRQ thread
+	struct mutex read_lock; // to lock done readers
+	DECLARE_KFIFO(done, pnvl_handle_t, PNVL_DONE_CNT);
+	wait_queue_head_t poll_wq;
+	struct pnvl_flow tx, rx; // ops of the file waiting for the engines
+	bool closed; // its ops are reclaimed when done, under the ops xa lock
+	unsigned int spin_us; // cap of WAIT spins, PNVL_SPIN_DEFAULT for the param
+	u64 wait_ns; // moving average of how long WAITs had to wait
+};
+
 struct pnvl_op {
 	struct list_head list;
 	wait_queue_head_t waitq;
 	atomic_t nwaiting;
-	int flag; // for the wait queue
+	int state; // PNVL_OP_*, for the wait queue
 	pnvl_handle_t id;
+	struct pnvl_file *file; // issued through, told when the op is done
+	struct eventfd_ctx *efd; // signalled when the op is done, optional
+	struct io_uring_cmd *ucmd; // completed when the op is done, optional
+	bool uring; // issued by an io_uring command
+	struct pnvl_queue *queue;
+	bool cancelled; // flushed while on the device, fails once it is done
 	long retval;
-	long (*ioctl_fn)(struct pnvl_dev *, struct pnvl_dma *);
+	u64 done_ns; // when the op finished, to tune WAIT spins
+	long (*ioctl_fn)(struct pnvl_dev *, struct pnvl_op *);
 	struct pnvl_dma dma;
+	u8 payload[PNVL_HW_DMA_INLINE_SIZE] __aligned(8); // of an inline send
 };
 
-long pnvl_ioctl_send(struct pnvl_dev *pnvl_dev, struct pnvl_dma *dma);
-long pnvl_ioctl_recv(struct pnvl_dev *pnvl_dev, struct pnvl_dma *dma);
+long pnvl_ioctl_send(struct pnvl_dev *pnvl_dev, struct pnvl_op *op);
+long pnvl_ioctl_recv(struct pnvl_dev *pnvl_dev, struct pnvl_op *op);
+void pnvl_file_put(struct pnvl_file *file);
 
-int pnvl_dma_pin_pages(struct pnvl_dma *dma);
+int pnvl_dma_pin_pages(struct pnvl_dma *dma, struct pci_dev *pdev);
 void pnvl_dma_unpin_pages(struct pnvl_dma *dma);
 int pnvl_dma_map_pages(struct pnvl_dma *dma, struct pci_dev *pdev);
 void pnvl_dma_unmap_pages(struct pnvl_dma *dma, struct pci_dev *pdev);
-void pnvl_dma_write_setup(struct pnvl_dma *dma, struct pnvl_bar *bar, int mode, enum dma_data_direction dir);
-void pnvl_dma_write_maps(struct pnvl_dma *dma, struct pnvl_bar *bar);
-void pnvl_dma_doorbell_ring(struct pnvl_bar *bar);
+void pnvl_dma_write_setup(struct pnvl_dma *dma, void __iomem *bank, int mode, enum dma_data_direction dir);
+void pnvl_dma_write_maps(struct pnvl_dma *dma, void __iomem *bank);
+void pnvl_dma_write_inline(struct pnvl_dma *dma, void __iomem *bank,
+		void __iomem *window, const void *payload);
+void pnvl_dma_write_delta(struct pnvl_dma *dma, void __iomem *bank);
+void pnvl_dma_doorbell_ring(void __iomem *bank, u32 tag);
 
-struct pnvl_op *pnvl_ops_new(unsigned int cmd, unsigned long uarg);
+int pnvl_delta_prepare(struct pnvl_dev *pnvl_dev, struct pnvl_dma *dma);
+void pnvl_delta_finish(struct pnvl_dev *pnvl_dev, struct pnvl_dma *dma, bool ok);
+void pnvl_delta_flush(struct pnvl_dev *pnvl_dev, struct mm_struct *mm);
+
+struct pnvl_buf *pnvl_buf_create(struct pnvl_dev *pnvl_dev, unsigned long addr,
+		unsigned long len);
+int pnvl_buf_slice(struct pnvl_buf *buf, struct pnvl_dma *dma,
+		unsigned long addr, unsigned long len);
+void pnvl_buf_sync(struct pnvl_buf *buf, struct pnvl_dma *dma,
+		bool for_device);
+pnvl_key_t pnvl_buf_add(struct pnvl_file *file, struct pnvl_buf *buf);
+long pnvl_buf_reg(struct pnvl_file *file, unsigned long uarg);
+long pnvl_buf_unreg(struct pnvl_file *file, pnvl_key_t key);
+struct pnvl_buf *pnvl_buf_get(struct pnvl_file *file, pnvl_key_t key);
+void pnvl_buf_put(struct pnvl_buf *buf);
+void pnvl_buf_release(struct pnvl_file *file);
+int pnvl_buf_mmap(struct pnvl_file *file, struct vm_area_struct *vma);
+int pnvl_buf_find_mmap(struct pnvl_file *file, struct pnvl_dma *dma);
+
+int pnvl_cache_new(struct pnvl_op *op, unsigned int cmd, unsigned long uarg);
+int pnvl_cache_get_pages(struct pnvl_dma *dma, struct pci_dev *pdev);
+void pnvl_cache_finish(struct pnvl_dma *dma, bool ok);
+void pnvl_cache_put_pages(struct pnvl_dma *dma);
+
+long pnvl_dmabuf_export(struct pnvl_file *file, pnvl_key_t key);
+long pnvl_dmabuf_import(struct pnvl_file *file, int fd);
+int pnvl_dmabuf_wait(struct pnvl_buf *buf, bool send);
+void pnvl_dmabuf_detach(struct pnvl_buf *buf);
+
+int pnvl_pin_get(struct pnvl_dev *pnvl_dev, struct pnvl_dma *dma);
+void pnvl_pin_init(struct pnvl_dev *pnvl_dev);
+void pnvl_pin_flush(struct pnvl_dev *pnvl_dev);
+
+int pnvl_ops_set_tag(struct pnvl_dma *dma, pnvl_tag_t tag);
+struct pnvl_op *pnvl_ops_new(struct pnvl_file *file, unsigned int cmd,
+		unsigned long uarg);
+struct pnvl_op *pnvl_ops_new_data(struct pnvl_file *file, unsigned int cmd,
+		const struct pnvl_data *data);
 pnvl_handle_t pnvl_ops_init(struct pnvl_dev *pnvl_dev, struct pnvl_op *op);
-struct pnvl_op *pnvl_ops_current(struct pnvl_ops *ops);
-long pnvl_ops_wait(struct pnvl_op *op);
+long pnvl_ops_wait(struct pnvl_ops *ops, struct pnvl_op *op);
+long pnvl_ops_set_spin(struct pnvl_file *file, unsigned long us);
+long pnvl_ops_notify(struct pnvl_file *file, unsigned long uarg);
+long pnvl_ops_submitv(struct pnvl_file *file, unsigned long uarg);
+long pnvl_ops_waitv(struct pnvl_file *file, unsigned long uarg);
+long pnvl_ops_wait_uring(struct pnvl_file *file, pnvl_handle_t id,
+		struct io_uring_cmd *ucmd);
+void pnvl_ops_put(struct pnvl_ops *ops, struct pnvl_op *op);
 void pnvl_ops_next(struct pnvl_dev *pnvl_dev);
-struct pnvl_op *pnvl_ops_get(struct pnvl_ops *ops, pnvl_handle_t id);
-int pnvl_ops_flush(struct pnvl_dev *pnvl_dev);
+void pnvl_ops_init_queue(struct pnvl_queue *queue, void __iomem *bank);
+void pnvl_ops_init_file(struct pnvl_file *file);
+void pnvl_ops_fini_file(struct pnvl_file *file);
+struct pnvl_op *pnvl_ops_get(struct pnvl_file *file, pnvl_handle_t id);
+int pnvl_ops_flush(struct pnvl_dev *pnvl_dev, struct pnvl_file *file);
+void pnvl_ops_init_ops(struct pnvl_ops *ops);
+void pnvl_ops_fini_ops(struct pnvl_ops *ops);
+int pnvl_ops_cache_init(void);
+void pnvl_ops_cache_fini(void);
+
+int pnvl_uring_issue(struct io_uring_cmd *ucmd, unsigned int issue_flags);
+void pnvl_uring_attach(struct io_uring_cmd *ucmd, struct pnvl_op *op);
+void pnvl_uring_complete(struct io_uring_cmd *ucmd);
 
 int pnvl_irq_enable(struct pnvl_dev *pnvl_dev);
 
@@ -0,0 +1,252 @@
+/* pnvl_pin.c - Cache of pinned and mapped user ranges
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include "pnvl_module.h"
+#include <linux/module.h>
+#include <linux/slab.h>
+
+static unsigned int pin_cache_mb = 64;
+module_param(pin_cache_mb, uint, 0644);
+MODULE_PARM_DESC(pin_cache_mb, "Max pinned memory kept for reuse, in MiB (0 = off)");
+
+/*
+ * Ranges of plain sends and receives stay pinned and mapped after the op
+ * completes, as buffers every later op inside the range can be a slice of.
+ * A range is dropped as soon as its mapping changes, or when it is the
+ * least recently used one and room is needed.
+ */
+struct pnvl_pin {
+	struct interval_tree_node node; // page aligned user range
+	struct mmu_interval_notifier notifier;
+	struct list_head lru;
+	struct pnvl_dev *pnvl_dev;
+	struct pnvl_buf *buf;
+	bool cached; // still in the tree
+};
+
+static unsigned long pnvl_pin_size(struct pnvl_pin *pin)
+{
+	return pin->node.last - pin->node.start + 1;
+}
+
+/* Take a range out of the cache, pins->lock must be taken */
+static void pnvl_pin_unlink(struct pnvl_pins *pins, struct pnvl_pin *pin)
+{
+	interval_tree_remove(&pin->node, &pins->tree);
+	list_del(&pin->lru);
+	pins->bytes -= pnvl_pin_size(pin);
+	pin->cached = false;
+}
+
+/* Free ranges taken out of the cache, only in process context */
+static void pnvl_pin_free(struct list_head *list)
+{
+	struct pnvl_pin *pin, *tmp;
+
+	list_for_each_entry_safe(pin, tmp, list, lru) {
+		list_del(&pin->lru);
+		mmu_interval_notifier_remove(&pin->notifier);
+		pnvl_buf_put(pin->buf);
+		kfree(pin);
+	}
+}
+
+/*
+ * The notifier cannot be removed from its own callback, so invalidated
+ * ranges are freed from a work item.
+ */
+static void pnvl_pin_reap(struct work_struct *work)
+{
+	struct pnvl_pins *pins = container_of(work, struct pnvl_pins, reap);
+	LIST_HEAD(dead);
+
+	spin_lock(&pins->lock);
+	list_splice_init(&pins->dead, &dead);
+	spin_unlock(&pins->lock);
+
+	pnvl_pin_free(&dead);
+}
+
+static bool pnvl_pin_invalidate(struct mmu_interval_notifier *mni,
+		const struct mmu_notifier_range *range, unsigned long cur_seq)
+{
+	struct pnvl_pin *pin = container_of(mni, struct pnvl_pin, notifier);
+	struct pnvl_pins *pins = &pin->pnvl_dev->pins;
+
+	spin_lock(&pins->lock);
+	mmu_interval_set_seq(mni, cur_seq);
+	if (pin->cached) {
+		pnvl_pin_unlink(pins, pin);
+		list_add_tail(&pin->lru, &pins->dead);
+		schedule_work(&pins->reap);
+	}
+	spin_unlock(&pins->lock);
+
+	return true;
+}
+
+static const struct mmu_interval_notifier_ops pnvl_pin_ops = {
+	.invalidate = pnvl_pin_invalidate,
+};
+
+/*
+ * Cached range of the current process covering [start, last], with a
+ * reference taken for the caller. pins->lock must be taken.
+ */
+static struct pnvl_buf *pnvl_pin_find(struct pnvl_pins *pins,
+		unsigned long start, unsigned long last)
+{
+	struct interval_tree_node *node;
+	struct pnvl_pin *pin;
+
+	for (node = interval_tree_iter_first(&pins->tree, start, last); node;
+			node = interval_tree_iter_next(node, start, last)) {
+		pin = container_of(node, struct pnvl_pin, node);
+		if (pin->notifier.mm != current->mm || node->start > start ||
+				node->last < last)
+			continue;
+		list_move_tail(&pin->lru, &pins->lru);
+		kref_get(&pin->buf->ref);
+		return pin->buf;
+	}
+	return NULL;
+}
+
+/*
+ * Pin and map a new range, making room for it first. The range goes into
+ * the cache only if its mapping did not change while it was being pinned.
+ */
+static struct pnvl_buf *pnvl_pin_add(struct pnvl_dev *pnvl_dev,
+		unsigned long start, unsigned long last)
+{
+	struct pnvl_pins *pins = &pnvl_dev->pins;
+	unsigned long seq, size = last - start + 1;
+	unsigned long max = (unsigned long)pin_cache_mb << 20;
+	struct pnvl_pin *pin, *old;
+	struct pnvl_buf *buf;
+	LIST_HEAD(evicted);
+
+	if (size > max)
+		return NULL;
+
+	pin = kzalloc(sizeof(*pin), GFP_KERNEL);
+	if (!pin)
+		return NULL;
+
+	pin->pnvl_dev = pnvl_dev;
+	pin->node.start = start;
+	pin->node.last = last;
+	if (mmu_interval_notifier_insert(&pin->notifier, current->mm, start,
+				size, &pnvl_pin_ops)) {
+		kfree(pin);
+		return NULL;
+	}
+
+	seq = mmu_interval_read_begin(&pin->notifier);
+	buf = pnvl_buf_create(pnvl_dev, start, size);
+	if (IS_ERR(buf)) {
+		mmu_interval_notifier_remove(&pin->notifier);
+		kfree(pin);
+		return NULL;
+	}
+	pin->buf = buf;
+
+	spin_lock(&pins->lock);
+	if (mmu_interval_read_retry(&pin->notifier, seq)) {
+		spin_unlock(&pins->lock);
+		list_add(&pin->lru, &evicted);
+		pnvl_pin_free(&evicted);
+		return NULL;
+	}
+	while (pins->bytes + size > max && !list_empty(&pins->lru)) {
+		old = list_first_entry(&pins->lru, struct pnvl_pin, lru);
+		pnvl_pin_unlink(pins, old);
+		list_add_tail(&old->lru, &evicted);
+	}
+	interval_tree_insert(&pin->node, &pins->tree);
+	list_add_tail(&pin->lru, &pins->lru);
+	pins->bytes += size;
+	pin->cached = true;
+	kref_get(&buf->ref);
+	spin_unlock(&pins->lock);
+
+	pnvl_pin_free(&evicted);
+	return buf;
+}
+
+/*
+ * Make dma a slice of a cached range covering it, pinning and mapping the
+ * whole pages of dma as a new range on a miss. Returns -ENOENT if the op
+ * has to pin and map its pages itself.
+ */
+int pnvl_pin_get(struct pnvl_dev *pnvl_dev, struct pnvl_dma *dma)
+{
+	struct pnvl_pins *pins = &pnvl_dev->pins;
+	unsigned long start, last;
+	struct pnvl_buf *buf;
+
+	if (!pin_cache_mb || !dma->len || dma->addr + dma->len < dma->addr)
+		return -ENOENT;
+
+	start = dma->addr & PAGE_MASK;
+	last = PAGE_ALIGN(dma->addr + dma->len) - 1;
+
+	spin_lock(&pins->lock);
+	buf = pnvl_pin_find(pins, start, last);
+	spin_unlock(&pins->lock);
+
+	if (!buf)
+		buf = pnvl_pin_add(pnvl_dev, start, last);
+	if (!buf)
+		return -ENOENT;
+
+	if (pnvl_buf_slice(buf, dma, dma->addr, dma->len) < 0) {
+		pnvl_buf_put(buf);
+		return -ENOENT;
+	}
+	return 0;
+}
+
+void pnvl_pin_init(struct pnvl_dev *pnvl_dev)
+{
+	struct pnvl_pins *pins = &pnvl_dev->pins;
+
+	spin_lock_init(&pins->lock);
+	pins->tree = RB_ROOT_CACHED;
+	INIT_LIST_HEAD(&pins->lru);
+	INIT_LIST_HEAD(&pins->dead);
+	pins->bytes = 0;
+	INIT_WORK(&pins->reap, pnvl_pin_reap);
+}
+
+/*
+ * Drop every cached range. Ops still running on one keep it pinned until
+ * they complete. Once every notifier is removed no invalidation can queue
+ * the reap any more, so it is cancelled only then, and what it left freed.
+ */
+void pnvl_pin_flush(struct pnvl_dev *pnvl_dev)
+{
+	struct pnvl_pins *pins = &pnvl_dev->pins;
+	struct pnvl_pin *pin, *tmp;
+	LIST_HEAD(unused);
+
+	spin_lock(&pins->lock);
+	list_for_each_entry_safe(pin, tmp, &pins->lru, lru) {
+		pnvl_pin_unlink(pins, pin);
+		list_add_tail(&pin->lru, &unused);
+	}
+	list_splice_init(&pins->dead, &unused);
+	spin_unlock(&pins->lock);
+
+	pnvl_pin_free(&unused);
+	cancel_work_sync(&pins->reap);
+
+	spin_lock(&pins->lock);
+	list_splice_init(&pins->dead, &unused);
+	spin_unlock(&pins->lock);
+
+	pnvl_pin_free(&unused);
+}
@@ -5,194 +5,1084 @@
  */
 
 #include "pnvl_module.h"
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
 
-struct pnvl_op *pnvl_ops_new(unsigned int cmd, unsigned long uarg)
+static unsigned int drr_quantum_kb = 64;
+module_param(drr_quantum_kb, uint, 0644);
+MODULE_PARM_DESC(drr_quantum_kb, "Bytes each file may launch per turn, in KiB");
+
+static unsigned int inline_max = PNVL_HW_DMA_INLINE_SIZE;
+module_param(inline_max, uint, 0644);
+MODULE_PARM_DESC(inline_max, "Largest send copied through the inline window, in bytes (0 = off)");
+
+static unsigned int spin_max_us = 50;
+module_param(spin_max_us, uint, 0644);
+MODULE_PARM_DESC(spin_max_us, "Longest a WAIT spins before sleeping, in us (0 = always sleep)");
+
+static struct kmem_cache *pnvl_op_cache;
+
+/*
+ * Device tag of a user tag, which may carry PNVL_PRIO_LATENCY on top of
+ * its 32 bits. Wider tags are refused, they would alias others once cut.
+ */
+int pnvl_ops_set_tag(struct pnvl_dma *dma, pnvl_tag_t tag)
+{
+	if ((tag & ~PNVL_PRIO_LATENCY) > U32_MAX)
+		return -EINVAL;
+
+	dma->latency = !!(tag & PNVL_PRIO_LATENCY);
+	dma->tag = (u32)tag;
+	return 0;
+}
+
+/*
+ * Make an op out of a slice of a registered buffer. The op holds a
+ * reference to the buffer until it completes.
+ */
+static int pnvl_ops_new_reg(struct pnvl_file *file, struct pnvl_op *op,
+		unsigned long uarg)
+{
+	struct pnvl_reg_data data;
+	struct pnvl_buf *buf;
+
+	if (copy_from_user(&data, (void *)uarg, sizeof(data)))
+		return -EFAULT;
+
+	if (pnvl_ops_set_tag(&op->dma, data.tag) < 0)
+		return -EINVAL;
+
+	buf = pnvl_buf_get(file, data.key);
+	if (!buf)
+		return -ENOENT;
+	if (!data.len || data.ofs >= buf->dma.len ||
+			data.len > buf->dma.len - data.ofs) {
+		pnvl_buf_put(buf);
+		return -EINVAL;
+	}
+
+	if (pnvl_buf_slice(buf, &op->dma, buf->dma.addr + data.ofs,
+				data.len) < 0) {
+		pnvl_buf_put(buf);
+		return -EMSGSIZE;
+	}
+	op->dma.mode = PNVL_MODE_OFF;
+
+	return 0;
+}
+
+/*
+ * Fill in a plain send or receive. Sends must carry a tag of their own.
+ */
+static int pnvl_ops_set_data(struct pnvl_op *op, unsigned int cmd,
+		const struct pnvl_data *data)
 {
 	int rv;
+
+	rv = pnvl_ops_set_tag(&op->dma, data->tag);
+	if (rv < 0)
+		return rv;
+	if (cmd != PNVL_IOCTL_RECV && op->dma.tag == PNVL_TAG_ANY)
+		return -EINVAL;
+
+	op->dma.addr = data->addr;
+	op->dma.len = data->len;
+	op->dma.mode = PNVL_MODE_OFF;
+	if (cmd == PNVL_IOCTL_RECV) {
+		op->dma.direction = DMA_FROM_DEVICE;
+		op->ioctl_fn = pnvl_ioctl_recv;
+	} else {
+		op->dma.delta = cmd == PNVL_IOCTL_SEND_DELTA;
+		op->dma.direction = DMA_TO_DEVICE;
+		op->ioctl_fn = pnvl_ioctl_send;
+	}
+
+	return 0;
+}
+
+static struct pnvl_op *pnvl_ops_alloc(struct pnvl_file *file)
+{
+	struct pnvl_op *op = kmem_cache_alloc(pnvl_op_cache, GFP_KERNEL);
+	if (!op)
+		return NULL;
+
+	op->dma.latency = false;
+	op->dma.inl = false;
+	op->dma.delta = false;
+	op->dma.sums = NULL;
+	op->dma.dirty = NULL;
+	op->dma.pfns = NULL;
+	op->dma.clean = NULL;
+	op->dma.prev = NULL;
+	op->dma.buf = NULL;
+	op->dma.filp = NULL;
+	op->file = file;
+	op->efd = NULL;
+	op->ucmd = NULL;
+	op->uring = false;
+	op->cancelled = false;
+	init_waitqueue_head(&op->waitq);
+	atomic_set(&op->nwaiting, 0);
+	op->state = PNVL_OP_PENDING;
+
+	return op;
+}
+
+/* driver allocated memory is sent whole, it has no pages to sum */
+static void pnvl_ops_find_mmap(struct pnvl_file *file, struct pnvl_op *op)
+{
+	if (!op->dma.buf && !op->dma.filp &&
+			!pnvl_buf_find_mmap(file, &op->dma))
+		op->dma.delta = false;
+}
+
+struct pnvl_op *pnvl_ops_new(struct pnvl_file *file, unsigned int cmd,
+		unsigned long uarg)
+{
 	struct pnvl_data data;
+	struct pnvl_op *op;
 
-	struct pnvl_op *op = kmalloc(sizeof(*op), GFP_KERNEL);
+	op = pnvl_ops_alloc(file);
 	if (!op)
-		goto out;
+		return NULL;
 
 	switch(cmd) {
 	case PNVL_IOCTL_SEND:
-		rv = copy_from_user(&data, (void *)uarg, sizeof(data));
-		if (rv < 0)
+	case PNVL_IOCTL_SEND_DELTA:
+	case PNVL_IOCTL_RECV:
+		if (copy_from_user(&data, (void *)uarg, sizeof(data)))
+			goto clean;
+		if (pnvl_ops_set_data(op, cmd, &data) < 0)
+			goto clean;
+		break;
+	case PNVL_IOCTL_SEND_REG:
+		if (pnvl_ops_new_reg(file, op, uarg) < 0)
 			goto clean;
-		op->dma.addr = data.addr;
-		op->dma.len = data.len;
-		op->dma.mode = PNVL_MODE_OFF;
+		if (op->dma.tag == PNVL_TAG_ANY) {
+			pnvl_buf_put(op->dma.buf);
+			goto clean;
+		}
+		op->dma.direction = DMA_TO_DEVICE;
 		op->ioctl_fn = pnvl_ioctl_send;
 		break;
-	case PNVL_IOCTL_RECV:
-		rv = copy_from_user(&data, (void *)uarg, sizeof(data));
-		if (rv < 0)
+	case PNVL_IOCTL_RECV_REG:
+		if (pnvl_ops_new_reg(file, op, uarg) < 0)
 			goto clean;
-		op->dma.addr = data.addr;
-		op->dma.len = data.len;
-		op->dma.mode = PNVL_MODE_OFF;
+		op->dma.direction = DMA_FROM_DEVICE;
 		op->ioctl_fn = pnvl_ioctl_recv;
 		break;
+	case PNVL_IOCTL_SEND_FILE:
+	case PNVL_IOCTL_RECV_FILE:
+		if (pnvl_cache_new(op, cmd, uarg) < 0)
+			goto clean;
+		break;
 	default:
 		goto clean;
 	}
 
-	init_waitqueue_head(&op->waitq);
-	atomic_set(&op->nwaiting, 0);
-	op->flag = 0;
-
-out:
+	pnvl_ops_find_mmap(file, op);
 	return op;
 
 clean:
-	kfree(op);
+	kmem_cache_free(pnvl_op_cache, op);
 	return NULL;
 }
 
-pnvl_handle_t pnvl_ops_init(struct pnvl_dev *pnvl_dev, struct pnvl_op *op)
+/*
+ * Same as pnvl_ops_new for a plain send or receive already copied in, as
+ * io_uring commands carry them. Returns an ERR_PTR on failure.
+ */
+struct pnvl_op *pnvl_ops_new_data(struct pnvl_file *file, unsigned int cmd,
+		const struct pnvl_data *data)
+{
+	struct pnvl_op *op;
+	int rv;
+
+	op = pnvl_ops_alloc(file);
+	if (!op)
+		return ERR_PTR(-ENOMEM);
+
+	rv = pnvl_ops_set_data(op, cmd, data);
+	if (rv < 0) {
+		kmem_cache_free(pnvl_op_cache, op);
+		return ERR_PTR(rv);
+	}
+
+	pnvl_ops_find_mmap(file, op);
+	return op;
+}
+
+static struct pnvl_flow *pnvl_ops_flow(struct pnvl_file *file,
+		struct pnvl_queue *q)
+{
+	return q == &file->pnvl_dev->ops.tx ? &file->tx : &file->rx;
+}
+
+/*
+ * Next op to launch. Latency ops go first, in the order they were queued.
+ * Bulk ops are picked by deficit round robin over the files with pending
+ * ops, so each gets the same share of bytes whatever the size of its ops.
+ */
+static struct pnvl_op *pnvl_ops_pick(struct pnvl_queue *q)
+{
+	long quantum = max_t(long, (long)drr_quantum_kb << 10, 1);
+	struct pnvl_flow *flow;
+	struct pnvl_op *op;
+
+	/* q->lock must be taken */
+	if (!list_empty(&q->urgent))
+		return list_first_entry(&q->urgent, struct pnvl_op, list);
+
+	while (!list_empty(&q->flows)) {
+		flow = list_first_entry(&q->flows, struct pnvl_flow, node);
+		op = list_first_entry(&flow->pending, struct pnvl_op, list);
+		if (flow->deficit < (long)op->dma.len) {
+			flow->deficit += quantum;
+			list_move_tail(&flow->node, &q->flows);
+			continue;
+		}
+		flow->deficit -= op->dma.len;
+		if (list_is_singular(&flow->pending)) {
+			list_del_init(&flow->node);
+			flow->deficit = 0;
+		}
+		return op;
+	}
+	return NULL;
+}
+
+static void pnvl_ops_launch(struct pnvl_dev *pnvl_dev, struct pnvl_queue *q)
+{
+	struct pnvl_op *op;
+
+	/* q->lock must be taken */
+	while (q->nslots && (op = pnvl_ops_pick(q))) {
+		list_move_tail(&op->list, &q->active);
+		op->state = PNVL_OP_ACTIVE;
+		q->nslots--;
+		//pr_info("pnvl_ops_launch - running op %lu\n", op->id);
+		op->retval = op->ioctl_fn(pnvl_dev, op);
+	}
+}
+
+/*
+ * Small plain sends are copied in at once and written to the device along
+ * with the command, they need no pages pinned or mapped.
+ */
+static bool pnvl_ops_inline(struct pnvl_op *op)
+{
+	return op->dma.direction == DMA_TO_DEVICE && !op->dma.buf &&
+		!op->dma.filp && !op->dma.delta && op->dma.len &&
+		op->dma.len <= min_t(unsigned int, READ_ONCE(inline_max),
+				PNVL_HW_DMA_INLINE_SIZE);
+}
+
+/*
+ * Pin, map and number an op, ready to be queued. The op is freed if this
+ * fails.
+ */
+static long pnvl_ops_prepare(struct pnvl_dev *pnvl_dev, struct pnvl_op *op)
 {
 	struct pnvl_ops *ops = &pnvl_dev->ops;
-	unsigned long flags;
 	long rv = 0;
-	int empty;
+	u32 id;
+
+	if (pnvl_ops_inline(op)) {
+		if (copy_from_user(op->payload, (void __user *)op->dma.addr,
+					op->dma.len)) {
+			rv = -EFAULT;
+			goto free_op;
+		}
+		op->dma.inl = true;
+		goto pinned;
+	}
+
+	if (op->dma.buf ||
+			(!op->dma.filp && !pnvl_pin_get(pnvl_dev, &op->dma)))
+		goto pinned;
+
+	if (op->dma.filp)
+		rv = pnvl_cache_get_pages(&op->dma, pnvl_dev->pdev);
+	else
+		rv = pnvl_dma_pin_pages(&op->dma, pnvl_dev->pdev);
+	if (rv < 0)
+		goto free_op;
+
+	//pr_info("pnvl_dma_pin_pages - success\n");
+
+	if (pnvl_dma_map_pages(&op->dma, pnvl_dev->pdev) <= 0) {
+		rv = -ENOMEM;
+		goto unpin_pages;
+	}
+
+pinned:
+	if (op->dma.buf && op->dma.buf->attach) {
+		rv = pnvl_dmabuf_wait(op->dma.buf,
+				op->dma.direction == DMA_TO_DEVICE);
+		if (rv < 0)
+			goto unmap_pages;
+	}
+	if (op->dma.buf)
+		pnvl_buf_sync(op->dma.buf, &op->dma, true);
+
+	/* the device dirty map covers a single window of handles */
+	if (op->dma.npages > PNVL_HW_BAR0_DMA_HANDLES_CNT)
+		op->dma.delta = false;
+	if (op->dma.delta) {
+		rv = pnvl_delta_prepare(pnvl_dev, &op->dma);
+		if (rv < 0)
+			goto unmap_pages;
+	}
+
+	op->queue = op->dma.direction == DMA_TO_DEVICE ? &ops->tx : &ops->rx;
+
+	/*
+	 * handles are device tags, kept off PNVL_HW_DMA_CMD_NONE, and ioctl
+	 * results, which userspace takes as an int
+	 */
+	rv = xa_alloc_cyclic_irq(&ops->xa, &id, op, XA_LIMIT(0, INT_MAX),
+			&ops->next_id, GFP_KERNEL);
+	if (rv < 0)
+		goto release;
+	op->id = id;
+	kref_get(&op->file->ref);
+
+	return 0;
+
+release:
+	if (op->dma.delta)
+		pnvl_delta_finish(pnvl_dev, &op->dma, false);
+unmap_pages:
+	if (op->dma.inl)
+		goto free_op;
+	if (op->dma.buf) {
+		pnvl_buf_sync(op->dma.buf, &op->dma, false);
+		pnvl_buf_put(op->dma.buf);
+		goto free_op;
+	}
+	pnvl_dma_unmap_pages(&op->dma, pnvl_dev->pdev);
+unpin_pages:
+	pnvl_dma_unpin_pages(&op->dma);
+free_op:
+	kmem_cache_free(pnvl_op_cache, op);
+	return rv;
+}
+
+/*
+ * Queue prepared ops of one file, taken from list, at once and start as
+ * many as the device has slots for.
+ */
+static void pnvl_ops_enqueue(struct pnvl_dev *pnvl_dev, struct pnvl_queue *q,
+		struct list_head *list)
+{
+	struct pnvl_op *op, *tmp;
+	struct pnvl_flow *flow;
+
+	if (list_empty(list))
+		return;
+
+	flow = pnvl_ops_flow(list_first_entry(list, struct pnvl_op, list)->file,
+			q);
+
+	mutex_lock(&q->lock);
+	list_for_each_entry_safe(op, tmp, list, list) {
+		if (op->dma.latency)
+			list_move_tail(&op->list, &q->urgent);
+	}
+	list_splice_tail_init(list, &flow->pending);
+	if (!list_empty(&flow->pending) && list_empty(&flow->node))
+		list_add_tail(&flow->node, &q->flows);
+	pnvl_ops_launch(pnvl_dev, q);
+	mutex_unlock(&q->lock);
+}
+
+pnvl_handle_t pnvl_ops_init(struct pnvl_dev *pnvl_dev, struct pnvl_op *op)
+{
+	pnvl_handle_t id;
+	LIST_HEAD(list);
+	long rv;
 
 	if (!op)
 		return -EINVAL;
 
-	rv = pnvl_dma_pin_pages(&op->dma);
+	rv = pnvl_ops_prepare(pnvl_dev, op);
 	if (rv < 0)
 		return rv;
 
-	//pr_info("pnvl_dma_pin_pages - success\n");
+	/* the op may be reclaimed as soon as it is queued */
+	id = op->id;
+	list_add_tail(&op->list, &list);
+	pnvl_ops_enqueue(pnvl_dev, op->queue, &list);
 
-	spin_lock_irqsave(&ops->lock, flags);
-	empty = list_empty(&ops->active); 
-	list_add_tail(&op->list, &ops->active);
-	op->id = ops->next_id++;
-	spin_unlock_irqrestore(&ops->lock, flags);
+	return id;
+}
 
-	if (empty) {
-		//pr_info("pnvl_ops_init - running op %lu\n", op->id);
-		rv = op->ioctl_fn(pnvl_dev, &op->dma);
-		if (rv < 0)
-			return rv;
+/*
+ * Issue a vector of plain sends and receives, taking each queue lock once.
+ * The handle of every entry, or its error, is written back. Returns how
+ * many ops were issued.
+ */
+long pnvl_ops_submitv(struct pnvl_file *file, unsigned long uarg)
+{
+	struct pnvl_dev *pnvl_dev = file->pnvl_dev;
+	struct pnvl_ops *ops = &pnvl_dev->ops;
+	struct pnvl_vecs vecs;
+	struct pnvl_vec *vec;
+	struct pnvl_data data;
+	struct pnvl_op *op;
+	LIST_HEAD(tx);
+	LIST_HEAD(rx);
+	long rv, n = 0;
+	unsigned long i;
+
+	if (copy_from_user(&vecs, (void *)uarg, sizeof(vecs)))
+		return -EFAULT;
+	if (!vecs.cnt || vecs.cnt > PNVL_VEC_MAX)
+		return -EINVAL;
+
+	vec = memdup_user((void *)vecs.vec, vecs.cnt * sizeof(*vec));
+	if (IS_ERR(vec))
+		return PTR_ERR(vec);
+
+	for (i = 0; i < vecs.cnt; i++) {
+		switch (vec[i].cmd) {
+		case PNVL_IOCTL_SEND:
+		case PNVL_IOCTL_SEND_DELTA:
+		case PNVL_IOCTL_RECV:
+			break;
+		default:
+			vec[i].id = (pnvl_handle_t)-EINVAL;
+			continue;
+		}
+
+		data.addr = vec[i].addr;
+		data.len = vec[i].len;
+		data.tag = vec[i].tag;
+		op = pnvl_ops_new_data(file, vec[i].cmd, &data);
+		if (IS_ERR(op)) {
+			vec[i].id = (pnvl_handle_t)PTR_ERR(op);
+			continue;
+		}
+
+		rv = pnvl_ops_prepare(pnvl_dev, op);
+		if (rv < 0) {
+			vec[i].id = (pnvl_handle_t)rv;
+			continue;
+		}
+
+		vec[i].id = op->id;
+		list_add_tail(&op->list, op->queue == &ops->tx ? &tx : &rx);
+		n++;
 	}
 
-	return op->id;
+	pnvl_ops_enqueue(pnvl_dev, &ops->tx, &tx);
+	pnvl_ops_enqueue(pnvl_dev, &ops->rx, &rx);
+
+	if (copy_to_user((void *)vecs.vec, vec, vecs.cnt * sizeof(*vec)))
+		n = -EFAULT;
+	kfree(vec);
+	return n;
 }
 
-struct pnvl_op *pnvl_ops_current(struct pnvl_ops *ops)
+void pnvl_ops_init_queue(struct pnvl_queue *q, void __iomem *bank)
 {
-	/* ops->lock must be taken */
-	return list_empty(&ops->active) ?
-		NULL : list_first_entry(&ops->active, struct pnvl_op, list);
+	mutex_init(&q->lock);
+	INIT_LIST_HEAD(&q->urgent);
+	INIT_LIST_HEAD(&q->flows);
+	INIT_LIST_HEAD(&q->active);
+	q->bank = bank;
+	q->nslots = ioread32(bank + PNVL_HW_DMA_CMD_FREE);
 }
 
-static void pnvl_ops_fini(struct pnvl_dev *pnvl_dev, struct pnvl_op *op)
+static void pnvl_ops_init_flow(struct pnvl_flow *flow)
 {
+	INIT_LIST_HEAD(&flow->node);
+	INIT_LIST_HEAD(&flow->pending);
+	flow->deficit = 0;
+}
+
+void pnvl_ops_init_file(struct pnvl_file *file)
+{
+	file->closed = false;
+	file->spin_us = PNVL_SPIN_DEFAULT;
+	file->wait_ns = 0;
+	pnvl_ops_init_flow(&file->tx);
+	pnvl_ops_init_flow(&file->rx);
+}
+
+static long pnvl_ops_status(u32 status)
+{
+	switch (status) {
+	case PNVL_HW_DMA_STS_OK:
+		return 0;
+	case PNVL_HW_DMA_STS_EMSGSIZE:
+		return -EMSGSIZE;
+	case PNVL_HW_DMA_STS_EBUSY:
+		return -EBUSY;
+	default:
+		return -EIO;
+	}
+}
+
+/*
+ * Give back what the op holds on its user memory. Slices of registered or
+ * cached buffers are synced for the CPU and drop their reference, the
+ * buffer stays pinned and mapped. Page cache pages a receive wrote are dirtied before being put.
+ * Inline sends hold nothing.
+ */
+static void pnvl_ops_release(struct pnvl_dev *pnvl_dev, struct pnvl_op *op,
+		bool ok)
+{
+	if (op->dma.delta)
+		pnvl_delta_finish(pnvl_dev, &op->dma, ok);
+
+	if (op->dma.inl)
+		return;
+	if (op->dma.buf) {
+		pnvl_buf_sync(op->dma.buf, &op->dma, false);
+		pnvl_buf_put(op->dma.buf);
+		return;
+	}
+
 	pnvl_dma_unmap_pages(&op->dma, pnvl_dev->pdev);
+	if (op->dma.filp)
+		pnvl_cache_finish(&op->dma, ok);
 	pnvl_dma_unpin_pages(&op->dma);
+}
+
+/*
+ * The op stays reachable by its handle until it has been waited for, or
+ * until the next flush if nobody does.
+ */
+static void pnvl_ops_fini(struct pnvl_dev *pnvl_dev, struct pnvl_op *op)
+{
+	struct pnvl_ops *ops = &pnvl_dev->ops;
+	struct pnvl_file *file = op->file;
+	struct io_uring_cmd *ucmd;
+	struct eventfd_ctx *efd;
+	pnvl_handle_t id = op->id;
+	bool uring = op->uring;
+	unsigned long flags;
+	bool reclaim;
 
-	/* ops->lock must be taken */
-	list_move_tail(&op->list, &pnvl_dev->ops.inactive);
+	pnvl_ops_release(pnvl_dev, op, op->retval == 0);
+	op->done_ns = ktime_get_ns();
 
-	op->flag = 1;
+	/* waiters cannot reclaim the op before the lock is dropped */
+	xa_lock_irqsave(&ops->xa, flags);
+	/* pairs with the lockless waiters, which then read retval and done_ns */
+	smp_store_release(&op->state, PNVL_OP_DONE);
+	efd = op->efd;
+	op->efd = NULL;
+	ucmd = op->ucmd;
+	op->ucmd = NULL;
 	wake_up_all(&op->waitq);
+	/* the file is closed, nobody else can wait for it */
+	reclaim = file->closed && !atomic_read(&op->nwaiting);
+	if (reclaim)
+		__xa_erase(&ops->xa, id);
+	xa_unlock_irqrestore(&ops->xa, flags);
+	wake_up_all(&ops->done_wq);
+
+	if (efd) {
+		eventfd_signal(efd, 1);
+		eventfd_ctx_put(efd);
+	}
+	if (ucmd)
+		pnvl_uring_complete(ucmd);
+
+	/* a full ring drops the handle, the op can still be waited for */
+	if (!uring) {
+		kfifo_in_spinlocked(&file->done, &id, 1, &file->done_lock);
+		wake_up_interruptible(&file->poll_wq);
+	}
+	if (reclaim)
+		kmem_cache_free(pnvl_op_cache, op);
+	pnvl_file_put(file);
 }
 
-long pnvl_ops_wait(struct pnvl_op *op)
+/*
+ * Drop the reference of a waiter. The last waiter of a finished op
+ * reclaims it.
+ */
+void pnvl_ops_put(struct pnvl_ops *ops, struct pnvl_op *op)
 {
-	long rv = -EINVAL;
+	unsigned long flags;
+	bool last;
+
+	xa_lock_irqsave(&ops->xa, flags);
+	last = atomic_dec_and_test(&op->nwaiting) &&
+		op->state == PNVL_OP_DONE;
+	if (last)
+		__xa_erase(&ops->xa, op->id);
+	xa_unlock_irqrestore(&ops->xa, flags);
+
+	if (last)
+		kmem_cache_free(pnvl_op_cache, op);
+}
+
+long pnvl_ops_set_spin(struct pnvl_file *file, unsigned long us)
+{
+	if (us != PNVL_SPIN_DEFAULT && us > USEC_PER_SEC)
+		return -EINVAL;
+
+	WRITE_ONCE(file->spin_us, (unsigned int)us);
+	return 0;
+}
+
+/*
+ * How long a wait spins: twice the time recent waits of the file had to
+ * wait, up to the cap. Files whose waits are longer than the cap do not
+ * spin at all, their ops take long enough for a sleep not to matter.
+ */
+static u64 pnvl_ops_spin_ns(struct pnvl_file *file)
+{
+	unsigned int cap_us = READ_ONCE(file->spin_us);
+	u64 cap, mean = READ_ONCE(file->wait_ns);
+
+	if (cap_us == PNVL_SPIN_DEFAULT)
+		cap_us = READ_ONCE(spin_max_us);
+	cap = (u64)cap_us * NSEC_PER_USEC;
+
+	if (!mean || mean > cap)
+		return 0;
+	return min(cap, 2 * mean);
+}
+
+/*
+ * Fold how long a wait had to wait into the average of the file. This is
+ * taken from when the op finished rather than from when the waiter woke,
+ * so sleeping does not make ops look longer than they are.
+ */
+static void pnvl_ops_account_wait(struct pnvl_file *file, struct pnvl_op *op,
+		u64 start)
+{
+	u64 mean = READ_ONCE(file->wait_ns);
+	u64 waited = op->done_ns > start ? op->done_ns - start : 0;
+
+	/* racing waiters of the file may lose a sample, which is harmless */
+	WRITE_ONCE(file->wait_ns, mean ? mean - mean / 8 + waited / 8 : waited);
+}
+
+/*
+ * Ops that finish in a few microseconds are waited for by spinning on
+ * their state, which saves the sleep and the wakeup. The spin gives up
+ * once over its time or as soon as the CPU is wanted elsewhere.
+ */
+long pnvl_ops_wait(struct pnvl_ops *ops, struct pnvl_op *op)
+{
+	u64 start, spin;
+	long rv;
 
 	if (!op)
-		goto out;
+		return -EINVAL;
 
-	atomic_add(1, &op->nwaiting);
-	wait_event(op->waitq, op->flag == 1);
+	start = ktime_get_ns();
+	spin = pnvl_ops_spin_ns(op->file);
+	while (spin && smp_load_acquire(&op->state) != PNVL_OP_DONE &&
+			ktime_get_ns() - start < spin && !need_resched())
+		cpu_relax();
+
+	wait_event(op->waitq, smp_load_acquire(&op->state) == PNVL_OP_DONE);
+	pnvl_ops_account_wait(op->file, op, start);
 	rv = op->retval;
+	pnvl_ops_put(ops, op);
 
-	if (!atomic_sub_return(1, &op->nwaiting)) {
-		list_del(&op->list);
-		kfree(op);
+	return rv;
+}
+
+/* Index of the first finished op, -1 if none is */
+static long pnvl_ops_first_done(struct pnvl_op **ops, unsigned long cnt)
+{
+	unsigned long i;
+
+	for (i = 0; i < cnt; i++) {
+		if (smp_load_acquire(&ops[i]->state) == PNVL_OP_DONE)
+			return i;
 	}
+	return -1;
+}
+
+/*
+ * Wait for a vector of handles, writing back the result of each op waited
+ * for. With PNVL_WAIT_ANY, only the first op found finished is waited for
+ * and its index returned; the others can still be waited for later. An
+ * unknown handle fails it with -EINVAL, its retval telling which one.
+ */
+long pnvl_ops_waitv(struct pnvl_file *file, unsigned long uarg)
+{
+	struct pnvl_ops *ops = &file->pnvl_dev->ops;
+	struct pnvl_op **waited;
+	struct pnvl_vecs vecs;
+	struct pnvl_vec *vec;
+	unsigned long i;
+	long rv = 0;
 
+	if (copy_from_user(&vecs, (void *)uarg, sizeof(vecs)))
+		return -EFAULT;
+	if (!vecs.cnt || vecs.cnt > PNVL_VEC_MAX)
+		return -EINVAL;
+
+	vec = memdup_user((void *)vecs.vec, vecs.cnt * sizeof(*vec));
+	if (IS_ERR(vec))
+		return PTR_ERR(vec);
+
+	if (!(vecs.flags & PNVL_WAIT_ANY)) {
+		for (i = 0; i < vecs.cnt; i++)
+			vec[i].retval = pnvl_ops_wait(ops,
+					pnvl_ops_get(file, vec[i].id));
+		goto out;
+	}
+
+	waited = kcalloc(vecs.cnt, sizeof(*waited), GFP_KERNEL);
+	if (!waited) {
+		rv = -ENOMEM;
+		goto free_vec;
+	}
+
+	for (i = 0; i < vecs.cnt; i++) {
+		waited[i] = pnvl_ops_get(file, vec[i].id);
+		if (!waited[i]) {
+			vec[i].retval = -EINVAL;
+			rv = -EINVAL;
+			goto unget;
+		}
+	}
+
+	wait_event(ops->done_wq,
+			(rv = pnvl_ops_first_done(waited, vecs.cnt)) >= 0);
+	vec[rv].retval = waited[rv]->retval;
+
+unget:
+	for (i = 0; i < vecs.cnt && waited[i]; i++) {
+		if (rv >= 0 && i == rv)
+			pnvl_ops_put(ops, waited[i]);
+		else
+			atomic_dec(&waited[i]->nwaiting);
+	}
+	kfree(waited);
 out:
+	if (copy_to_user((void *)vecs.vec, vec, vecs.cnt * sizeof(*vec)))
+		rv = -EFAULT;
+free_vec:
+	kfree(vec);
 	return rv;
 }
 
+/*
+ * Take a finished command off the queue it was launched on, moving it to
+ * done. Returns false if it is not active there.
+ */
+static bool pnvl_ops_retire(struct pnvl_dev *pnvl_dev, struct pnvl_queue *q,
+		u32 tag, u32 status, struct list_head *done)
+{
+	struct pnvl_ops *ops = &pnvl_dev->ops;
+	struct pnvl_op *op;
+
+	mutex_lock(&q->lock);
+	xa_lock_irq(&ops->xa);
+	op = xa_load(&ops->xa, tag);
+	if (op && (op->queue != q || op->state != PNVL_OP_ACTIVE))
+		op = NULL;
+	xa_unlock_irq(&ops->xa);
+	if (op) {
+		list_move_tail(&op->list, done);
+		q->nslots++;
+		op->retval = op->cancelled ? -ECANCELED :
+			pnvl_ops_status(status);
+	}
+	mutex_unlock(&q->lock);
+
+	return op != NULL;
+}
+
+/*
+ * Retire every command the device reports as done, in whatever order they
+ * finished and on either engine, and fill the freed device slots with
+ * pending ops. Runs in the IRQ thread. The retired ops are only unmapped,
+ * unpinned and completed once the device has new work, all in one batch.
+ */
 void pnvl_ops_next(struct pnvl_dev *pnvl_dev)
 {
 	struct pnvl_ops *ops = &pnvl_dev->ops;
+	void __iomem *mmio = pnvl_dev->bar.mmio;
+	struct pnvl_op *op, *tmp;
+	u32 tag, status;
+	LIST_HEAD(done);
+
+	while ((tag = ioread32(mmio + PNVL_HW_BAR0_DMA_CMD_DONE)) !=
+			PNVL_HW_DMA_CMD_NONE) {
+		status = ioread32(mmio + PNVL_HW_BAR0_DMA_CMD_STS);
+		if (pnvl_ops_retire(pnvl_dev, &ops->tx, tag, status, &done))
+			continue;
+		if (pnvl_ops_retire(pnvl_dev, &ops->rx, tag, status, &done))
+			continue;
+		/* not an op of ours, resync the free slots anyway */
+		mutex_lock(&ops->tx.lock);
+		ops->tx.nslots = ioread32(ops->tx.bank + PNVL_HW_DMA_CMD_FREE);
+		mutex_unlock(&ops->tx.lock);
+		mutex_lock(&ops->rx.lock);
+		ops->rx.nslots = ioread32(ops->rx.bank + PNVL_HW_DMA_CMD_FREE);
+		mutex_unlock(&ops->rx.lock);
+	}
+
+	mutex_lock(&ops->tx.lock);
+	pnvl_ops_launch(pnvl_dev, &ops->tx);
+	mutex_unlock(&ops->tx.lock);
+	mutex_lock(&ops->rx.lock);
+	pnvl_ops_launch(pnvl_dev, &ops->rx);
+	mutex_unlock(&ops->rx.lock);
+
+	list_for_each_entry_safe(op, tmp, &done, list) {
+		list_del(&op->list);
+		pnvl_ops_fini(pnvl_dev, op);
+	}
+}
+
+/*
+ * Have an eventfd signalled when an op finishes, right away if it already
+ * did. It replaces any eventfd set before.
+ */
+long pnvl_ops_notify(struct pnvl_file *file, unsigned long uarg)
+{
+	struct pnvl_ops *ops = &file->pnvl_dev->ops;
+	struct eventfd_ctx *efd, *old = NULL;
+	struct pnvl_notify notify;
 	struct pnvl_op *op;
 	unsigned long flags;
+	long rv = 0;
+
+	if (copy_from_user(&notify, (void *)uarg, sizeof(notify)))
+		return -EFAULT;
+	if (notify.id > U32_MAX)
+		return -EINVAL;
 
-	spin_lock_irqsave(&ops->lock, flags);
+	efd = eventfd_ctx_fdget(notify.efd);
+	if (IS_ERR(efd))
+		return PTR_ERR(efd);
 
-	op = pnvl_ops_current(ops);
-	if (!op)
-		goto unlock;
-	pnvl_ops_fini(pnvl_dev, op);
-	op = pnvl_ops_current(ops);
-	if (op) {
-		//pr_info("pnvl_ops_next - running op %lu\n", op->id);
-		op->retval = op->ioctl_fn(pnvl_dev, &op->dma);
+	xa_lock_irqsave(&ops->xa, flags);
+	op = xa_load(&ops->xa, notify.id);
+	if (!op || op->file != file) {
+		rv = -EINVAL;
+	} else if (op->state == PNVL_OP_DONE) {
+		eventfd_signal(efd, 1);
+	} else {
+		old = op->efd;
+		op->efd = efd;
+		efd = NULL;
 	}
+	xa_unlock_irqrestore(&ops->xa, flags);
 
-unlock:
-	spin_unlock_irqrestore(&ops->lock, flags);
+	if (efd)
+		eventfd_ctx_put(efd);
+	if (old)
+		eventfd_ctx_put(old);
+	return rv;
 }
 
-struct pnvl_op *pnvl_ops_get(struct pnvl_ops *ops, pnvl_handle_t id)
+/*
+ * Have an io_uring command complete when an op issued by ioctl finishes.
+ * The command holds a waiter reference, so it also reclaims the op.
+ * Returns -EIOCBQUEUED if the command completes later.
+ */
+long pnvl_ops_wait_uring(struct pnvl_file *file, pnvl_handle_t id,
+		struct io_uring_cmd *ucmd)
 {
-	struct pnvl_op *cur_op, *op = NULL;
-	struct list_head *entry;
+	struct pnvl_ops *ops = &file->pnvl_dev->ops;
+	struct pnvl_op *op;
+	bool reclaim = false;
 	unsigned long flags;
+	long rv;
 
-	if (id >= ops->next_id)
-		goto out;
+	if (id > U32_MAX)
+		return -EINVAL;
 
-	spin_lock_irqsave(&ops->lock, flags);
-	list_for_each(entry, &ops->active) {
-		cur_op = list_entry(entry, struct pnvl_op, list);
-		if (cur_op->id == id) {
-			op = cur_op;
-			goto unlock;
-		}
-	}
-	list_for_each(entry, &ops->inactive) {
-		cur_op = list_entry(entry, struct pnvl_op, list);
-		if (cur_op->id == id) {
-			op = cur_op;
-			goto unlock;
-		}
+	xa_lock_irqsave(&ops->xa, flags);
+	op = xa_load(&ops->xa, id);
+	if (!op || op->file != file) {
+		rv = -EINVAL;
+	} else if (op->state == PNVL_OP_DONE) {
+		/* nobody else waits, reclaim it as WAIT would */
+		rv = op->retval;
+		reclaim = !atomic_read(&op->nwaiting);
+		if (reclaim)
+			__xa_erase(&ops->xa, op->id);
+	} else if (op->ucmd) {
+		rv = -EBUSY;
+	} else {
+		atomic_inc(&op->nwaiting);
+		pnvl_uring_attach(ucmd, op);
+		op->ucmd = ucmd;
+		rv = -EIOCBQUEUED;
 	}
-unlock:
-	spin_unlock_irqrestore(&ops->lock, flags);
-out:
+	xa_unlock_irqrestore(&ops->xa, flags);
+
+	if (reclaim)
+		kmem_cache_free(pnvl_op_cache, op);
+	return rv;
+}
+
+/*
+ * Look an op of the file up by handle, taking a waiter reference to it.
+ * NULL if the handle is unknown to the file or was already reclaimed.
+ * Handles double as device tags and so are unique to the device, but a
+ * file only sees its own.
+ */
+struct pnvl_op *pnvl_ops_get(struct pnvl_file *file, pnvl_handle_t id)
+{
+	struct pnvl_ops *ops = &file->pnvl_dev->ops;
+	struct pnvl_op *op = NULL;
+	unsigned long flags;
+
+	if (id > U32_MAX)
+		return NULL;
+
+	xa_lock_irqsave(&ops->xa, flags);
+	op = xa_load(&ops->xa, id);
+	if (op && op->file != file)
+		op = NULL;
+	if (op)
+		atomic_inc(&op->nwaiting);
+	xa_unlock_irqrestore(&ops->xa, flags);
+
 	return op;
 }
 
-int pnvl_ops_flush(struct pnvl_dev *pnvl_dev)
+/* Take the pending ops of a flow off its queue, q->lock must be taken */
+static void pnvl_ops_flush_flow(struct pnvl_flow *flow,
+		struct list_head *flushed)
 {
-	struct pnvl_ops *ops = &pnvl_dev->ops;
-	struct pnvl_op *op;
+	list_splice_tail_init(&flow->pending, flushed);
+	list_del_init(&flow->node);
+	flow->deficit = 0;
+}
+
+/*
+ * Cancel the queued ops of a file, or of every file if it is NULL, and
+ * those already on the device if active is set. The device may still
+ * write into the pages of a running op, so it is only marked and fails
+ * when the device reports it done. Only a flush of every file, once the
+ * device stopped (see pnvl_remove), releases running ops at once.
+ */
+static void pnvl_ops_flush_queue(struct pnvl_dev *pnvl_dev,
+		struct pnvl_queue *q, struct pnvl_file *file, bool active)
+{
+	struct pnvl_op *op, *next;
+	struct pnvl_flow *flow, *ftmp;
 	struct list_head *entry, *tmp;
-	unsigned long flags;
+	LIST_HEAD(flushed);
 
-	spin_lock_irqsave(&ops->lock, flags);
-	list_for_each_safe(entry, tmp, &ops->active) {
+	mutex_lock(&q->lock);
+	list_for_each_entry_safe(op, next, &q->urgent, list) {
+		if (!file || op->file == file)
+			list_move_tail(&op->list, &flushed);
+	}
+	if (file) {
+		pnvl_ops_flush_flow(pnvl_ops_flow(file, q), &flushed);
+	} else {
+		list_for_each_entry_safe(flow, ftmp, &q->flows, node)
+			pnvl_ops_flush_flow(flow, &flushed);
+	}
+	list_for_each_entry_safe(op, next, &q->active, list) {
+		if (!active || (file && op->file != file))
+			continue;
+		if (file) {
+			op->cancelled = true;
+			continue;
+		}
+		op->state = PNVL_OP_PENDING; /* no longer retired by the IRQ */
+		list_move_tail(&op->list, &flushed);
+	}
+	mutex_unlock(&q->lock);
+
+	list_for_each_safe(entry, tmp, &flushed) {
 		list_del(entry);
 		op = list_entry(entry, struct pnvl_op, list);
-		pnvl_dma_unpin_pages(&op->dma);
-		pnvl_dma_unmap_pages(&op->dma, pnvl_dev->pdev);
-		kfree(op);
+		op->retval = -ECANCELED;
+		pnvl_ops_fini(pnvl_dev, op);
 	}
-	list_for_each_safe(entry, tmp, &ops->inactive) {
-		list_del(entry);
-		kfree(list_entry(entry, struct pnvl_op, list));
+}
+
+/* Reclaim the finished ops of a file nobody is waiting for */
+static void pnvl_ops_reap(struct pnvl_ops *ops, struct pnvl_file *file)
+{
+	XA_STATE(xas, &ops->xa, 0);
+	struct pnvl_op *op, *tmp;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	xas_lock_irqsave(&xas, flags);
+	xas_for_each(&xas, op, U32_MAX) {
+		if (file && op->file != file)
+			continue;
+		if (op->state == PNVL_OP_DONE && !atomic_read(&op->nwaiting)) {
+			xas_store(&xas, NULL);
+			list_add_tail(&op->list, &done);
+		}
 	}
-	spin_unlock_irqrestore(&ops->lock, flags);
+	xas_unlock_irqrestore(&xas, flags);
+
+	list_for_each_entry_safe(op, tmp, &done, list)
+		kmem_cache_free(pnvl_op_cache, op);
+}
+
+/*
+ * Cancel every queued op of a file, waking its waiters, and reclaim its
+ * finished ops nobody is waiting for. Ops on the device fail once it is
+ * done with them. A NULL file flushes all of them.
+ */
+int pnvl_ops_flush(struct pnvl_dev *pnvl_dev, struct pnvl_file *file)
+{
+	struct pnvl_ops *ops = &pnvl_dev->ops;
+
+	pnvl_ops_flush_queue(pnvl_dev, &ops->tx, file, true);
+	pnvl_ops_flush_queue(pnvl_dev, &ops->rx, file, true);
+	pnvl_ops_reap(ops, file);
 
 	return 0;
 }
+
+/*
+ * Handles are private to the file, so once it is closed nobody can wait
+ * for its ops. Those not started are cancelled, the finished ones are
+ * reclaimed now and the running ones when they finish.
+ */
+void pnvl_ops_fini_file(struct pnvl_file *file)
+{
+	struct pnvl_dev *pnvl_dev = file->pnvl_dev;
+	struct pnvl_ops *ops = &pnvl_dev->ops;
+
+	xa_lock_irq(&ops->xa);
+	file->closed = true;
+	xa_unlock_irq(&ops->xa);
+
+	pnvl_ops_flush_queue(pnvl_dev, &ops->tx, file, false);
+	pnvl_ops_flush_queue(pnvl_dev, &ops->rx, file, false);
+	pnvl_ops_reap(ops, file);
+}
+
+void pnvl_ops_init_ops(struct pnvl_ops *ops)
+{
+	xa_init_flags(&ops->xa, XA_FLAGS_ALLOC | XA_FLAGS_LOCK_IRQ);
+	ops->next_id = 0;
+	init_waitqueue_head(&ops->done_wq);
+}
+
+void pnvl_ops_fini_ops(struct pnvl_ops *ops)
+{
+	xa_destroy(&ops->xa);
+}
+
+int pnvl_ops_cache_init(void)
+{
+	pnvl_op_cache = KMEM_CACHE(pnvl_op, 0);
+	return pnvl_op_cache ? 0 : -ENOMEM;
+}
+
+void pnvl_ops_cache_fini(void)
+{
+	kmem_cache_destroy(pnvl_op_cache);
+}
@@ -0,0 +1,85 @@
+/* pnvl_uring.c - io_uring command passthrough
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include "pnvl_module.h"
+#include <linux/io_uring.h>
+
+struct pnvl_uring_pdu {
+	struct pnvl_op *op;
+};
+
+void pnvl_uring_attach(struct io_uring_cmd *ucmd, struct pnvl_op *op)
+{
+	struct pnvl_uring_pdu *pdu = (struct pnvl_uring_pdu *)ucmd->pdu;
+
+	pdu->op = op;
+}
+
+/* Post the CQE of a finished op from task context, and drop the op */
+static void pnvl_uring_done(struct io_uring_cmd *ucmd, unsigned int issue_flags)
+{
+	struct pnvl_uring_pdu *pdu = (struct pnvl_uring_pdu *)ucmd->pdu;
+	struct pnvl_file *file = ucmd->file->private_data;
+	long rv = pdu->op->retval;
+
+	pnvl_ops_put(&file->pnvl_dev->ops, pdu->op);
+	io_uring_cmd_done(ucmd, rv, 0, issue_flags);
+}
+
+/*
+ * Called when the op of a command finishes, possibly from the IRQ thread.
+ */
+void pnvl_uring_complete(struct io_uring_cmd *ucmd)
+{
+	io_uring_cmd_complete_in_task(ucmd, pnvl_uring_done);
+}
+
+/*
+ * SEND, SEND_DELTA and RECV commands issue an op and complete with its
+ * result. WAIT completes when the op of an ioctl handle finishes. The
+ * submission may sleep pinning pages, just as the ioctl does, so it is
+ * left to io-wq when issued from a context that must not block.
+ */
+int pnvl_uring_issue(struct io_uring_cmd *ucmd, unsigned int issue_flags)
+{
+	const struct pnvl_uring_cmd *cmd = io_uring_sqe_cmd(ucmd->sqe);
+	struct pnvl_file *file = ucmd->file->private_data;
+	struct pnvl_dev *pnvl_dev = file->pnvl_dev;
+	struct pnvl_data data;
+	struct pnvl_op *op;
+	long rv;
+
+	data.addr = (unsigned long)READ_ONCE(cmd->addr);
+	data.len = READ_ONCE(ucmd->sqe->len);
+	data.tag = READ_ONCE(cmd->tag);
+
+	switch (ucmd->cmd_op) {
+	case PNVL_IOCTL_SEND:
+	case PNVL_IOCTL_SEND_DELTA:
+	case PNVL_IOCTL_RECV:
+		break;
+	case PNVL_IOCTL_WAIT:
+		return pnvl_ops_wait_uring(file, data.addr, ucmd);
+	default:
+		return -ENOTTY;
+	}
+
+	if (issue_flags & IO_URING_F_NONBLOCK)
+		return -EAGAIN;
+
+	op = pnvl_ops_new_data(file, ucmd->cmd_op, &data);
+	if (IS_ERR(op))
+		return PTR_ERR(op);
+
+	/* the command is the only waiter of the op */
+	op->uring = true;
+	op->ucmd = ucmd;
+	atomic_set(&op->nwaiting, 1);
+	pnvl_uring_attach(ucmd, op);
+
+	rv = (long)pnvl_ops_init(pnvl_dev, op);
+	return rv < 0 ? rv : -EIOCBQUEUED;
+}
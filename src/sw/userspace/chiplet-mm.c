@@ -82,7 +82,7 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	id = pnvl_recv(fd, pt_A, sz_A);
+	id = pnvl_recv_tag(fd, pt_A, sz_A, PNVL_TAG_A);
 	if ((long)id < 0) {
 		perror("pnvl_recv(A)");
 		exit(1);
@@ -94,7 +94,7 @@ int main(int argc, char *argv[])
 	}
 #endif
 
-	id = pnvl_recv(fd, pt_B, sz_B);
+	id = pnvl_recv_tag(fd, pt_B, sz_B, PNVL_TAG_B);
 	if ((long)id < 0) {
 		perror("pnvl_recv(B)");
 		exit(1);
@@ -106,7 +106,7 @@ int main(int argc, char *argv[])
 	}
 #endif
 
-	id = pnvl_recv(fd, pt_C, sz_C);
+	id = pnvl_recv_tag(fd, pt_C, sz_C, PNVL_TAG_C);
 	if ((long)id < 0) {
 		perror("pnvl_recv(C)");
 		exit(1);
@@ -144,7 +144,7 @@ int main(int argc, char *argv[])
 	}
 	/* FUNCTION END ---------------------------------------- */
 
-	id = pnvl_send(fd, pt_C, sz_C);
+	id = pnvl_send_tag(fd, pt_C, sz_C, PNVL_TAG_C);
 	if ((long)id < 0) {
 		perror("pnvl_send(C)");
 		exit(1);
@@ -61,7 +61,6 @@ void matmul(char *msg, int sz_n, int sz_t, int sz_m,
 	{ /* PNVL PART START =================================== */
 		int fd, num = pnvl_num_devs();
 		int part, pi, pj, sz_part, ofs = 0;
-		pnvl_handle_t id;
 
 		for (int i = 0; i < num; ++i) {
 			fd = pnvl_fd(i);
@@ -73,62 +72,35 @@ void matmul(char *msg, int sz_n, int sz_t, int sz_m,
 			printf("dev=%d (fd=%d), part=%d (sz_part=%d), ofs=%d\n",
 					i, fd, part, part, ofs);
 
-			id = pnvl_send_args(fd, sz_n, sz_t, sz_m, part, ofs);
-			if ((long)id < 0) {
-				perror("pnvl_send_args");
+			/* args, A, B and C out, C back: one submit, one wait */
+			int args[5] = { sz_n, sz_t, sz_m, part, ofs };
+			struct pnvl_vec vec[5];
+
+			pnvl_vec_set(&vec[0], PNVL_IOCTL_SEND, args, sizeof(args),
+					PNVL_TAG_ARGS | PNVL_PRIO_LATENCY);
+			pnvl_vec_set(&vec[1], PNVL_IOCTL_SEND, A,
+					sz_n * sz_t * sizeof(TYPE), PNVL_TAG_A);
+			pnvl_vec_set(&vec[2], PNVL_IOCTL_SEND, B,
+					sz_t * sz_m * sizeof(TYPE), PNVL_TAG_B);
+			pnvl_vec_set(&vec[3], PNVL_IOCTL_SEND, &C[pi][pj],
+					sz_part, PNVL_TAG_C);
+			pnvl_vec_set(&vec[4], PNVL_IOCTL_RECV, &C[pi][pj],
+					sz_part, PNVL_TAG_C);
+
+			if (pnvl_submitv(fd, vec, 5) != 5) {
+				perror("pnvl_submitv");
 				exit(1);
 			}
-#if WAIT_ALL_OPS
-			if (pnvl_wait(fd, id) < 0) {
-				perror("pnvl_wait(args)");
+			if (pnvl_waitv(fd, vec, 5, 0) < 0) {
+				perror("pnvl_waitv");
 				exit(1);
 			}
-#endif
-
-			id = pnvl_send(fd, A, sz_n * sz_t * sizeof(TYPE));
-			if ((long)id < 0) {
-				perror("pnvl_send(A)");
-				exit(1);
-			}
-#if WAIT_ALL_OPS
-			if (pnvl_wait(fd, id) < 0) {
-				perror("pnvl_wait(A)");
-				exit(1);
-			}
-#endif
-
-			id = pnvl_send(fd, B, sz_t * sz_m * sizeof(TYPE));
-			if ((long)id < 0) {
-				perror("pnvl_send(B)");
-				exit(1);
-			}
-#if WAIT_ALL_OPS
-			if (pnvl_wait(fd, id) < 0) {
-				perror("pnvl_wait(B)");
-				exit(1);
-			}
-#endif
-
-			id = pnvl_send(fd, &C[pi][pj], sz_part);
-			if ((long)id < 0) {
-				perror("pnvl_send(C)");
-				exit(1);
-			}
-#if WAIT_ALL_OPS
-			if (pnvl_wait(fd, id) < 0) {
-				perror("pnvl_wait(C)");
-				exit(1);
-			}
-#endif
-
-			id = pnvl_recv(fd, &C[pi][pj], sz_part);
-			if ((long)id < 0) {
-				perror("pnvl_recv(C)");
-				exit(1);
-			}
-			if (pnvl_wait(fd, id) < 0) {
-				perror("pnvl_wait(C)");
-				exit(1);
+			for (int v = 0; v < 5; ++v) {
+				if (vec[v].retval < 0) {
+					fprintf(stderr, "pnvl_waitv: op %d failed (%ld)\n",
+							v, vec[v].retval);
+					exit(1);
+				}
 			}
 
 			pnvl_flush(fd);
@@ -1,9 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <linux/io_uring.h>
 #include "pnvl_wrappers.h"
 
 extern struct pnvl_devices *pnvl_devs;
@@ -80,45 +83,223 @@ int pnvl_close_devs(void)
 	return 0;
 }
 
-int pnvl_send(int fd, void *addr, size_t len)
+int pnvl_send_tag(int fd, void *addr, size_t len, pnvl_tag_t tag)
 {
 	struct pnvl_data data = {
 		.addr = (unsigned long)addr,
 		.len = (unsigned long)len,
+		.tag = tag,
 	};
 	return ioctl(fd, PNVL_IOCTL_SEND, &data);
 }
 
-int pnvl_recv(int fd, void *addr, size_t len)
+int pnvl_send_delta_tag(int fd, void *addr, size_t len, pnvl_tag_t tag)
+{
+	struct pnvl_data data = {
+		.addr = (unsigned long)addr,
+		.len = (unsigned long)len,
+		.tag = tag,
+	};
+	return ioctl(fd, PNVL_IOCTL_SEND_DELTA, &data);
+}
+
+int pnvl_send_reg_tag(int fd, pnvl_key_t key, size_t ofs, size_t len,
+		pnvl_tag_t tag)
+{
+	struct pnvl_reg_data data = {
+		.key = key,
+		.ofs = (unsigned long)ofs,
+		.len = (unsigned long)len,
+		.tag = tag,
+	};
+	return ioctl(fd, PNVL_IOCTL_SEND_REG, &data);
+}
+
+int pnvl_recv_reg_tag(int fd, pnvl_key_t key, size_t ofs, size_t len,
+		pnvl_tag_t tag)
+{
+	struct pnvl_reg_data data = {
+		.key = key,
+		.ofs = (unsigned long)ofs,
+		.len = (unsigned long)len,
+		.tag = tag,
+	};
+	return ioctl(fd, PNVL_IOCTL_RECV_REG, &data);
+}
+
+int pnvl_send_file_tag(int fd, int file_fd, off_t ofs, size_t len,
+		pnvl_tag_t tag)
+{
+	struct pnvl_file_data data = {
+		.fd = file_fd,
+		.ofs = (unsigned long)ofs,
+		.len = (unsigned long)len,
+		.tag = tag,
+	};
+	return ioctl(fd, PNVL_IOCTL_SEND_FILE, &data);
+}
+
+int pnvl_recv_file_tag(int fd, int file_fd, off_t ofs, size_t len,
+		pnvl_tag_t tag)
+{
+	struct pnvl_file_data data = {
+		.fd = file_fd,
+		.ofs = (unsigned long)ofs,
+		.len = (unsigned long)len,
+		.tag = tag,
+	};
+	return ioctl(fd, PNVL_IOCTL_RECV_FILE, &data);
+}
+
+int pnvl_recv_tag(int fd, void *addr, size_t len, pnvl_tag_t tag)
 {
 	struct pnvl_data data = {
 		.addr = (unsigned long)addr,
 		.len = (unsigned long)len,
+		.tag = tag,
 	};
 	return ioctl(fd, PNVL_IOCTL_RECV, &data);
 }
 
+int pnvl_send(int fd, void *addr, size_t len)
+{
+	return pnvl_send_tag(fd, addr, len, 0);
+}
+
+int pnvl_recv(int fd, void *addr, size_t len)
+{
+	return pnvl_recv_tag(fd, addr, len, PNVL_TAG_ANY);
+}
+
+/*
+ * Ops on this memory skip pinning and mapping, but only through fd. The
+ * length is rounded up to whole pages by the kernel.
+ */
+void *pnvl_alloc(int fd, size_t len)
+{
+	void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+int pnvl_free(void *addr, size_t len)
+{
+	return munmap(addr, len);
+}
+
+int pnvl_reg_buf(int fd, void *addr, size_t len)
+{
+	struct pnvl_reg reg = {
+		.addr = (unsigned long)addr,
+		.len = (unsigned long)len,
+	};
+	return ioctl(fd, PNVL_IOCTL_REG_BUF, &reg);
+}
+
+int pnvl_unreg_buf(int fd, pnvl_key_t key)
+{
+	return ioctl(fd, PNVL_IOCTL_UNREG_BUF, key);
+}
+
+int pnvl_export_buf(int fd, pnvl_key_t key)
+{
+	return ioctl(fd, PNVL_IOCTL_EXPORT_BUF, key);
+}
+
+int pnvl_import_buf(int fd, int dmabuf_fd)
+{
+	return ioctl(fd, PNVL_IOCTL_IMPORT_BUF, dmabuf_fd);
+}
+
 int pnvl_wait(int fd, pnvl_handle_t id)
 {
 	return ioctl(fd, PNVL_IOCTL_WAIT, id);
 }
 
+void pnvl_prep_uring(struct io_uring_sqe *sqe, int fd, unsigned int cmd,
+		void *addr, size_t len, pnvl_tag_t tag)
+{
+	struct pnvl_uring_cmd data = {
+		.addr = (unsigned long)addr,
+		.tag = tag,
+	};
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = fd;
+	sqe->cmd_op = cmd;
+	sqe->len = (unsigned int)len;
+	memcpy(sqe->cmd, &data, sizeof(data));
+}
+
+void pnvl_vec_set(struct pnvl_vec *vec, unsigned long cmd, void *addr,
+		size_t len, pnvl_tag_t tag)
+{
+	vec->cmd = cmd;
+	vec->addr = (unsigned long)addr;
+	vec->len = (unsigned long)len;
+	vec->tag = tag;
+}
+
+int pnvl_submitv(int fd, struct pnvl_vec *vec, int cnt)
+{
+	struct pnvl_vecs vecs = {
+		.vec = (unsigned long)vec,
+		.cnt = (unsigned long)cnt,
+		.flags = 0,
+	};
+	return ioctl(fd, PNVL_IOCTL_SUBMITV, &vecs);
+}
+
+int pnvl_waitv(int fd, struct pnvl_vec *vec, int cnt, int any)
+{
+	struct pnvl_vecs vecs = {
+		.vec = (unsigned long)vec,
+		.cnt = (unsigned long)cnt,
+		.flags = any ? PNVL_WAIT_ANY : 0,
+	};
+	return ioctl(fd, PNVL_IOCTL_WAITV, &vecs);
+}
+
+int pnvl_notify(int fd, pnvl_handle_t id, int efd)
+{
+	struct pnvl_notify notify = {
+		.id = id,
+		.efd = efd,
+	};
+	return ioctl(fd, PNVL_IOCTL_NOTIFY, &notify);
+}
+
+int pnvl_done(int fd, pnvl_handle_t *ids, int max)
+{
+	ssize_t rv = read(fd, ids, max * sizeof(pnvl_handle_t));
+
+	return rv < 0 ? -1 : (int)(rv / sizeof(pnvl_handle_t));
+}
+
 int pnvl_flush(int fd)
 {
 	return ioctl(fd, PNVL_IOCTL_FLUSH);
 }
 
+int pnvl_set_spin(int fd, unsigned long us)
+{
+	return ioctl(fd, PNVL_IOCTL_SPIN, us);
+}
+
 int pnvl_send_args(int fd, int sz_n, int sz_t, int sz_m, int len, int ofs)
 {
 	int params[5] = { sz_n, sz_t, sz_m, len, ofs };
-	return pnvl_send(fd, params, sizeof(params));
+	return pnvl_send_tag(fd, params, sizeof(params),
+			PNVL_TAG_ARGS | PNVL_PRIO_LATENCY);
 }
 
 int pnvl_recv_args(int fd, int *sz_n, int *sz_t, int *sz_m, int *len, int *ofs)
 {
 	int rv, params[5];
 
-	rv = pnvl_recv(fd, params, sizeof(params));
+	rv = pnvl_recv_tag(fd, params, sizeof(params),
+			PNVL_TAG_ARGS | PNVL_PRIO_LATENCY);
 	*sz_n = params[0];
 	*sz_t = params[1];
 	*sz_m = params[2];
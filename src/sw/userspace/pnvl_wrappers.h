@@ -1,3 +1,5 @@
+#include <sys/ioctl.h>
+#include <sys/types.h>
 #include "sw/module/pnvl_ioctl.h"
 
 #define WAIT_ALL_OPS 1
@@ -5,6 +7,14 @@
 // d = dev num, n = total elems, t = total devs
 #define PART_FOR_DEV(d, n, t) ((n / t) + (d < (n % t)))
 
+// message tags used by master-mm and chiplet-mm
+#define PNVL_TAG_ARGS 1
+#define PNVL_TAG_A 2
+#define PNVL_TAG_B 3
+#define PNVL_TAG_C 4
+
+struct io_uring_sqe;
+
 struct pnvl_devices {
 	int num;
 	int *fds;
@@ -15,10 +25,50 @@ int pnvl_num_devs(void);
 int pnvl_open_devs(void);
 int pnvl_close_devs(void);
 int pnvl_wait(int fd, pnvl_handle_t id);
+int pnvl_notify(int fd, pnvl_handle_t id, int efd);
+void pnvl_vec_set(struct pnvl_vec *vec, unsigned long cmd, void *addr,
+		size_t len, pnvl_tag_t tag);
+// returns how many ops were issued, handles are left in vec
+int pnvl_submitv(int fd, struct pnvl_vec *vec, int cnt);
+// returns the index of the op waited for if any, results are left in vec
+int pnvl_waitv(int fd, struct pnvl_vec *vec, int cnt, int any);
+// handles of finished ops issued through fd, returns how many (at most max)
+int pnvl_done(int fd, pnvl_handle_t *ids, int max);
 int pnvl_flush(int fd);
+// cap how long pnvl_wait spins before sleeping, PNVL_SPIN_DEFAULT for the
+// module default
+int pnvl_set_spin(int fd, unsigned long us);
+
+// memory already mapped for device fd, NULL on error
+void *pnvl_alloc(int fd, size_t len);
+int pnvl_free(void *addr, size_t len);
+
+// fill an io_uring SQE for cmd (PNVL_IOCTL_SEND, RECV...), see pnvl_ioctl.h
+void pnvl_prep_uring(struct io_uring_sqe *sqe, int fd, unsigned int cmd,
+		void *addr, size_t len, pnvl_tag_t tag);
+
+// returns a key for the buffer if return value is non-negative
+int pnvl_reg_buf(int fd, void *addr, size_t len);
+int pnvl_unreg_buf(int fd, pnvl_key_t key);
+// returns a dma-buf fd of a registered buffer if non-negative
+int pnvl_export_buf(int fd, pnvl_key_t key);
+// returns a key for the dma-buf if return value is non-negative
+int pnvl_import_buf(int fd, int dmabuf_fd);
 
 // these return a handle if return value is non-negative
 int pnvl_send(int fd, void *addr, size_t len);
 int pnvl_recv(int fd, void *addr, size_t len);
+int pnvl_send_tag(int fd, void *addr, size_t len, pnvl_tag_t tag);
+int pnvl_send_delta_tag(int fd, void *addr, size_t len, pnvl_tag_t tag);
+int pnvl_recv_tag(int fd, void *addr, size_t len, pnvl_tag_t tag);
+int pnvl_send_reg_tag(int fd, pnvl_key_t key, size_t ofs, size_t len,
+		pnvl_tag_t tag);
+int pnvl_recv_reg_tag(int fd, pnvl_key_t key, size_t ofs, size_t len,
+		pnvl_tag_t tag);
+// ranges of the file open as file_fd, moved through its page cache
+int pnvl_send_file_tag(int fd, int file_fd, off_t ofs, size_t len,
+		pnvl_tag_t tag);
+int pnvl_recv_file_tag(int fd, int file_fd, off_t ofs, size_t len,
+		pnvl_tag_t tag);
 int pnvl_send_args(int fd, int sz_n, int sz_t, int sz_m, int len, int ofs);
 int pnvl_recv_args(int fd, int *sz_n, int *sz_t, int *sz_m, int *len, int *ofs);
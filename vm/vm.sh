@@ -10,13 +10,14 @@ instances=1
 server=off
 port_base=9990
 debug_dev=off
+link_args=""
 
 # disk params
 disk="vda.img"
 ronly=on
 lock=off
 
-while getopts "Ddsp:n:mMu" opt; do
+while getopts "Ddsp:n:mMub:l:j:c:L:S:w:x:" opt; do
 	case "$opt" in
 		D) # DEBUG QEMU
 			debug_qemu="-s"
@@ -53,6 +54,30 @@ while getopts "Ddsp:n:mMu" opt; do
 			lock=on
 			mode="maintenance"
 			;;
+		b) # MODELED LINK BANDWIDTH (bytes per second)
+			link_args="$link_args,bandwidth=$OPTARG"
+			;;
+		l) # MODELED LINK LATENCY (nanoseconds per message)
+			link_args="$link_args,latency=$OPTARG"
+			;;
+		j) # MODELED LINK JITTER (max. nanoseconds per message)
+			link_args="$link_args,jitter=$OPTARG"
+			;;
+		c) # CLOCK USED BY THE LINK MODEL (host or virtual)
+			link_args="$link_args,link_clock=$OPTARG"
+			;;
+		L) # NUMBER OF BULK LANES ON THE LINK
+			link_args="$link_args,lanes=$OPTARG"
+			;;
+		S) # NUMBER OF PARALLEL SOCKETS ON THE LINK
+			link_args="$link_args,streams=$OPTARG"
+			;;
+		w) # NUMBER OF DMA THREADS MOVING A LARGE SEND
+			link_args="$link_args,dma_workers=$OPTARG"
+			;;
+		x) # DEDUP CACHE ENTRIES PER LINK STREAM (0 disables it)
+			link_args="$link_args,dedup=$OPTARG"
+			;;
 		u) # UPDATE DISK IMAGE
 			./manage-disk.sh -iur
 			exit 0
@@ -68,7 +93,7 @@ shift $((OPTIND-1))
 args=""
 for i in $(seq 1 $instances); do
 	port=$((port_base + i))
-	args="$args -device pnvl,server_mode=$server,port=$port"
+	args="$args -device pnvl,server_mode=$server,port=$port$link_args"
 done
 
 #qemu-system-riscv64 \